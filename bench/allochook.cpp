@@ -0,0 +1,103 @@
+/*
+ * Global operator new / delete of the benchmark, reporting every heap
+ * allocation of the process to AllocationTracker: the heaps, buckets and
+ * vectors of the strategies included, without touching their containers.
+ * Each block carries its size in a header in front of the user pointer, so
+ * unsized deletes are accounted exactly as well.
+ * Only bench links it; go and the tests keep the standard operators.
+ */
+#include <cstdlib>
+#include <new>
+
+#include "alloctrack.h"
+
+
+namespace {
+
+constexpr size_t DEFAULT_ALIGNMENT = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+// Header of at least one size_t, a multiple of the alignment.
+constexpr size_t headerSize(size_t alignment) {
+    return alignment < sizeof(size_t) ? sizeof(size_t) : alignment;
+}
+
+void* allocate(size_t size, size_t alignment) noexcept {
+    size_t header = headerSize(alignment);
+    void* block = alignment > DEFAULT_ALIGNMENT
+        ? std::aligned_alloc(alignment, (header + size + alignment - 1) / alignment * alignment)
+        : std::malloc(header + size);
+    if (block == nullptr) {
+        return nullptr;
+    }
+    char* user = static_cast<char*>(block) + header;
+    reinterpret_cast<size_t*>(user)[-1] = size;
+    AllocationTracker::allocated(size);
+    return user;
+}
+
+void release(void* pointer, size_t alignment) noexcept {
+    if (pointer == nullptr) {
+        return;
+    }
+    char* user = static_cast<char*>(pointer);
+    AllocationTracker::freed(reinterpret_cast<size_t*>(user)[-1]);
+    std::free(user - headerSize(alignment));
+}
+
+void* allocateOrThrow(size_t size, size_t alignment) {
+    for (;;) {
+        if (void* pointer = allocate(size, alignment)) {
+            return pointer;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+} // namespace
+
+
+void* operator new(size_t size) { return allocateOrThrow(size, DEFAULT_ALIGNMENT); }
+void* operator new[](size_t size) { return allocateOrThrow(size, DEFAULT_ALIGNMENT); }
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return allocate(size, DEFAULT_ALIGNMENT); }
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return allocate(size, DEFAULT_ALIGNMENT); }
+void* operator new(size_t size, std::align_val_t alignment) {
+    return allocateOrThrow(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return allocateOrThrow(size, static_cast<size_t>(alignment));
+}
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocate(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* pointer) noexcept { release(pointer, DEFAULT_ALIGNMENT); }
+void operator delete[](void* pointer) noexcept { release(pointer, DEFAULT_ALIGNMENT); }
+void operator delete(void* pointer, size_t) noexcept { release(pointer, DEFAULT_ALIGNMENT); }
+void operator delete[](void* pointer, size_t) noexcept { release(pointer, DEFAULT_ALIGNMENT); }
+void operator delete(void* pointer, const std::nothrow_t&) noexcept { release(pointer, DEFAULT_ALIGNMENT); }
+void operator delete[](void* pointer, const std::nothrow_t&) noexcept { release(pointer, DEFAULT_ALIGNMENT); }
+void operator delete(void* pointer, std::align_val_t alignment) noexcept {
+    release(pointer, static_cast<size_t>(alignment));
+}
+void operator delete[](void* pointer, std::align_val_t alignment) noexcept {
+    release(pointer, static_cast<size_t>(alignment));
+}
+void operator delete(void* pointer, size_t, std::align_val_t alignment) noexcept {
+    release(pointer, static_cast<size_t>(alignment));
+}
+void operator delete[](void* pointer, size_t, std::align_val_t alignment) noexcept {
+    release(pointer, static_cast<size_t>(alignment));
+}
+void operator delete(void* pointer, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    release(pointer, static_cast<size_t>(alignment));
+}
+void operator delete[](void* pointer, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    release(pointer, static_cast<size_t>(alignment));
+}
@@ -0,0 +1,541 @@
+/*
+ * Benchmark harness of the processImage strategies, built by "make bench".
+ *
+ *   bench [--sizes 100,200,400,800] [--topn-steps 10] [--warmup 2] [--reps 10]
+ *         [--strategies HeapBest,ParallelV512,...|all] [--csv matrix_data.csv] [--json <path>]
+ *         [--counters on|off] [--trace <path>] [--scratch shared|fresh]
+ *
+ * --strategies takes the Strategy names of processImage (the default set)
+ * and any other processImage* member by its name without the prefix: Sort,
+ * Heap, SetNice, CS_MAP, ParallelV16, ParallelNoTiling, ... (BENCH_METHODS);
+ * "all" runs every one of them.
+ *
+ * Every (image class, size, topN, method) runs warmup untimed times, then
+ * reps timed times on a fresh ImageProcessor (steady_clock). Reported: the
+ * median, p90 and p99 (nearest rank) in ms, pixels per second and GB/s of
+ * pixel bytes read, both from the median. Memory comes from the counting
+ * operator new of allochook.cpp and TrackingMatAllocator: exact bytes per
+ * call, the peak of the worst run, the total and allocation count of the
+ * median one. With perf_event_open permitted,
+ * the median per run of the hardware counters of perfcounters.h as well;
+ * without, those columns stay empty (null in the JSON).
+ *
+ * The CSV keeps the columns of the former simulate() output, so
+ * tools/train_strategy_tree reads it as before:
+ *   Type,Dimension,topN,IDMethod,ExecTime,MemUsed,Cost,Method,Reps,Median,P90,P99,PixelsPerSec,GBPerSec,
+ *   Cycles,Instructions,L1DMisses,LLCMisses,BranchMisses,DTLBMisses,
+ *   PeakBytes,TotalBytes,Allocations
+ * --trace records the timeline of every run (trace.h) into one Chrome
+ * trace_event JSON file.
+ * The processors of a measure share one ScratchArena (scratch.h), as the
+ * processors of a service do: the warmups grow it and the reps see the steady
+ * state. --scratch fresh gives every run its own arena, the cold cost.
+ * IDMethod is the Strategy index, -1 for the members processImage never
+ * picks (train_strategy_tree leaves them out), ExecTime and Cost the median
+ * in ms, MemUsed the peak in KB.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <opencv2/opencv.hpp>
+
+#include "alloctrack.h"
+#include "image.h"
+#include "processor.h"
+#include "selector.h"
+#include "threadpool.h"
+#include "trace.h"
+#include "utils.h"
+
+#include "perfcounters.h"
+
+
+namespace {
+
+/*
+ * ********************************
+ *   Synthetic images
+ * ********************************
+ */
+cv::Mat generateMatrixUniform(size_t size) {
+    cv::Mat image(size, size, CV_8UC1);
+
+    for (size_t i = 0; i < size; ++i) {
+        for (size_t j = 0; j < size; ++j) {
+            image.at<uchar>(i, j) = 17;
+        }
+    }
+
+    return image;
+}
+
+cv::Mat generateMatrix(size_t size) {
+    cv::Mat image(size, size, CV_16U);
+
+    for (size_t i = 0; i < size; ++i) {
+        for (size_t j = 0; j < size; ++j) {
+            uint16_t value = static_cast<uint16_t>(rand() % 65536); // 2^16 = 65536
+            image.at<uint16_t>(i, j) = value;
+        }
+    }
+
+    return image;
+}
+
+cv::Mat generateMatrixSort(size_t size, int increment) {
+    uint16_t start = 0;
+    cv::Mat image(size, size, CV_16U);
+
+    if(increment < 0) start = size * size - 1;
+    for (size_t i = 0; i < size; ++i) {
+        for (size_t j = 0; j < size; ++j) {
+            image.at<uint16_t>(j, i) = start;
+            start += increment;
+        }
+    }
+
+    return image;
+}
+
+cv::Mat generateMatrixSortA(size_t size) {
+    return generateMatrixSort(size, 1);
+}
+cv::Mat generateMatrixSortD(size_t size) {
+    return generateMatrixSort(size, -1);
+}
+
+cv::Mat generateMatrixWithDistribution(size_t size) {
+    size_t regionsX = 4; // nb region per h.
+    size_t regionsY = 4; // nb region per v.
+
+    return generateMatrixWithVariableRegions(size, regionsX, regionsY);
+}
+
+std::vector<size_t> generateTopNValues(size_t size, size_t steps) {
+    size_t totalPixels = size * size;
+    std::vector<size_t> topNValues;
+    double startPercentage = 0.001; // Start cu 0.1%
+    double endPercentage = 0.999;   // End cu 99.9%
+    double step = steps > 1 ? (endPercentage - startPercentage) / (steps - 1) : 0;
+
+    for (size_t i = 0; i < steps; ++i) {
+        double currentPercentage = startPercentage + step * i;
+        topNValues.push_back(std::max<size_t>(1, static_cast<size_t>(currentPercentage * totalPixels)));
+    }
+
+    return topNValues;
+}
+
+using MatrixGeneratorFunc = std::function<cv::Mat(size_t)>;
+
+// In Type order of the CSV
+const std::vector<std::pair<MatrixGeneratorFunc, std::string>> MATRIX_GENERATORS = {
+    {generateMatrix, "random Matrix"},
+    {generateMatrixSortA, "Sorted Ascending"},
+    {generateMatrixSortD, "Sorted Descending"},
+    {generateMatrixWithDistribution, "With Specific Distribution"},
+    {generateMatrixUniform, "Uniform Distribution"}
+};
+
+
+/*
+ * ********************************
+ *   Methods
+ * ********************************
+ */
+using Processor = ImageProcessor<uint16_t>;
+
+// A processImage* member under its bench name; id is the IDMethod of the CSV.
+struct BenchMethod {
+    std::string name;
+    int id;
+    std::function<std::vector<PixelCoord>(Processor&, size_t)> run;
+};
+
+BenchMethod strategyMethod(Strategy strategy) {
+    return {strategyName(strategy), static_cast<int>(strategy),
+            [strategy](Processor& ip, size_t topN) { return ip.runStrategy(strategy, topN); }};
+}
+
+BenchMethod memberMethod(const std::string& name, std::vector<PixelCoord> (Processor::*member)(size_t)) {
+    return {name, -1, [member](Processor& ip, size_t topN) { return (ip.*member)(topN); }};
+}
+
+// The strategies of processImage in Strategy order, then the rest of the
+// family; processImageCS is the CountingSort strategy.
+const std::vector<BenchMethod> BENCH_METHODS = [] {
+    std::vector<BenchMethod> methods;
+    for (size_t s = 0; s < STRATEGY_COUNT; ++s) {
+        methods.push_back(strategyMethod(static_cast<Strategy>(s)));
+    }
+    for (const BenchMethod& method : {
+             memberMethod("Dispatch", &Processor::processImage), // tree or cost model pick
+             memberMethod("Sort", &Processor::processImageSort),
+             memberMethod("PQ", &Processor::processImagePQ),
+             memberMethod("Heap", &Processor::processImageHeap),
+             memberMethod("HeapCopy", &Processor::processImageHeapCopy),
+             memberMethod("HeapNextPixel", &Processor::processImageHeapNextPixel),
+             memberMethod("HeapNextPixelCopy", &Processor::processImageHeapNextPixelCopy),
+             memberMethod("HeapUnrolling", &Processor::processImageHeapUnrolling),
+             memberMethod("HeapBest1", &Processor::processImageHeapBest1),
+             memberMethod("Parallel", &Processor::processImageParallel),
+             memberMethod("ParallelNoTiling", &Processor::processImageParallelNoTiling),
+             BenchMethod{"ParallelWithTiling", -1,
+                         [](Processor& ip, size_t topN) { return ip.processImageParallelWithTiling(topN); }},
+             memberMethod("ParallelV16", &Processor::processImageParallelV16),
+             memberMethod("ParallelV32", &Processor::processImageParallelV32),
+             memberMethod("ParallelV64", &Processor::processImageParallelV64),
+             memberMethod("ParallelV128", &Processor::processImageParallelV128),
+             memberMethod("ParallelV1024", &Processor::processImageParallelV1024),
+             memberMethod("CS_MAP", &Processor::processImageCS_MAP),
+             memberMethod("Set", &Processor::processImageSet),
+             memberMethod("SetNice", &Processor::processImageSetNice),
+             memberMethod("SetCopy", &Processor::processImageSetCopy),
+             memberMethod("SetOld", &Processor::processImageSetOld)}) {
+        methods.push_back(method);
+    }
+    return methods;
+}();
+
+
+/*
+ * ********************************
+ *   Measurement
+ * ********************************
+ */
+struct BenchOptions {
+    std::vector<size_t> sizes = {100, 200, 400, 800};
+    size_t topNSteps = 10;
+    size_t warmup = 2;
+    size_t reps = 10;
+    std::vector<size_t> methods;        // in BENCH_METHODS, the strategies by default
+    std::string csvPath = "matrix_data.csv";
+    std::string jsonPath;               // no JSON without it
+    bool counters = true;
+    std::string tracePath;              // no timeline without it
+    bool sharedScratch = true;
+};
+
+struct BenchResult {
+    size_t type = 0;
+    size_t pixels = 0;
+    size_t topN = 0;
+    size_t method = 0;                  // in BENCH_METHODS
+    size_t reps = 0;
+    double median = 0; // ms
+    double p90 = 0;
+    double p99 = 0;
+    double pixelsPerSec = 0;
+    double gbPerSec = 0;
+    PerfCounters::Reading counters;     // median per run
+    AllocationStats memory;             // peak: worst run, total and count: median
+};
+
+// Nearest rank percentile of sorted samples.
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p * sorted.size()));
+    return sorted[std::min(sorted.size(), std::max<size_t>(rank, 1)) - 1];
+}
+
+// counters: nullptr when they are off or unavailable
+BenchResult measure(IImage<uint16_t>& image, size_t bytesPerPixel, size_t method, size_t topN,
+                    const BenchOptions& options, PerfCounters* counters) {
+    std::vector<double> samples;
+    samples.reserve(options.reps);
+    std::array<std::vector<double>, PerfCounters::EventCount> counts;
+    std::vector<AllocationStats> memory;
+    auto arena = std::make_shared<ScratchArena>();
+    for (size_t r = 0; r < options.warmup + options.reps; ++r) {
+        ImageProcessor<uint16_t> ip(image);
+        ip.invalidateTileSummary(); // kept with the image: every run builds its own
+        if (options.sharedScratch) {
+            ip.setScratchArena(arena);
+        }
+        AllocationScope allocations;
+        if (counters) counters->start();
+        auto start = std::chrono::steady_clock::now();
+        auto topPixels = BENCH_METHODS[method].run(ip, topN);
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        AllocationStats used = allocations.stats();
+        PerfCounters::Reading reading;
+        if (counters) reading = counters->stop();
+        if (r < options.warmup) {
+            continue;
+        }
+        samples.push_back(elapsed.count());
+        memory.push_back(used);
+        for (size_t e = 0; e < PerfCounters::EventCount; ++e) {
+            if (reading.valid[e]) counts[e].push_back(reading.value[e]);
+        }
+    }
+    std::sort(samples.begin(), samples.end());
+
+    BenchResult result;
+    result.pixels = image.size();
+    result.topN = topN;
+    result.method = method;
+    result.reps = samples.size();
+    result.median = percentile(samples, 0.5);
+    result.p90 = percentile(samples, 0.9);
+    result.p99 = percentile(samples, 0.99);
+    double seconds = result.median / 1e3;
+    if (seconds > 0) {
+        result.pixelsPerSec = result.pixels / seconds;
+        result.gbPerSec = result.pixels * bytesPerPixel / seconds / 1e9;
+    }
+    for (const AllocationStats& used : memory) {
+        result.memory.peakBytes = std::max(result.memory.peakBytes, used.peakBytes);
+    }
+    std::sort(memory.begin(), memory.end(),
+              [](const AllocationStats& a, const AllocationStats& b) { return a.totalBytes < b.totalBytes; });
+    result.memory.totalBytes = memory[(memory.size() - 1) / 2].totalBytes;
+    result.memory.allocations = memory[(memory.size() - 1) / 2].allocations;
+    for (size_t e = 0; e < PerfCounters::EventCount; ++e) {
+        if (counts[e].size() == samples.size()) { // counted in every run
+            std::sort(counts[e].begin(), counts[e].end());
+            result.counters.value[e] = percentile(counts[e], 0.5);
+            result.counters.valid[e] = true;
+        }
+    }
+    return result;
+}
+
+void writeCsv(const std::string& path, const std::vector<BenchResult>& results) {
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open " + path);
+    }
+    file << "Type,Dimension,topN,IDMethod,ExecTime,MemUsed,Cost,Method,Reps,Median,P90,P99,PixelsPerSec,GBPerSec";
+    for (size_t e = 0; e < PerfCounters::EventCount; ++e) {
+        file << "," << PerfCounters::name(static_cast<PerfCounters::Event>(e));
+    }
+    file << ",PeakBytes,TotalBytes,Allocations\n" << std::setprecision(6);
+    for (const BenchResult& r : results) {
+        const BenchMethod& method = BENCH_METHODS[r.method];
+        file << r.type << "," << r.pixels << "," << r.topN << "," << method.id << ","
+             << r.median << "," << r.memory.peakBytes / 1024.0 << "," << r.median << "," << method.name
+             << "," << r.reps << ","
+             << r.median << "," << r.p90 << "," << r.p99 << "," << r.pixelsPerSec << "," << r.gbPerSec;
+        for (size_t e = 0; e < PerfCounters::EventCount; ++e) {
+            file << ",";
+            if (r.counters.valid[e]) file << std::fixed << std::setprecision(0) << r.counters.value[e]
+                                          << std::defaultfloat << std::setprecision(6);
+        }
+        file << "," << r.memory.peakBytes << "," << r.memory.totalBytes << "," << r.memory.allocations << "\n";
+    }
+}
+
+void writeJson(const std::string& path, const std::vector<BenchResult>& results) {
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open " + path);
+    }
+    file << std::setprecision(6) << "[\n";
+    for (size_t i = 0; i < results.size(); ++i) {
+        const BenchResult& r = results[i];
+        file << "  {\"type\": " << r.type << ", \"type_name\": \"" << MATRIX_GENERATORS[r.type].second
+             << "\", \"pixels\": " << r.pixels << ", \"top_n\": " << r.topN
+             << ", \"method\": \"" << BENCH_METHODS[r.method].name << "\", \"id_method\": "
+             << BENCH_METHODS[r.method].id << ", \"reps\": " << r.reps << ", \"median_ms\": " << r.median
+             << ", \"p90_ms\": " << r.p90 << ", \"p99_ms\": " << r.p99 << ", \"pixels_per_sec\": "
+             << r.pixelsPerSec << ", \"gb_per_sec\": " << r.gbPerSec << ", \"peak_bytes\": "
+             << r.memory.peakBytes << ", \"total_bytes\": " << r.memory.totalBytes << ", \"allocations\": "
+             << r.memory.allocations;
+        for (size_t e = 0; e < PerfCounters::EventCount; ++e) {
+            file << ", \"" << PerfCounters::name(static_cast<PerfCounters::Event>(e)) << "\": ";
+            if (r.counters.valid[e]) {
+                file << std::fixed << std::setprecision(0) << r.counters.value[e] << std::defaultfloat
+                     << std::setprecision(6);
+            } else {
+                file << "null";
+            }
+        }
+        file << "}"
+             << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    file << "]\n";
+}
+
+
+// IPC and misses per 1000 instructions, the numbers that tell heap branch
+// mispredicts from bucket cache misses.
+void printCounters(const PerfCounters::Reading& c) {
+    using E = PerfCounters;
+    if (c.valid[E::Cycles] && c.valid[E::Instructions] && c.value[E::Cycles] > 0) {
+        std::cout << ", IPC " << std::setprecision(2) << c.value[E::Instructions] / c.value[E::Cycles];
+    }
+    if (!c.valid[E::Instructions] || c.value[E::Instructions] <= 0) {
+        return;
+    }
+    double perKilo = 1000 / c.value[E::Instructions];
+    for (E::Event e : {E::BranchMisses, E::L1DMisses, E::LLCMisses, E::DTLBMisses}) {
+        if (c.valid[e]) {
+            std::cout << ", " << E::name(e) << "/ki " << std::setprecision(2) << c.value[e] * perKilo;
+        }
+    }
+}
+
+
+/*
+ * ********************************
+ *   Command line
+ * ********************************
+ */
+std::vector<std::string> splitList(const std::string& text) {
+    std::vector<std::string> parts;
+    std::stringstream stream(text);
+    std::string part;
+    while (std::getline(stream, part, ',')) {
+        if (!part.empty()) parts.push_back(part);
+    }
+    return parts;
+}
+
+size_t parseMethod(const std::string& name) {
+    for (size_t m = 0; m < BENCH_METHODS.size(); ++m) {
+        if (name == BENCH_METHODS[m].name) {
+            return m;
+        }
+    }
+    throw std::runtime_error("Unknown strategy: " + name);
+}
+
+BenchOptions parseOptions(int argc, char** argv) {
+    BenchOptions options;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            throw std::runtime_error("Missing value of " + arg);
+        }
+        std::string value = argv[++i];
+        if (arg == "--sizes") {
+            options.sizes.clear();
+            for (const std::string& size : splitList(value)) options.sizes.push_back(std::stoul(size));
+        } else if (arg == "--topn-steps") {
+            options.topNSteps = std::stoul(value);
+        } else if (arg == "--warmup") {
+            options.warmup = std::stoul(value);
+        } else if (arg == "--reps") {
+            options.reps = std::stoul(value);
+        } else if (arg == "--strategies") {
+            options.methods.clear();
+            for (const std::string& name : splitList(value)) {
+                if (name == "all") {
+                    for (size_t m = 0; m < BENCH_METHODS.size(); ++m) options.methods.push_back(m);
+                } else {
+                    options.methods.push_back(parseMethod(name));
+                }
+            }
+        } else if (arg == "--csv") {
+            options.csvPath = value;
+        } else if (arg == "--json") {
+            options.jsonPath = value;
+        } else if (arg == "--trace") {
+            options.tracePath = value;
+        } else if (arg == "--counters") {
+            if (value != "on" && value != "off") {
+                throw std::runtime_error("--counters takes on or off");
+            }
+            options.counters = value == "on";
+        } else if (arg == "--scratch") {
+            if (value != "shared" && value != "fresh") {
+                throw std::runtime_error("--scratch takes shared or fresh");
+            }
+            options.sharedScratch = value == "shared";
+        } else {
+            throw std::runtime_error("Unknown option: " + arg);
+        }
+    }
+    if (options.reps == 0 || options.topNSteps == 0) {
+        throw std::runtime_error("--reps and --topn-steps must be at least 1");
+    }
+    if (options.methods.empty()) {
+        for (size_t s = 0; s < STRATEGY_COUNT; ++s) options.methods.push_back(s);
+    }
+    return options;
+}
+
+} // namespace
+
+
+int main(int argc, char** argv) {
+    try {
+        BenchOptions options = parseOptions(argc, argv);
+        std::vector<BenchResult> results;
+
+        cv::Mat::setDefaultAllocator(&TrackingMatAllocator::instance());
+        if (!options.tracePath.empty()) {
+            TraceRecorder::instance().start();
+        }
+
+        // Counters follow the pool workers: start them first
+        ThreadPool::instance();
+        std::unique_ptr<PerfCounters> counters;
+        if (options.counters) {
+            counters = std::make_unique<PerfCounters>();
+            if (!counters->available()) {
+                std::cout << "Hardware counters unavailable (" << counters->error()
+                          << "), timing only. See /proc/sys/kernel/perf_event_paranoid.\n";
+                counters.reset();
+            } else if (!counters->error().empty()) {
+                std::cout << "Some hardware counters unavailable: " << counters->error() << "\n";
+            }
+        }
+
+        for (size_t type = 0; type < MATRIX_GENERATORS.size(); ++type) {
+            const auto& [generate, description] = MATRIX_GENERATORS[type];
+            std::cout << "\n" << description << "\n";
+
+            for (size_t size : options.sizes) {
+                cv::Mat image = generate(size);
+                ImageWrapper<uint16_t> wrapper(image);
+
+                for (size_t topN : generateTopNValues(size, options.topNSteps)) {
+                    for (size_t method : options.methods) {
+                        BenchResult result = measure(wrapper, image.elemSize(), method, topN, options,
+                                                     counters.get());
+                        result.type = type;
+                        results.push_back(result);
+                        std::cout << std::fixed << std::setprecision(3) << "size " << size << ", topN " << topN
+                                  << ", " << BENCH_METHODS[method].name << ": median " << result.median << " ms, p90 "
+                                  << result.p90 << " ms, p99 " << result.p99 << " ms, " << std::setprecision(2)
+                                  << result.pixelsPerSec / 1e6 << " Mpx/s, " << result.gbPerSec << " GB/s, peak "
+                                  << result.memory.peakBytes / 1024.0 << " KB in " << result.memory.allocations
+                                  << " allocations";
+                        printCounters(result.counters);
+                        std::cout << "\n";
+                    }
+                }
+            }
+        }
+
+        writeCsv(options.csvPath, results);
+        std::cout << "\n" << results.size() << " configurations written to " << options.csvPath;
+        if (!options.jsonPath.empty()) {
+            writeJson(options.jsonPath, results);
+            std::cout << " and " << options.jsonPath;
+        }
+        std::cout << "\n";
+        if (!options.tracePath.empty()) {
+            TraceRecorder& trace = TraceRecorder::instance();
+            trace.stop();
+            trace.writeJson(options.tracePath);
+            std::cout << trace.eventCount() << " trace events (" << trace.droppedCount() << " dropped) written to "
+                      << options.tracePath << "\n";
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error occurred: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
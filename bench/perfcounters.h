@@ -0,0 +1,169 @@
+#pragma once
+
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <dirent.h>
+#include <string>
+#include <vector>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+
+/*
+ * Hardware counters of the whole process around a region, through
+ * perf_event_open (Linux). A counter is opened on every thread that exists
+ * when the set is created, so the ThreadPool must be started before: the
+ * strategies run most of their work on its workers. User space only
+ * (exclude_kernel), which perf_event_paranoid <= 2 permits.
+ *
+ * Degrades gracefully: an event the kernel or the CPU refuses (no PMU in a
+ * VM, paranoid 3, seccomp) is left out and reads as unavailable; available()
+ * is false when none could be opened, error() tells why.
+ */
+class PerfCounters {
+public:
+    enum Event { Cycles, Instructions, L1DMisses, LLCMisses, BranchMisses, DTLBMisses, EventCount };
+
+    static const char* name(Event event) {
+        static const char* const NAMES[EventCount] = {
+            "Cycles", "Instructions", "L1DMisses", "LLCMisses", "BranchMisses", "DTLBMisses"
+        };
+        return NAMES[event];
+    }
+
+    struct Reading {
+        std::array<double, EventCount> value{}; // scaled for multiplexing
+        std::array<bool, EventCount> valid{};
+    };
+
+    PerfCounters() {
+        std::vector<pid_t> threads = processThreads();
+        for (int e = 0; e < EventCount; ++e) {
+            perf_event_attr attr = attributes(static_cast<Event>(e));
+            std::vector<int> opened;
+            for (pid_t tid : threads) {
+                int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, tid, -1, -1, 0));
+                if (fd < 0) {
+                    if (errno != ESRCH) { // a thread that just exited is fine
+                        if (lastError.empty()) {
+                            lastError = std::string(name(static_cast<Event>(e))) + ": " + std::strerror(errno);
+                        }
+                        closeAll(opened);
+                        opened.clear();
+                        break;
+                    }
+                    continue;
+                }
+                opened.push_back(fd);
+            }
+            fds[e] = opened;
+        }
+    }
+
+    ~PerfCounters() {
+        for (auto& perEvent : fds) {
+            closeAll(perEvent);
+        }
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available() const {
+        for (const auto& perEvent : fds) {
+            if (!perEvent.empty()) return true;
+        }
+        return false;
+    }
+
+    // First refusal of the kernel, empty when every event opened.
+    const std::string& error() const { return lastError; }
+
+    void start() {
+        forEachFd([](int fd) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        });
+    }
+
+    Reading stop() {
+        forEachFd([](int fd) { ioctl(fd, PERF_EVENT_IOC_DISABLE, 0); });
+        Reading reading;
+        for (int e = 0; e < EventCount; ++e) {
+            if (fds[e].empty()) continue;
+            double total = 0;
+            bool counted = false;
+            for (int fd : fds[e]) {
+                uint64_t data[3] = {}; // value, time enabled, time running
+                if (read(fd, data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)) || data[2] == 0) {
+                    continue;
+                }
+                total += static_cast<double>(data[0]) * data[1] / data[2];
+                counted = true;
+            }
+            reading.value[e] = total;
+            reading.valid[e] = counted;
+        }
+        return reading;
+    }
+
+private:
+    std::array<std::vector<int>, EventCount> fds;
+    std::string lastError;
+
+    static perf_event_attr attributes(Event event) {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        auto cacheMiss = [&](uint64_t cache) {
+            attr.type = PERF_TYPE_HW_CACHE;
+            attr.config = cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        };
+        switch (event) {
+            case Cycles:       attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_CPU_CYCLES; break;
+            case Instructions: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_INSTRUCTIONS; break;
+            case BranchMisses: attr.type = PERF_TYPE_HARDWARE; attr.config = PERF_COUNT_HW_BRANCH_MISSES; break;
+            case L1DMisses:    cacheMiss(PERF_COUNT_HW_CACHE_L1D); break;
+            case LLCMisses:    cacheMiss(PERF_COUNT_HW_CACHE_LL); break;
+            case DTLBMisses:   cacheMiss(PERF_COUNT_HW_CACHE_DTLB); break;
+            default: break;
+        }
+        return attr;
+    }
+
+    static std::vector<pid_t> processThreads() {
+        std::vector<pid_t> threads;
+        if (DIR* dir = opendir("/proc/self/task")) {
+            while (dirent* entry = readdir(dir)) {
+                if (entry->d_name[0] != '.') {
+                    threads.push_back(static_cast<pid_t>(std::stol(entry->d_name)));
+                }
+            }
+            closedir(dir);
+        }
+        if (threads.empty()) {
+            threads.push_back(0); // the calling thread
+        }
+        return threads;
+    }
+
+    static void closeAll(const std::vector<int>& perEvent) {
+        for (int fd : perEvent) close(fd);
+    }
+
+    template<typename F>
+    void forEachFd(F f) {
+        for (const auto& perEvent : fds) {
+            for (int fd : perEvent) f(fd);
+        }
+    }
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+
+#include <opencv2/opencv.hpp>
+
+
+struct AllocationStats {
+    size_t peakBytes = 0;   // high-water mark above the bytes live at the start
+    size_t totalBytes = 0;  // sum of every allocation, freed or not
+    size_t allocations = 0;
+};
+
+
+/*
+ * Process wide allocation counters. They only move when allocations are
+ * reported: by the global operator new of a binary that installs the
+ * counting hook (bench/allochook.cpp) and by TrackingMatAllocator for
+ * cv::Mat pixels, which OpenCV allocates outside operator new.
+ * Lock free, callable from any thread and from operator new itself.
+ */
+class AllocationTracker {
+public:
+    static void allocated(size_t bytes) noexcept;
+    static void freed(size_t bytes) noexcept;
+
+    static size_t liveBytes() noexcept;
+
+    // True once a counting hook reported anything: without one the
+    // counters read 0 and mean "not measured".
+    static bool active() noexcept;
+};
+
+
+/*
+ * Measures the allocations between its construction and stats(), for
+ * instance one processImage* call. The peak is exact, not a max-RSS delta:
+ * it starts from the live bytes of the scope, whatever ran before.
+ * One scope at a time: opening a scope restarts the shared high-water mark.
+ */
+class AllocationScope {
+public:
+    AllocationScope() noexcept;
+    AllocationStats stats() const noexcept;
+
+private:
+    size_t baseLive;
+    size_t baseTotal;
+    size_t baseCount;
+};
+
+
+/*
+ * cv::MatAllocator reporting the pixel buffers of cv::Mat to
+ * AllocationTracker; the allocation itself is left to the wrapped
+ * allocator (the OpenCV default one). Install with
+ * cv::Mat::setDefaultAllocator(&TrackingMatAllocator::instance()).
+ * Buffers the caller provides (Mat over external data) are not counted.
+ */
+class TrackingMatAllocator : public cv::MatAllocator {
+public:
+    static TrackingMatAllocator& instance();
+
+    explicit TrackingMatAllocator(cv::MatAllocator* inner = cv::Mat::getStdAllocator()) : inner(inner) {}
+
+    cv::UMatData* allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                           cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const override;
+    bool allocate(cv::UMatData* data, cv::AccessFlag accessFlags, cv::UMatUsageFlags usageFlags) const override;
+    void deallocate(cv::UMatData* data) const override;
+
+private:
+    cv::MatAllocator* inner;
+};
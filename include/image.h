@@ -12,6 +12,91 @@
 #include <tuple>
 #include <iostream>
 #include <stdexcept>
+#include <type_traits>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+
+
+/*
+ * Non-virtual description of the contiguous pixel memory behind an image:
+ * row pointer, stride and depth, fetched once per call via IImage::view().
+ * data is nullptr when the image has no raw buffer (e.g. VectorImage),
+ * callers then fall back to the virtual getPixelValue.
+ */
+struct ImageView {
+    const uchar* data = nullptr;
+    size_t rows = 0;
+    size_t cols = 0;
+    size_t stride = 0;  // bytes between the start of two rows
+    int depth = -1;     // OpenCV depth code: CV_8U, CV_16U, CV_32F
+
+    // Samples as stored in a file mapping (mmapreader.h), never rewritten:
+    // big-endian, sign bit flipped (16-bit FITS, BZERO 32768).
+    bool bigEndian = false;
+    bool flipSign = false;
+
+    template<typename P>
+    const P* row(size_t y) const {
+        return reinterpret_cast<const P*>(data + y * stride);
+    }
+
+    size_t sampleSize() const {
+        return depth == CV_16U || depth == CV_16S ? 2 : depth == CV_32F ? 4 : 1;
+    }
+
+    // row() can not be used as is: the samples need decoding, or the rows
+    // are not aligned to the sample size (odd PGM header). Read through
+    // EncodedViewAccessor instead.
+    bool encoded() const {
+        size_t sample = sampleSize();
+        return bigEndian || flipSign
+            || reinterpret_cast<uintptr_t>(data) % sample != 0 || stride % sample != 0;
+    }
+};
+
+
+// Sample of storage type P at p, whatever its alignment and byte order.
+template<typename P>
+inline P loadSample(const uchar* p, bool bigEndian, bool flipSign) {
+    static_assert(sizeof(P) == 1 || sizeof(P) == 2 || sizeof(P) == 4, "8, 16 or 32-bit samples");
+    if constexpr (sizeof(P) == 1) {
+        return static_cast<P>(*p);
+    } else if constexpr (sizeof(P) == 2) {
+        uint16_t bits;
+        std::memcpy(&bits, p, sizeof bits);
+        if (bigEndian) {
+            bits = __builtin_bswap16(bits);
+        }
+        if (flipSign) {
+            bits ^= 0x8000;
+        }
+        P value;
+        std::memcpy(&value, &bits, sizeof value);
+        return value;
+    } else {
+        uint32_t bits;
+        std::memcpy(&bits, p, sizeof bits);
+        if (bigEndian) {
+            bits = __builtin_bswap32(bits);
+        }
+        P value;
+        std::memcpy(&value, &bits, sizeof value);
+        return value;
+    }
+}
+
+
+/*
+ * Data derived from the pixels of an image and kept with them, not with one
+ * processor: the tile summary of processor.h. Images over the same pixel
+ * memory (cache hits, see imagecache.h) share it, so it is built once per
+ * decoded frame. The pixels must not change while it is in use.
+ */
+struct DerivedPixelData {
+    std::mutex mutex;
+    std::shared_ptr<const void> tileSummary; // TileSummary<T> of the image
+};
 
 
 //Interface
@@ -26,13 +111,22 @@ private:
     //IImage() : imgStartPtr(nullptr), imgPtr(nullptr) {}
 
 public:
+    using value_type = T;
+
     explicit IImage(T* ptr) : imgStartPtr(ptr), imgPtr(ptr) {}
 
     virtual T getPixelValue(int x, int y) const = 0;
-    virtual T rows() const = 0;
-    virtual T cols() const = 0;
+    // Geometry does not depend on T, an 8-bit image can be wider than 255.
+    virtual size_t rows() const = 0;
+    virtual size_t cols() const = 0;
     virtual size_t size() const = 0;
 
+    // Raw memory of the image, empty view if there is none.
+    virtual ImageView view() const { return ImageView(); }
+
+    // Shared DerivedPixelData of the pixels, nullptr if the image keeps none.
+    virtual std::shared_ptr<DerivedPixelData> derivedData() const { return nullptr; }
+
     virtual inline T getNextPixelValue() {
         //if (imgPtr != nullptr) {
             return *(imgPtr++);
@@ -44,7 +138,7 @@ public:
         //if (imgPtr != nullptr) {
             return imgPtr;
         //}
-        return T();
+        return nullptr;
     }
     // reset imgPtr 
      virtual void moveToStart(size_t offset = 0) const {
@@ -58,8 +152,8 @@ public:
     // debug only interfaces
     //
     int printImage() const {
-        for (int y = 0; y < this->rows(); ++y) {
-            for (int x = 0; x < this->cols(); ++x) {
+        for (size_t y = 0; y < this->rows(); ++y) {
+            for (size_t x = 0; x < this->cols(); ++x) {
                 std::cout << this->getPixelValue(x, y) << " ";
             }
             std::cout << "\n";
@@ -85,6 +179,11 @@ template<typename T>
 class ImageWrapper : public IImage<T> {
 private:
     cv::Mat image;
+    std::shared_ptr<const void> owner; // keeps external pixel memory alive (file mapping)
+    bool bigEndian = false;
+    bool flipSign = false;
+    bool encoded = false; // view().encoded(), decided once
+    std::shared_ptr<DerivedPixelData> derived = std::make_shared<DerivedPixelData>();
 
 public:
     ImageWrapper(const cv::Mat& img) 
@@ -96,10 +195,31 @@ public:
         }
     }//IImage<uint16_t>(img.isContinuous() ? reinterpret_cast<uint16_t*>(img.data) : nullptr), image(img.isContinuous() ? img : img.clone()) {
 
+    // img points into memory that cv::Mat does not own, e.g. a mapped file:
+    // the wrapper holds memoryOwner for as long as it lives, no copy is made.
+    ImageWrapper(const cv::Mat& img, std::shared_ptr<const void> memoryOwner)
+        : ImageWrapper(img) {
+        owner = std::move(memoryOwner);
+        encoded = view().encoded();
+    }
+
+    // Same, for samples stored big-endian and/or with the sign bit flipped:
+    // they are decoded on every read, the memory is left untouched.
+    ImageWrapper(const cv::Mat& img, std::shared_ptr<const void> memoryOwner,
+                 bool bigEndianSamples, bool flipSignBit)
+        : ImageWrapper(img, std::move(memoryOwner)) {
+        bigEndian = bigEndianSamples;
+        flipSign = flipSignBit;
+        encoded = view().encoded();
+    }
+
     
     T getPixelValue(int x, int y) const {
         if (x < 0 || x >= image.cols || y < 0 || y >= image.rows) {
             throw std::out_of_range("Pixel coordinates out of range");
+        }
+        if (encoded) {
+            return decodedPixel(x, y);
         }
 		switch (image.depth()) {
 			case CV_8U:
@@ -107,6 +227,9 @@ public:
 			case CV_16U:
 				return image.at<uint16_t>(y, x);
 			case CV_32F:
+				if constexpr (std::is_floating_point<T>::value) {
+					return image.at<float>(y, x);
+				}
 				return static_cast<int>(image.at<float>(y, x));
 			default:
 				throw std::runtime_error("Unsupported image depth.");
@@ -114,9 +237,47 @@ public:
         return image.ptr<uint16_t>(y)[x];
 	}
 
-    T rows() const override { return image.rows; }
-    T cols() const override { return image.cols; }
+    T decodedPixel(int x, int y) const {
+        const uchar* p = image.ptr(y) + x * image.elemSize1();
+        switch (image.depth()) {
+            case CV_8U:
+                return loadSample<uint8_t>(p, bigEndian, flipSign);
+            case CV_16U:
+                return loadSample<uint16_t>(p, bigEndian, flipSign);
+            case CV_32F:
+                if constexpr (std::is_floating_point<T>::value) {
+                    return loadSample<float>(p, bigEndian, flipSign);
+                }
+                return static_cast<int>(loadSample<float>(p, bigEndian, flipSign));
+            default:
+                throw std::runtime_error("Unsupported image depth.");
+        }
+    }
+
+    size_t rows() const override { return static_cast<size_t>(image.rows); }
+    size_t cols() const override { return static_cast<size_t>(image.cols); }
     size_t size() const override { return static_cast<size_t>(image.total()); }
+
+    ImageView view() const override {
+        ImageView v;
+        v.data = image.data;
+        v.rows = image.rows;
+        v.cols = image.cols;
+        v.stride = static_cast<size_t>(image.step);
+        v.depth = image.depth();
+        v.bigEndian = bigEndian;
+        v.flipSign = flipSign;
+        return v;
+    }
+
+    std::shared_ptr<DerivedPixelData> derivedData() const override { return derived; }
+
+    // Use the derived data of another image over the same pixels.
+    void shareDerivedData(std::shared_ptr<DerivedPixelData> data) {
+        if (data) {
+            derived = std::move(data);
+        }
+    }
     
 };
 
@@ -162,10 +323,10 @@ public:
         return 0; //Assume a black background for pixels that are not specified
     }
 
-    T rows() const override {
+    size_t rows() const override {
         return max_y + 1; // max value + 1 give the max rows
     }
-    T cols() const override {
+    size_t cols() const override {
         return max_x + 1; // max value + 1 give the max cols
     }
     size_t size() const override {
@@ -183,7 +344,7 @@ public:
 
 
     T inline getNextPixelValue() {
-        if (xstart >= cols() || ystart >= rows()) {
+        if (xstart >= (int)cols() || ystart >= (int)rows()) {
             return T(); 
             throw std::runtime_error("Unsupported pixel value.");
         }
@@ -192,7 +353,7 @@ public:
    
         ++xstart;
 
-        if (xstart >= cols()) {
+        if (xstart >= (int)cols()) {
             xstart = 0;
             ++ystart; 
         }
@@ -213,8 +374,8 @@ public:
 
         // After sorting, fill in the missing (black) pixels
         if (sortedData.size() < size()) {
-            for (int y = 0; y < rows(); ++y) {
-                for (int x = 0; x < cols(); ++x) {
+            for (int y = 0; y < (int)rows(); ++y) {
+                for (int x = 0; x < (int)cols(); ++x) {
                     if (getPixelValue(x, y) == 0) { // Checks if pixel is black/missing
                         sortedData.push_back(std::make_tuple(0, x, y));
                     }
@@ -232,20 +393,121 @@ public:
     };
 };
 
-/* 
-std::unique_ptr<IImage> createImageWrapper(const cv::Mat& img) {
+/*
+ * Pixel accessors the processing kernels are templated on.
+ * ViewAccessor reads straight from the row pointers of an ImageView of
+ * storage type P, with no virtual call, bounds check or depth switch per pixel.
+ * EncodedViewAccessor reads encoded() views sample by sample (unaligned
+ * load, byte swap, sign flip), it has no rows for the SIMD paths.
+ * VirtualAccessor is the fallback through IImage::getPixelValue for images
+ * without a raw buffer (VectorImage).
+ * at() returns the processor value type T, pixel() the storage type,
+ * row() is only available when hasRows is true.
+ */
+template<typename T, typename P>
+class ViewAccessor {
+private:
+    ImageView v;
+
+public:
+    using pixel_type = P;
+    static constexpr bool hasRows = true;
+
+    explicit ViewAccessor(const ImageView& view) : v(view) {}
+
+    inline const P* row(size_t y) const { return v.row<P>(y); }
+    inline P pixel(size_t x, size_t y) const { return row(y)[x]; }
+    inline T at(size_t x, size_t y) const {
+        if constexpr (std::is_floating_point<P>::value && std::is_integral<T>::value) {
+            return static_cast<T>(static_cast<int>(pixel(x, y))); // same as ImageWrapper
+        } else {
+            return static_cast<T>(pixel(x, y));
+        }
+    }
+    size_t rows() const { return v.rows; }
+    size_t cols() const { return v.cols; }
+};
+
+template<typename T, typename P>
+class EncodedViewAccessor {
+private:
+    ImageView v;
+
+public:
+    using pixel_type = P;
+    static constexpr bool hasRows = false;
+
+    explicit EncodedViewAccessor(const ImageView& view) : v(view) {}
+
+    inline P pixel(size_t x, size_t y) const {
+        return loadSample<P>(v.data + y * v.stride + x * sizeof(P), v.bigEndian, v.flipSign);
+    }
+    inline T at(size_t x, size_t y) const {
+        if constexpr (std::is_floating_point<P>::value && std::is_integral<T>::value) {
+            return static_cast<T>(static_cast<int>(pixel(x, y)));
+        } else {
+            return static_cast<T>(pixel(x, y));
+        }
+    }
+    size_t rows() const { return v.rows; }
+    size_t cols() const { return v.cols; }
+};
+
+template<typename T>
+class VirtualAccessor {
+private:
+    const IImage<T>& img;
+    size_t nrows;
+    size_t ncols;
+
+public:
+    using pixel_type = T;
+    static constexpr bool hasRows = false;
+
+    explicit VirtualAccessor(const IImage<T>& image)
+        : img(image), nrows(image.rows()), ncols(image.cols()) {}
+
+    inline T pixel(size_t x, size_t y) const { return img.getPixelValue(x, y); }
+    inline T at(size_t x, size_t y) const { return img.getPixelValue(x, y); }
+    size_t rows() const { return nrows; }
+    size_t cols() const { return ncols; }
+};
+
+
+/*
+ * Image of any of the supported value types, picked from the real depth of
+ * the data: 8-bit, 16-bit or float.
+ */
+using AnyImage = std::variant<std::shared_ptr<IImage<uint8_t>>,
+                              std::shared_ptr<IImage<uint16_t>>,
+                              std::shared_ptr<IImage<float>>>;
+
+// Wrap img with the value type of its depth. Depths without a native
+// processor (signed, 32-bit int, double) are converted to float.
+// owner, when set, keeps the memory of img alive (see ImageWrapper).
+// bigEndian / flipSign describe the stored samples of the native depths; the
+// converted ones must be in host order already.
+inline AnyImage createImageWrapper(const cv::Mat& img, std::shared_ptr<const void> owner = nullptr,
+                                   bool bigEndian = false, bool flipSign = false) {
     switch (img.depth()) {
         case CV_8U:
-            return std::make_unique<ImageWrapper<uint8_t>>(img);
+            return std::make_shared<ImageWrapper<uint8_t>>(img, owner, bigEndian, flipSign);
         case CV_16U:
-            return std::make_unique<ImageWrapper<uint16_t>>(img);
+            return std::make_shared<ImageWrapper<uint16_t>>(img, owner, bigEndian, flipSign);
         case CV_32F:
-            return std::make_unique<ImageWrapper<float>>(img);
-        // Add other cases as necessary
+            return std::make_shared<ImageWrapper<float>>(img, owner, bigEndian, flipSign);
+        case CV_8S:
+        case CV_16S:
+        case CV_32S:
+        case CV_64F: {
+            cv::Mat converted;
+            img.convertTo(converted, CV_32F);
+            return std::make_shared<ImageWrapper<float>>(converted);
+        }
         default:
             throw std::runtime_error("Unsupported image type.");
     }
-} */
+}
 
 
 /*
@@ -260,6 +522,10 @@ public:
     virtual std::unique_ptr<IImage<uint16_t>> readImageSensor() {
         throw std::runtime_error("readImageSensor not implemented");
     }
+    // Image with the value type of the stored depth, no conversion to 16-bit.
+    virtual AnyImage readImageAnyDepth(const std::string& imagePath) {
+        throw std::runtime_error("readImageAnyDepth not implemented");
+    }
     virtual ~ImageReader() = default;
 };
 
@@ -278,6 +544,16 @@ public:
         }
         return std::make_unique<ImageWrapper<uint16_t>>(image);
     }
+
+    // Decode with IMREAD_ANYDEPTH: 8-bit, 16-bit and float files keep their
+    // depth, so 8-bit frames are processed as uint8_t.
+    AnyImage readImageAnyDepth(const std::string& imagePath) override {
+        cv::Mat image = cv::imread(imagePath, cv::IMREAD_ANYDEPTH);
+        if (image.empty()) {
+            throw std::runtime_error("Error loading the image.");
+        }
+        return createImageWrapper(image);
+    }
 };
 
 /*
@@ -288,6 +564,11 @@ public:
     static std::unique_ptr<ImageReader> createImageReader() {
         return std::make_unique<OpenCVImageReader>();
     }
+
+    // Reader for the format of imagePath, sniffed from its first bytes:
+    // uncompressed PGM (P5) and FITS are memory mapped (MappedImageReader),
+    // everything else is decoded by OpenCV. Defined in mmapreader.cpp.
+    static std::unique_ptr<ImageReader> createImageReader(const std::string& imagePath);
 };
 
 
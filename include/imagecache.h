@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "image.h"
+
+
+struct ImageCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;   // entries dropped to stay within the budget
+    size_t entries = 0;
+    size_t bytes = 0;       // pixel bytes held
+    size_t budget = 0;
+};
+
+
+/*
+ * ImageReader decorator keeping decoded images in an LRU cache of at most
+ * byteBudget pixel bytes. An entry is keyed by path and checked against the
+ * size and modification time of the file, a changed file is decoded again.
+ * A hit returns a new image sharing the cached pixels: no decode, no copy.
+ * The images are read only; several threads may use the reader at once.
+ * Images larger than the budget are returned but not cached.
+ * Memory mapped images (MappedImageReader) stay mappings of the file: files
+ * must be replaced (written aside and renamed), not rewritten in place.
+ */
+class CachingImageReader : public ImageReader {
+public:
+    using ReaderFactory = std::function<std::unique_ptr<ImageReader>(const std::string&)>;
+
+    explicit CachingImageReader(size_t byteBudget,
+                                ReaderFactory readerFor = [](const std::string& path) {
+                                    return ImageReaderFactory::createImageReader(path);
+                                });
+
+    std::unique_ptr<IImage<uint16_t>> readImage(const std::string& imagePath) override;
+    AnyImage readImageAnyDepth(const std::string& imagePath) override;
+
+    ImageCacheStats stats() const;
+    void clear();
+
+private:
+    struct FileStamp {
+        uint64_t size = 0;
+        int64_t mtimeNs = 0;
+        bool operator==(const FileStamp& other) const {
+            return size == other.size && mtimeNs == other.mtimeNs;
+        }
+    };
+
+    struct Entry {
+        std::string key;
+        FileStamp stamp;
+        AnyImage image; // 16-bit image for readImage, native depth for readImageAnyDepth
+        size_t bytes = 0;
+    };
+
+    size_t budget;
+    ReaderFactory readerFor;
+
+    mutable std::mutex mutex;
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    ImageCacheStats counters;
+
+    AnyImage read(const std::string& imagePath, bool anyDepth);
+    void insert(Entry entry);
+};
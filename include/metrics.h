@@ -0,0 +1,160 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <type_traits>
+
+#include "trace.h"
+
+
+/*
+ * Hot path instrumentation: stage timers, busy time of every thread and wait
+ * time on the locks of the parallel sections (the WorkStealingDeques slots of
+ * the tiled strategy), exported as Prometheus text or JSON.
+ *
+ * Built with -DTOPN_METRICS (make METRICS=1) the TOPN_* macros below record
+ * into Metrics::instance(): two steady_clock reads and a few relaxed atomic
+ * adds per scope, no lock, no allocation. Without it they expand to nothing,
+ * or to the traced lock alone for TOPN_TIMED_LOCK, and the export reports
+ * topn_metrics_enabled 0.
+ */
+enum class Stage : uint8_t {
+    Decode,     // reading and decoding the image
+    Scan,       // pass over the pixels (wall time of the parallel bands)
+    LocalHeap,  // allocating the per-task heaps
+    Merge,      // merging the per-task heaps
+    Output,     // writing the result
+    Count
+};
+
+constexpr size_t STAGE_COUNT = static_cast<size_t>(Stage::Count);
+
+const char* stageName(Stage stage);
+
+
+class Metrics {
+public:
+    static constexpr size_t MAX_THREADS = 256; // later threads share the last slot
+
+    static Metrics& instance() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    static constexpr bool enabled() {
+#ifdef TOPN_METRICS
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void recordStage(Stage stage, uint64_t ns) {
+        StageCounters& s = stages[static_cast<size_t>(stage)];
+        s.count.fetch_add(1, std::memory_order_relaxed);
+        s.totalNs.fetch_add(ns, std::memory_order_relaxed);
+        uint64_t max = s.maxNs.load(std::memory_order_relaxed);
+        while (ns > max && !s.maxNs.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+        }
+    }
+
+    void recordBusy(uint64_t ns) {
+        threadBusyNs[threadSlot()].fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    void recordLockWait(uint64_t ns) {
+        lockAcquisitions.fetch_add(1, std::memory_order_relaxed);
+        lockWaitNs.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    // Prometheus text exposition format (counters, seconds).
+    std::string prometheus() const;
+    std::string json() const;
+
+    // JSON when path ends in ".json", Prometheus text otherwise.
+    void writeFile(const std::string& path) const;
+
+    void reset();
+
+    // Small dense index of the calling thread, stable for its lifetime.
+    static size_t threadSlot() {
+        static std::atomic<size_t> next{0};
+        thread_local size_t slot = std::min(next.fetch_add(1, std::memory_order_relaxed), MAX_THREADS - 1);
+        return slot;
+    }
+
+private:
+    struct StageCounters {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> totalNs{0};
+        std::atomic<uint64_t> maxNs{0};
+    };
+
+    std::array<StageCounters, STAGE_COUNT> stages;
+    std::array<std::atomic<uint64_t>, MAX_THREADS> threadBusyNs{};
+    std::atomic<uint64_t> lockAcquisitions{0};
+    std::atomic<uint64_t> lockWaitNs{0};
+};
+
+
+inline uint64_t metricsNowNs() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Records the lifetime of the scope as one run of a stage.
+class StageTimer {
+public:
+    explicit StageTimer(Stage stage) : stage(stage), start(metricsNowNs()) {}
+    ~StageTimer() { Metrics::instance().recordStage(stage, metricsNowNs() - start); }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+    Stage stage;
+    uint64_t start;
+};
+
+// Adds the lifetime of the scope to the busy time of the calling thread.
+class BusyTimer {
+public:
+    BusyTimer() : start(metricsNowNs()) {}
+    ~BusyTimer() { Metrics::instance().recordBusy(metricsNowNs() - start); }
+
+    BusyTimer(const BusyTimer&) = delete;
+    BusyTimer& operator=(const BusyTimer&) = delete;
+
+private:
+    uint64_t start;
+};
+
+// Locks mutex, recording how long the lock took to get (tracedLock: a
+// contended wait also shows on the trace timeline).
+template<typename Mutex>
+std::unique_lock<Mutex> timedLock(Mutex& mutex, const char* mutexName) {
+    uint64_t start = metricsNowNs();
+    std::unique_lock<Mutex> lock = tracedLock(mutex, mutexName);
+    Metrics::instance().recordLockWait(metricsNowNs() - start);
+    return lock;
+}
+
+
+#define TOPN_METRICS_CONCAT2(a, b) a##b
+#define TOPN_METRICS_CONCAT(a, b) TOPN_METRICS_CONCAT2(a, b)
+
+#ifdef TOPN_METRICS
+#define TOPN_STAGE_TIMER(stage) StageTimer TOPN_METRICS_CONCAT(topnStageTimer, __LINE__)(Stage::stage)
+#define TOPN_BUSY_TIMER() BusyTimer TOPN_METRICS_CONCAT(topnBusyTimer, __LINE__)
+#define TOPN_TIMED_LOCK(name, mutex, label) auto name = timedLock(mutex, label)
+#else
+#define TOPN_STAGE_TIMER(stage) ((void)0)
+#define TOPN_BUSY_TIMER() ((void)0)
+#define TOPN_TIMED_LOCK(name, mutex, label) auto name = tracedLock(mutex, label)
+#endif
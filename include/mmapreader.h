@@ -0,0 +1,78 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "image.h"
+
+
+/*
+ * Read-only view of a whole file through mmap. The pages are those of the
+ * page cache: nothing is copied, and nothing may be written.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const uint8_t* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    uint8_t* bytes = nullptr;
+    size_t length = 0;
+};
+
+
+/*
+ * Geometry of a headerless raw file: rows x cols pixels of an OpenCV depth
+ * (CV_8U, CV_16U, CV_32F), rows stored back to back starting at offset.
+ */
+struct RawGeometry {
+    size_t rows = 0;
+    size_t cols = 0;
+    int depth = CV_16U;
+    size_t offset = 0;
+    bool bigEndian = false;
+};
+
+
+/*
+ * ImageReader over memory mapped, uncompressed files: binary PGM (P5, 8 and
+ * 16-bit), FITS primary images (BITPIX 8, 16, -32) and headerless raw data of
+ * a given RawGeometry. The ImageWrapper points straight into the mapping,
+ * there is no decode and no copy: big-endian or unaligned samples (PGM, FITS)
+ * are decoded by the accessor on every read (see ImageView::encoded), which
+ * costs the SIMD row filter. Signed 16-bit FITS data is converted to float.
+ * The mapping lives as long as the image.
+ */
+class MappedImageReader : public ImageReader {
+public:
+    MappedImageReader() = default;                     // PGM or FITS, from the header
+    explicit MappedImageReader(const RawGeometry& geometry) : raw(geometry) {}
+
+    std::unique_ptr<IImage<uint16_t>> readImage(const std::string& imagePath) override;
+    AnyImage readImageAnyDepth(const std::string& imagePath) override;
+
+    // True when the file starts like a PGM (P5) or FITS header.
+    static bool canRead(const std::string& imagePath);
+
+private:
+    std::optional<RawGeometry> raw;
+
+    // Pixels inside the mapping, as stored.
+    struct MappedPixels {
+        cv::Mat image;
+        std::shared_ptr<MappedFile> file;
+        bool bigEndian = false;
+        bool flipSign = false;
+    };
+
+    MappedPixels mapImage(const std::string& imagePath) const;
+};
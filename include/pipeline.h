@@ -0,0 +1,95 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "imagecache.h"
+
+
+/*
+ * Blocking FIFO of limited capacity between two pipeline stages.
+ * push waits while the queue is full, pop while it is empty; after close()
+ * push fails and pop drains what is left, then returns false.
+ */
+template<typename Item>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(std::max<size_t>(1, capacity)) {}
+
+    bool push(Item item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    bool pop(Item& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+        if (items.empty()) {
+            return false; // closed and drained
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notFull.notify_all();
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    std::deque<Item> items;
+    std::mutex mutex;
+    std::condition_variable notFull;
+    std::condition_variable notEmpty;
+    bool closed = false;
+};
+
+
+struct BatchOptions {
+    size_t topN = 0;
+    std::string outputDir;
+    bool binary = false;         // ".bin" results instead of ".json"
+    size_t readerThreads = 2;
+    size_t computeThreads = std::max(1u, std::thread::hardware_concurrency());
+    size_t queueCapacity = 4;    // decoded images (and results) waiting per stage
+    CachingImageReader* cache = nullptr; // optional, decoded images kept across batches
+};
+
+struct BatchStats {
+    size_t processed = 0;
+    size_t failed = 0;
+};
+
+
+/*
+ * Batch mode: read -> select -> write pipeline over many images.
+ * Reader threads decode (ImageReaderFactory), compute threads run the
+ * selection of createImageProcessor, each on its own ScratchArena reused
+ * from one image to the next, one writer thread writes a result file
+ * per image to outputDir, named after the input file. Bounded queues between
+ * the stages keep at most queueCapacity decoded images in memory.
+ * A failing image is reported on stderr and counted, the batch goes on.
+ * Throws std::runtime_error before any work when two inputs share a file
+ * name, as their results would overwrite each other.
+ */
+BatchStats runBatch(const std::vector<std::string>& inputs, const BatchOptions& options);
+
+// Images of a batch: the regular files of a directory (sorted), or the
+// paths listed one per line in a text file.
+std::vector<std::string> listBatchInputs(const std::string& listOrDirectory);
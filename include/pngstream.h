@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "image.h"
+#include "processor.h"
+#include "threadpool.h"
+#include "writer.h"
+
+
+/*
+ * Row-streaming PNG decoder (libpng): the image is decoded band by band into
+ * a caller buffer, so the whole frame never exists in memory.
+ * Like IMREAD_GRAYSCALE, color is converted to gray and alpha is dropped;
+ * gray up to 8 bits gives CV_8U rows, 16-bit gives CV_16U in host byte order.
+ * Interlaced files cannot be decoded row by row and are rejected.
+ */
+class PngBandReader {
+public:
+    explicit PngBandReader(const std::string& imagePath);
+    ~PngBandReader();
+
+    PngBandReader(const PngBandReader&) = delete;
+    PngBandReader& operator=(const PngBandReader&) = delete;
+
+    size_t rows() const;
+    size_t cols() const;
+    int depth() const;
+    size_t rowsLeft() const;
+
+    // Decode the next rows, at most maxRows, into buffer and return their
+    // view; the view has no rows once the image is done.
+    ImageView readBand(std::vector<uint8_t>& buffer, size_t maxRows);
+
+    // True when the file starts with the PNG signature.
+    static bool isPng(const std::string& imagePath);
+
+private:
+    struct State; // libpng handles, kept out of this header
+    std::unique_ptr<State> state;
+};
+
+
+constexpr size_t DEFAULT_BAND_ROWS = 256;
+
+/*
+ * topN brightest pixels of a PNG, decoded in bands of bandRows rows that are
+ * pushed to a StreamingSelector. Decoding the next band overlaps with the
+ * selection on the current one (two tasks on the shared pool), and only two
+ * bands are ever in memory.
+ */
+template<typename T>
+PixelValues<T> selectTopNFromPng(PngBandReader& reader, size_t topN, size_t bandRows = DEFAULT_BAND_ROWS) {
+    StreamingSelector<T> selector(topN, reader.rows(), reader.cols());
+    bandRows = std::max<size_t>(1, bandRows);
+
+    std::vector<uint8_t> buffers[2];
+    ImageView current = reader.readBand(buffers[0], bandRows);
+    size_t next = 1;
+
+    while (current.rows > 0) {
+        ImageView decoded;
+        ThreadPool::instance().run(2, [&](size_t task) {
+            if (task == 0) {
+                decoded = reader.readBand(buffers[next], bandRows);
+            } else {
+                selector.pushRows(current);
+            }
+        });
+        current = decoded;
+        next ^= 1;
+    }
+
+    return selector.values();
+}
+
+template<typename T>
+PixelValues<T> selectTopNFromPng(const std::string& imagePath, size_t topN, size_t bandRows = DEFAULT_BAND_ROWS) {
+    PngBandReader reader(imagePath);
+    return selectTopNFromPng<T>(reader, topN, bandRows);
+}
+
+// selectTopNFromPng with the value type of the PNG bit depth, to writer.
+void streamPngTopN(const std::string& imagePath, size_t topN, ResultWriter& writer,
+                   size_t bandRows = DEFAULT_BAND_ROWS);
@@ -11,35 +11,205 @@
 #include <mutex>
 #include <algorithm>
 #include <string>
+#include <limits>
+#include <numeric>
+#include <atomic>
+#include <memory>
+#include <array>
+#include <type_traits>
+#include <set>
+#include <unordered_map>
+#include <memory_resource>
 #include "utils.h"
 #include "image.h"
+#include "simd.h"
+#include "threadpool.h"
+#include "writer.h"
+#include "selector.h"
+#include "strategy_tree.h"
+#include "metrics.h"
+#include "trace.h"
+#include "scratch.h"
 
  
+/*
+ * Depth independent interface of ImageProcessor, returned by
+ * createImageProcessor when the value type is only known at runtime.
+ */
+class IImageProcessor {
+public:
+    virtual std::vector<PixelCoord> processImage(size_t topN) = 0;
+    virtual std::vector<PixelCoord> processImageParallel(size_t topN) = 0;
+    // Select topN with their values (processImageValues) and hand them to writer.
+    virtual void processImageTo(size_t topN, ResultWriter& writer) = 0;
+    // Answers for several topN at once, in the order of topNs.
+    virtual std::vector<std::vector<PixelCoord>> processImageMulti(const std::vector<size_t>& topNs) = 0;
+    virtual ~IImageProcessor() = default;
+};
+
+
+/*
+ * Min-heap of the topN best PackedKey (utils.h) of an image, fed one row at a
+ * time. The keys carry the pixel values, so rows can be dropped once pushed.
+ * Rows must come in scan order: a later pixel then has a larger index than
+ * every key in the heap and enters only with a strictly larger value, which
+ * is what the filterAbove threshold of the raw-row path tests.
+ */
+template<typename T>
+class PackedKeyHeap {
+public:
+    PackedKeyHeap(size_t topN, size_t cols) : topN(topN), cols(cols) {
+        static_assert(packableValue<T>(), "value does not fit in a packed key");
+        heap.reserve(topN);
+    }
+
+    // Runs in storage taken over from a ScratchArena; hand it back with
+    // release() and releaseCandidates().
+    PackedKeyHeap(size_t topN, size_t cols, std::vector<PackedKey> storage, std::vector<uint32_t> candidateRow)
+        : topN(topN), cols(cols), heap(std::move(storage)), candidates(std::move(candidateRow)) {
+        static_assert(packableValue<T>(), "value does not fit in a packed key");
+        heap.clear();
+        heap.reserve(topN);
+    }
+
+    // Row y of acc is row imageY of the image, pixels from startX on.
+    template<typename Acc>
+    void pushRow(const Acc& acc, size_t y, size_t imageY, size_t startX = 0) {
+        using P = typename Acc::pixel_type;
+        if (topN == 0) {
+            return;
+        }
+        size_t base = imageY * cols;
+        size_t x = startX;
+
+        for (; x < cols && heap.size() < topN; ++x) {
+            heap.push_back(packKey(orderedBits(acc.at(x, y)), base + x));
+            if (heap.size() == topN) {
+                std::make_heap(heap.begin(), heap.end(), comp);
+            }
+        }
+        if (x == cols) {
+            return;
+        }
+
+        if constexpr (Acc::hasRows && simdFilterable<P, T>()) {
+            // the weakest value came from a P pixel, so it is exact in P
+            P threshold = static_cast<P>(valueFromBits<T>(keyValueBits(heap.front())));
+            candidates.resize(cols);
+            size_t found = filterAbove(acc.row(y) + x, cols - x, threshold, candidates.data());
+
+            for (size_t i = 0; i < found; ++i) {
+                size_t cx = x + candidates[i];
+                push(packKey(orderedBits(acc.at(cx, y)), base + cx));
+            }
+        } else {
+            for (; x < cols; ++x) {
+                push(packKey(orderedBits(acc.at(x, y)), base + x));
+            }
+        }
+    }
+
+    const std::vector<PackedKey>& keys() const { return heap; }
+    std::vector<PackedKey> release() { return std::move(heap); }
+    std::vector<uint32_t> releaseCandidates() { return std::move(candidates); }
+
+private:
+    size_t topN;
+    size_t cols;
+    std::greater<PackedKey> comp; // min-heap, the weakest key at the front
+    std::vector<PackedKey> heap;
+    std::vector<uint32_t> candidates;
+
+    inline void push(PackedKey key) {
+        if (key > heap.front()) {
+            std::pop_heap(heap.begin(), heap.end(), comp);
+            heap.back() = key;
+            std::push_heap(heap.begin(), heap.end(), comp);
+        }
+    }
+};
+
+// Keys to pixels with values, best first (lower index first on ties).
+// Sorts keys in place.
 template<typename T>
-class ImageProcessor {
+PixelValues<T> sortedKeysToPixelValues(std::vector<PackedKey>& keys, size_t cols) {
+    std::sort(keys.begin(), keys.end(), std::greater<PackedKey>());
+    PixelValues<T> result;
+    result.reserve(keys.size());
+    for (PackedKey key : keys) {
+        size_t index = keyIndex(key);
+        result.push_back(index % cols, index / cols, valueFromBits<T>(keyValueBits(key)));
+    }
+    return result;
+}
+
+template<typename T>
+PixelValues<T> keysToPixelValues(std::vector<PackedKey> keys, size_t cols) {
+    return sortedKeysToPixelValues<T>(keys, cols);
+}
+
+
+/*
+ * Max value of every tileSize x tileSize block of an image and how many of
+ * its pixels are at that max, with the tiles ordered by descending max.
+ * A tile whose max is not above the current threshold holds no candidate,
+ * and the counts bound the Nth value before any pixel is read (floorFor).
+ */
+template<typename T>
+struct TileSummary {
+    size_t tileSize = 0;
+    size_t tilesX = 0;
+    size_t tilesY = 0;
+    std::vector<T> max;                 // row-major tiles
+    std::vector<uint32_t> countAtMax;
+    std::vector<uint32_t> order;        // tile indices, descending max
+
+    // A value at least topN pixels reach: no pixel below it is in the top N.
+    T floorFor(size_t topN) const {
+        size_t reached = 0;
+        for (uint32_t tile : order) {
+            reached += countAtMax[tile];
+            if (reached >= topN) {
+                return max[tile];
+            }
+        }
+        return std::numeric_limits<T>::lowest();
+    }
+};
+
+
+template<typename T>
+class ImageProcessor : public IImageProcessor {
 private:
     IImage<T>& image; //make const
+    std::shared_ptr<IImage<T>> ownedImage; // set when the processor keeps the image alive
     std::vector<PixelCoord> globalHeap;
     std::mutex heapMutex;
+    std::shared_ptr<const void> tileSummaryCache; // images without DerivedPixelData, see tileSummary()
+    std::mutex tileSummaryMutex;
+    std::shared_ptr<ScratchArena> scratch = std::make_shared<ScratchArena>(); // see setScratchArena()
 
 
     // Comparator for the heap, used to maintain pixels with the highest values.
+    // Acc is the pixel accessor the kernel runs on (see image.h).
+    template<typename Acc>
     struct ComparePixelVal {
-        const IImage<T>& img;
-        ComparePixelVal(const IImage<T>& image) : img(image) {}
+        const Acc& acc;
+        ComparePixelVal(const Acc& accessor) : acc(accessor) {}
 
         bool operator()(const PixelCoord& p1, const PixelCoord& p2) const {
-            return img.getPixelValue(p1.x, p1.y) > img.getPixelValue(p2.x, p2.y);
+            return acc.at(p1.x, p1.y) > acc.at(p2.x, p2.y);
         }
     };
 
+    template<typename Acc>
     struct ComparePixelValAndCoord {
-        const IImage<T>& img;
-        ComparePixelValAndCoord(const IImage<T>& image) : img(image) {}
+        const Acc& acc;
+        ComparePixelValAndCoord(const Acc& accessor) : acc(accessor) {}
 
         bool operator()(const PixelCoord& p1, const PixelCoord& p2) const {
-            auto val1 = img.getPixelValue(p1.x, p1.y);
-            auto val2 = img.getPixelValue(p2.x, p2.y);
+            auto val1 = acc.at(p1.x, p1.y);
+            auto val2 = acc.at(p2.x, p2.y);
 
             if (val1 == val2) {
                 if (p1.y < p2.y) {
@@ -55,20 +225,128 @@ private:
     };
 
 
+    // Fetch the image view once and run kernel on the matching accessor:
+    // raw rows of the real depth when the image has a buffer, decoded samples
+    // when that buffer is stored encoded (mapped big-endian or unaligned
+    // file), the virtual getPixelValue path otherwise (VectorImage).
+    template<typename Kernel>
+    auto dispatch(Kernel&& kernel) {
+        ImageView v = image.view();
+        if (v.data != nullptr && v.encoded()) {
+            switch (v.depth) {
+                case CV_16U:
+                    return kernel(EncodedViewAccessor<T, uint16_t>(v));
+                case CV_32F:
+                    return kernel(EncodedViewAccessor<T, float>(v));
+                default:
+                    break;
+            }
+        } else if (v.data != nullptr) {
+            switch (v.depth) {
+                case CV_8U:
+                    return kernel(ViewAccessor<T, uint8_t>(v));
+                case CV_16U:
+                    return kernel(ViewAccessor<T, uint16_t>(v));
+                case CV_32F:
+                    return kernel(ViewAccessor<T, float>(v));
+                default:
+                    break;
+            }
+        }
+        return kernel(VirtualAccessor<T>(image));
+    }
+
+    // Row bands for a parallel kernel: the grain policy of the shared pool,
+    // never more bands than rows.
+    template<typename Acc>
+    size_t parallelTasks(const Acc& acc) const {
+        size_t tasks = ThreadPool::instance().tasksFor(acc.rows() * acc.cols());
+        return std::max<size_t>(1, std::min(tasks, acc.rows()));
+    }
+
 
 public:
     ImageProcessor(IImage<T>& img) : image(img) {}//toto make const
+    ImageProcessor(std::shared_ptr<IImage<T>> img) : image(*img), ownedImage(std::move(img)) {}
 
+// Working memory of the strategies (scratch.h). Processors created per frame
+// share one arena to reuse the buffers of the previous frames; nullptr runs
+// every call on a temporary one.
+void setScratchArena(std::shared_ptr<ScratchArena> arena) { scratch = std::move(arena); }
+const std::shared_ptr<ScratchArena>& scratchArena() const { return scratch; }
 
 
-std::vector<PixelCoord> processImage(size_t topN) {
-    std::vector<PixelCoord> v;
-    v = processImageParallelV1(topN);
-/* 
-    static int c = 0;c++;
-    if (c == 5) exit(0); */
 
-    return v;
+// Strategy picked by the compiled STRATEGY_TREE, or by the StrategySelector
+// from the features of the query once a cost model is loaded (opt-in, see
+// StrategySelector::loadOrCalibrate).
+std::vector<PixelCoord> processImage(size_t topN) override {
+    const StrategySelector& selector = StrategySelector::instance();
+    if (!selector.calibrated()) {
+        double pixels = static_cast<double>(image.size());
+        double ratio = pixels > 0 ? topN / pixels : 0;
+        return runStrategy(evaluateStrategyTree(STRATEGY_TREE, pixels, ratio), topN);
+    }
+    return runStrategy(selector.choose(imageFeatures(topN)), topN);
+}
+
+std::vector<PixelCoord> runStrategy(Strategy strategy, size_t topN) {
+    switch (strategy) {
+        case Strategy::HeapBest:        return processImageHeapBest(topN);
+        case Strategy::ParallelV512:    return processImageParallelV512(topN);
+        case Strategy::CountingSort:
+            if constexpr (std::is_integral<T>::value) {
+                return processImageCS(topN); // one bucket per value
+            }
+            return processImageParallelV1(topN);
+        case Strategy::HistogramSelect: return processImageHistogramSelect(topN);
+        case Strategy::PackedKeys:      return processImagePackedKeys(topN);
+        case Strategy::TileSummary:     return processImageTileSummary(topN);
+        case Strategy::ParallelV1:
+        default:                        return processImageParallelV1(topN);
+    }
+}
+
+static constexpr size_t FEATURE_SAMPLES = 4096;
+static constexpr size_t FEATURE_BINS = 64;
+
+// Selector features of a topN query; the histogram is built from at most
+// FEATURE_SAMPLES pixels spread over the image.
+ImageFeatures imageFeatures(size_t topN) {
+    ImageFeatures features;
+    features.rows = image.rows();
+    features.cols = image.cols();
+    features.tasks = ThreadPool::instance().tasksFor(features.pixels());
+    features.integralValues = std::is_integral<T>::value;
+    features.topN = topN;
+    features.topNRatio = features.pixels() > 0 ? static_cast<double>(topN) / features.pixels() : 0;
+    if (features.pixels() > 0) {
+        features.dominantShare = dispatch([&](const auto& acc) { return dominantShareKernel(acc); });
+    }
+    return features;
+}
+
+template<typename Acc>
+double dominantShareKernel(const Acc& acc) {
+    size_t pixels = acc.rows() * acc.cols();
+    size_t step = std::max<size_t>(1, pixels / FEATURE_SAMPLES);
+    std::vector<double> samples;
+    samples.reserve(pixels / step + 1);
+    for (size_t i = 0; i < pixels; i += step) {
+        samples.push_back(static_cast<double>(acc.at(i % acc.cols(), i / acc.cols())));
+    }
+
+    auto [low, high] = std::minmax_element(samples.begin(), samples.end());
+    double min = *low, range = *high - *low;
+    if (!(range > 0)) {
+        return 1.0;
+    }
+    std::array<size_t, FEATURE_BINS> bins{};
+    for (double sample : samples) {
+        size_t bin = static_cast<size_t>((sample - min) / range * (FEATURE_BINS - 1));
+        ++bins[std::min(bin, FEATURE_BINS - 1)];
+    }
+    return static_cast<double>(*std::max_element(bins.begin(), bins.end())) / samples.size();
 }
 
 
@@ -78,22 +356,27 @@ std::vector<PixelCoord> processImageSort( size_t topN) {
         return {};
     }
 
+    return dispatch([&](const auto& acc) { return processImageSortKernel(acc, topN); });
+};
+
+template<typename Acc>
+std::vector<PixelCoord> processImageSortKernel(const Acc& acc, size_t topN) {
     std::vector<PixelCoord> v;
 
-    for (int y = 0; y < image.rows(); ++y) {
-        for (int x = 0; x < image.cols(); ++x) {
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
             v.emplace_back(x, y);
         }
     }
 
-   std::sort(v.begin(), v.end(),  ComparePixelVal(image));
+   std::sort(v.begin(), v.end(),  ComparePixelVal<Acc>(acc));
 
     if (v.size() > topN) {
         v.erase(v.begin() + topN, v.end());
     }
 
     return v;
-};
+}
 
 
 std::vector<PixelCoord> processImagePQ( size_t topN) {
@@ -103,16 +386,21 @@ std::vector<PixelCoord> processImagePQ( size_t topN) {
     }
     topN = std::min(topN, image.size());
 
+    return dispatch([&](const auto& acc) { return processImagePQKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImagePQKernel(const Acc& acc, size_t topN) {
 //    std::priority_queue<PixelCoord, std::vector<PixelCoord>, ComparePixelVal> pq(ComparePixelVal(image));
-    std::priority_queue<PixelCoord, std::vector<PixelCoord>, ComparePixelVal> pq{ComparePixelVal(image)};
+    std::priority_queue<PixelCoord, std::vector<PixelCoord>, ComparePixelVal<Acc>> pq{ComparePixelVal<Acc>(acc)};
 
 
-    for (int y = 0; y < image.rows(); ++y) {
-        for (int x = 0; x < image.cols(); ++x) {
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
             PixelCoord currentPixel(x, y);
             if (pq.size() < topN) {
                 pq.push(currentPixel);
-            } else if (image.getPixelValue(x, y) > image.getPixelValue(pq.top().x, pq.top().y)) {
+            } else if (acc.at(x, y) > acc.at(pq.top().x, pq.top().y)) {
                 pq.pop();
                 pq.push(currentPixel);
             }
@@ -139,25 +427,29 @@ std::vector<PixelCoord> processImagePQ( size_t topN) {
  */
 
 std::vector<PixelCoord> processImageHeap(size_t topN) {
-    std::vector<PixelCoord> v;
-    ComparePixelVal comp(image);
-
     if (topN <= 0 || image.size() < 1) {
         std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
         return {};
     }
     topN = std::min(topN, image.size());
 
+    return dispatch([&](const auto& acc) { return processImageHeapKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageHeapKernel(const Acc& acc, size_t topN) {
+    std::vector<PixelCoord> v;
+    ComparePixelVal<Acc> comp(acc);
+
     v.reserve(topN);
-    for (int y = 0; y < image.rows(); ++y) {
-        __builtin_prefetch(image.getPixelPtr());
-        for (int x = 0; x < image.cols(); ++x) {
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
             if (__builtin_expect(v.size() < topN, 1)) {
                 v.emplace_back(x, y);
                 std::push_heap(v.begin(), v.end(), comp);
             } else {
-                T pixelValue = image.getPixelValue(x, y);
-                T heapMinValue = image.getPixelValue(v.front().x, v.front().y);
+                T pixelValue = acc.at(x, y);
+                T heapMinValue = acc.at(v.front().x, v.front().y);
                 
                 if (pixelValue > heapMinValue) {
                     std::pop_heap(v.begin(), v.end(), comp);
@@ -183,25 +475,29 @@ std::vector<PixelCoord> processImageHeap(size_t topN) {
 
 
 std::vector<PixelCoord> processImageHeapCopy(size_t topN) {
-    std::vector<PixelAll> v;
-    //ComparePixelVal comp(image);
     if (topN <= 0 || image.size() < 1) {
         std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
         return {};
     }
     topN = std::min(topN, image.size());
 
+    return dispatch([&](const auto& acc) { return processImageHeapCopyKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageHeapCopyKernel(const Acc& acc, size_t topN) {
+    std::vector<PixelAll> v;
+
     v.reserve(topN);
-    for (size_t y = 0; y < image.rows(); ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
             if (v.size() < topN) {
-                T pixelValue = image.getPixelValue(x, y);
+                T pixelValue = acc.at(x, y);
                 PixelAll currentPixel(x, y, pixelValue);
                 v.emplace_back(currentPixel); //   v.emplace_back(x, y);
                 std::push_heap(v.begin(), v.end(), ComparePixelValAndCoordCopy());
             } else {
-                T pixelValue = image.getPixelValue(x, y);
-                //T heapMinValue = image.getPixelValue(v.front().x, v.front().y);
+                T pixelValue = acc.at(x, y);
                 T heapMinValue = v.front().value;
                 if (pixelValue > heapMinValue) {
                     std::pop_heap(v.begin(), v.end(), ComparePixelValAndCoordCopy());
@@ -225,28 +521,30 @@ return result;
 
 
 std::vector<PixelCoord> processImageHeapNextPixel(size_t topN) {
-    std::vector<PixelCoord> v;
-    ComparePixelVal comp(image);
-
     if (topN <= 0 || image.size() < 1) {
         std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
         return {};
     }
     topN = std::min(topN, image.size());
 
+    return dispatch([&](const auto& acc) { return processImageHeapNextPixelKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageHeapNextPixelKernel(const Acc& acc, size_t topN) {
+    std::vector<PixelCoord> v;
+    ComparePixelVal<Acc> comp(acc);
+
     v.reserve(topN);
-    image.moveToStart();
 
-    for (size_t y = 0; y < image.rows(); ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
-            //T pixelValue = image.getNextPixelValue(); 
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
             if (v.size() < topN) {
-                //PixelAll currentPixel(x, y, pixelValue);
                 v.emplace_back(x, y);
                 std::push_heap(v.begin(), v.end(), comp);
             } else {
-                T pixelValue = image.getPixelValue(x, y);
-                T heapMinValue = image.getPixelValue(v.front().x, v.front().y);
+                T pixelValue = acc.at(x, y);
+                T heapMinValue = acc.at(v.front().x, v.front().y);
                 if (pixelValue > heapMinValue) {
                     std::pop_heap(v.begin(), v.end(), comp);
                     v.pop_back();
@@ -262,19 +560,24 @@ std::vector<PixelCoord> processImageHeapNextPixel(size_t topN) {
 }
 
 std::vector<PixelCoord> processImageHeapNextPixelCopy(size_t topN) {
-    std::vector<PixelAll> v;
     if (topN <= 0 || image.size() < 1) {
         std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
         return {};
     }
     topN = std::min(topN, image.size());
 
+    return dispatch([&](const auto& acc) { return processImageHeapNextPixelCopyKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageHeapNextPixelCopyKernel(const Acc& acc, size_t topN) {
+    std::vector<PixelAll> v;
+
     v.reserve(topN);
-    image.moveToStart();
 
-    for (size_t y = 0; y < image.rows(); ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
-            T pixelValue = image.getNextPixelValue(); 
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
+            T pixelValue = acc.at(x, y);
             if (v.size() < topN) {
                 PixelAll currentPixel(x, y, pixelValue);
                 v.emplace_back(currentPixel);
@@ -303,24 +606,29 @@ std::vector<PixelCoord> processImageHeapNextPixelCopy(size_t topN) {
 
 
 std::vector<PixelCoord> processImageHeapUnrolling(size_t topN) {
-    std::vector<PixelCoord> v;
-    ComparePixelVal comp(image);
-
     if (topN <= 0 || image.size() < 1) {
         std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
         return {};
     }
     topN = std::min(topN, image.size());
 
+    return dispatch([&](const auto& acc) { return processImageHeapUnrollingKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageHeapUnrollingKernel(const Acc& acc, size_t topN) {
+    std::vector<PixelCoord> v;
+    ComparePixelVal<Acc> comp(acc);
+
     v.reserve(topN);
 
     // Calculate the number of full pixels to add
-    size_t completeRows = topN / image.cols();
-    size_t remainingPixels = topN % image.cols();
+    size_t completeRows = topN / acc.cols();
+    size_t remainingPixels = topN % acc.cols();
 
     // Add pixels from complete rows
     for (size_t y = 0; y < completeRows; ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
             v.emplace_back(x, y);
         }
     }
@@ -335,9 +643,9 @@ std::vector<PixelCoord> processImageHeapUnrolling(size_t topN) {
 
     // Process the rest of the image, if there is any
     size_t y = completeRows;
-    for (size_t x = remainingPixels; x < image.cols(); ++x) {
-        T pixelValue = image.getPixelValue(x, y);
-        T heapMinValue = image.getPixelValue(v.front().x, v.front().y);
+    for (size_t x = remainingPixels; y < acc.rows() && x < acc.cols(); ++x) {
+        T pixelValue = acc.at(x, y);
+        T heapMinValue = acc.at(v.front().x, v.front().y);
         if (pixelValue > heapMinValue) {
             std::pop_heap(v.begin(), v.end(), comp);
             v.pop_back(); 
@@ -347,10 +655,10 @@ std::vector<PixelCoord> processImageHeapUnrolling(size_t topN) {
     }
 
     // Process the rest of the image, if there is any
-    for (size_t y = completeRows + 1; y < image.rows(); ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
-            T pixelValue = image.getPixelValue(x, y);
-            T heapMinValue = image.getPixelValue(v.front().x, v.front().y);
+    for (size_t y = completeRows + 1; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
+            T pixelValue = acc.at(x, y);
+            T heapMinValue = acc.at(v.front().x, v.front().y);
             if (pixelValue > heapMinValue) {
                 std::pop_heap(v.begin(), v.end(), comp);
                 v.pop_back(); 
@@ -370,24 +678,29 @@ Sequential Memory Access: Pixels in images are generally stored in memory sequen
 Accessing them in this order maximizes cache efficiency,
 as adjacent data is often preloaded into the cache by the CPU's prefetching mechanisms */
 std::vector<PixelCoord> processImageHeapBest(size_t topN) {
-    std::vector<PixelCoord> v;
-    ComparePixelVal comp(image);
-
     if (topN <= 0 || image.size() < 1) {
         std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
         return {};
     }
     topN = std::min(topN, image.size());
 
+    return dispatch([&](const auto& acc) { return processImageHeapBestKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageHeapBestKernel(const Acc& acc, size_t topN) {
+    std::vector<PixelCoord> v;
+    ComparePixelVal<Acc> comp(acc);
+
     v.reserve(topN);
 
     // Calculate the number of full pixels to add
-    size_t completeRows = topN / image.cols();
-    size_t remainingPixels = topN % image.cols();
+    size_t completeRows = topN / acc.cols();
+    size_t remainingPixels = topN % acc.cols();
 
     // Add pixels from complete rows
     for (size_t y = 0; y < completeRows; ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
             v.emplace_back(x, y);
         }
     }
@@ -400,12 +713,6 @@ std::vector<PixelCoord> processImageHeapBest(size_t topN) {
     // Initialize the heap with the added pixels
     std::make_heap(v.begin(), v.end(), comp);
 
-    //before processs to next pixels jump image pointer to correct position
-    image.moveToStart(topN);
-    VectorImage<T>* derivedImg = dynamic_cast<VectorImage<T>*>(&image);
-    if (derivedImg) {
-        derivedImg->moveToStart(topN);
-    } 
     /*
         Because heap is full, compare and possibly replace the min heap
     */ 
@@ -413,9 +720,9 @@ std::vector<PixelCoord> processImageHeapBest(size_t topN) {
     T heapMinValue = 0;
     T pixelValue = 0;
     size_t y = completeRows;
-    for (size_t x = remainingPixels; x < image.cols(); ++x) {
-        pixelValue = image.getNextPixelValue(); 
-        heapMinValue = image.getPixelValue(v.front().x, v.front().y);
+    for (size_t x = remainingPixels; y < acc.rows() && x < acc.cols(); ++x) {
+        pixelValue = acc.at(x, y);
+        heapMinValue = acc.at(v.front().x, v.front().y);
         if (pixelValue > heapMinValue) {
             std::pop_heap(v.begin(), v.end(), comp);
             v.pop_back(); 
@@ -424,14 +731,25 @@ std::vector<PixelCoord> processImageHeapBest(size_t topN) {
         }
     }
 
+    using P = typename Acc::pixel_type;
+    if constexpr (Acc::hasRows && simdFilterable<P, T>()) {
+        // Only the SIMD filtered candidates of each row reach the heap
+        ScratchArena::Lease arena(scratch);
+        std::vector<uint32_t>& candidates = arena->rowCandidates();
+        candidates.resize(acc.cols());
+        for (size_t y = completeRows + 1; y < acc.rows(); ++y) {
+            processRowFullHeap(acc, v, comp, y, 0, acc.cols(), candidates);
+        }
+        return v;
+    }
+
     bool heap_updated = true;
     // Process the rest of the iamge from (completeRows + 1) row to the end, if there is any
-    for (size_t y = completeRows + 1; y < image.rows(); ++y) {
-        __builtin_prefetch(image.getPixelPtr());
-        for (size_t x = 0; x < image.cols(); ++x) {
-            pixelValue = image.getNextPixelValue(); //T pixelValue = image.getPixelValue(x, y);
+    for (size_t y = completeRows + 1; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
+            pixelValue = acc.at(x, y);
             if(heap_updated) {
-                heapMinValue = image.getPixelValue(v.front().x, v.front().y);
+                heapMinValue = acc.at(v.front().x, v.front().y);
             }
             // compare and possibly replace the min heap
              if (__builtin_expect(pixelValue > heapMinValue, 0)) {
@@ -452,24 +770,29 @@ std::vector<PixelCoord> processImageHeapBest(size_t topN) {
 
 
 std::vector<PixelCoord> processImageHeapBest1(size_t topN) {
-    std::vector<PixelCoord> v;
-    ComparePixelVal comp(image);
-
     if (topN <= 0 || image.size() < 1) {
         std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
         return {};
     }
     topN = std::min(topN, image.size());
 
+    return dispatch([&](const auto& acc) { return processImageHeapBest1Kernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageHeapBest1Kernel(const Acc& acc, size_t topN) {
+    std::vector<PixelCoord> v;
+    ComparePixelVal<Acc> comp(acc);
+
     v.reserve(topN);
 
     // Calculate the number of full pixels to add
-    size_t completeRows = topN / image.cols();
-    size_t remainingPixels = topN % image.cols();
+    size_t completeRows = topN / acc.cols();
+    size_t remainingPixels = topN % acc.cols();
 
     // Add pixels from complete rows
     for (size_t y = 0; y < completeRows; ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
             v.emplace_back(x, y);
         }
     }
@@ -482,20 +805,14 @@ std::vector<PixelCoord> processImageHeapBest1(size_t topN) {
     // Initialize the heap with the added pixels
     std::make_heap(v.begin(), v.end(), comp);
 
-    //before processs to next pixels jump image pointer to correct position
-    image.moveToStart(topN);
-    VectorImage<T>* derivedImg = dynamic_cast<VectorImage<T>*>(&image);
-    if (derivedImg) {
-        derivedImg->moveToStart(topN);
-    }
     /*
         Because heap is full, compare and possibly replace the min heap
     */ 
     // Process the rest of the row, if there is any
     size_t y = completeRows;
-    for (size_t x = remainingPixels; x < image.cols(); ++x) {
-        T pixelValue = image.getNextPixelValue(); 
-        T heapMinValue = image.getPixelValue(v.front().x, v.front().y);
+    for (size_t x = remainingPixels; y < acc.rows() && x < acc.cols(); ++x) {
+        T pixelValue = acc.at(x, y);
+        T heapMinValue = acc.at(v.front().x, v.front().y);
         if (pixelValue > heapMinValue) {
             std::pop_heap(v.begin(), v.end(), comp);
             v.pop_back(); 
@@ -505,10 +822,10 @@ std::vector<PixelCoord> processImageHeapBest1(size_t topN) {
     }
 
     // Process the rest of the image from (completeRows + 1) row to the end, if there is any
-    for (size_t y = completeRows + 1; y < image.rows(); ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
-            T pixelValue = image.getNextPixelValue(); //T pixelValue = image.getPixelValue(x, y);
-            T heapMinValue = image.getPixelValue(v.front().x, v.front().y);
+    for (size_t y = completeRows + 1; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
+            T pixelValue = acc.at(x, y);
+            T heapMinValue = acc.at(v.front().x, v.front().y);
             // compare and possibly replace the min heap
              if (pixelValue > heapMinValue) {
                 std::pop_heap(v.begin(), v.end(), comp);
@@ -524,28 +841,121 @@ std::vector<PixelCoord> processImageHeapBest1(size_t topN) {
 
 
 
+/*
+ * Row segment [startX, endX) of row y against a full heap v: only pixels
+ * above the heap minimum (and above floor, when given) can enter. filterAbove
+ * (simd.h) compares the raw row with that threshold at the start of the
+ * segment, the candidates are re-checked against the current minimum as it
+ * grows.
+ */
+template<typename Acc>
+void processRowFullHeap(const Acc& acc, std::vector<PixelCoord>& v, ComparePixelVal<Acc>& comp,
+                        size_t y, size_t startX, size_t endX, std::vector<uint32_t>& candidates,
+                        typename Acc::pixel_type floor = std::numeric_limits<typename Acc::pixel_type>::lowest()) {
+    using P = typename Acc::pixel_type;
+    static_assert(Acc::hasRows && simdFilterable<P, T>(), "raw rows of a filterable type only");
+
+    P threshold = std::max(acc.pixel(v.front().x, v.front().y), floor);
+    size_t found = filterAbove(acc.row(y) + startX, endX - startX, threshold, candidates.data());
+
+    for (size_t i = 0; i < found; ++i) {
+        size_t x = startX + candidates[i];
+        if (acc.at(x, y) > acc.at(v.front().x, v.front().y)) {
+            std::pop_heap(v.begin(), v.end(), comp);
+            v.pop_back();
+            v.push_back({x, y});
+            std::push_heap(v.begin(), v.end(), comp);
+        }
+    }
+}
+
+
 /*
  * ********************************
  *   processImageParallel thread execution
  * ********************************
  */
-void processSubImage(std::vector<PixelCoord>& v, size_t topN, size_t startY, size_t endY, size_t startX, size_t endX) {
-    ComparePixelVal comp(image);
+// bound is shared by the tasks of one call: it is raised to the heap minimum
+// at the end of every row once the heap is full, and pixels not above it are
+// skipped, so bands without bright pixels rarely touch their heap.
+// rowCandidates: buffer of the SIMD filter, kept by the caller across calls.
+template<typename Acc>
+void processSubImage(const Acc& acc, std::vector<PixelCoord>& v, size_t topN, size_t startY, size_t endY, size_t startX, size_t endX,
+                     AtomicLowerBound<T>* bound = nullptr, std::vector<uint32_t>* rowCandidates = nullptr) {
+    TOPN_BUSY_TIMER();
+    TraceScope trace("processSubImage", "scan", "y0", startY, "x0", startX);
+    ComparePixelVal<Acc> comp(acc);
+
+    using P = typename Acc::pixel_type;
+    if constexpr (Acc::hasRows && simdFilterable<P, T>()) {
+        std::vector<uint32_t> ownCandidates;
+        std::vector<uint32_t>& candidates = rowCandidates ? *rowCandidates : ownCandidates;
+        candidates.resize(endX - startX);
+        for (size_t y = startY; y < endY; ++y) {
+            bool prune = bound && bound->isSet();
+            // the bound is the value of a pixel, so it is exact in P
+            P floor = prune ? static_cast<P>(bound->get()) : std::numeric_limits<P>::lowest();
+
+            if (v.size() == topN) {
+                processRowFullHeap(acc, v, comp, y, startX, endX, candidates, floor);
+            } else if (prune) {
+                // fill the heap with the pixels above the bound only
+                size_t found = filterAbove(acc.row(y) + startX, endX - startX, floor, candidates.data());
+                for (size_t i = 0; i < found; ++i) {
+                    size_t x = startX + candidates[i];
+                    if (v.size() < topN) {
+                        v.push_back({x, y});
+                        if (v.size() == topN) {
+                            std::make_heap(v.begin(), v.end(), comp);
+                        }
+                    } else if (acc.at(x, y) > acc.at(v.front().x, v.front().y)) {
+                        std::pop_heap(v.begin(), v.end(), comp);
+                        v.pop_back();
+                        v.push_back({x, y});
+                        std::push_heap(v.begin(), v.end(), comp);
+                    }
+                }
+            } else {
+                // fill the heap, then hand the rest of the row to the SIMD filter
+                size_t x = startX;
+                for (; x < endX && v.size() < topN; ++x) {
+                    v.push_back({x, y});
+                }
+                if (v.size() == topN) {
+                    std::make_heap(v.begin(), v.end(), comp);
+                    if (x < endX) {
+                        processRowFullHeap(acc, v, comp, y, x, endX, candidates);
+                    }
+                }
+            }
+
+            if (bound && v.size() == topN) {
+                bound->raise(acc.at(v.front().x, v.front().y));
+            }
+        }
+        return;
+    }
 
     // O(N) = 2 * topn  + (n - topn) * (2 * log (topn)) 
     for (size_t y = startY; y < endY; ++y) {
+        bool prune = bound && bound->isSet();
+        T floor = prune ? bound->get() : std::numeric_limits<T>::lowest();
+
         for (size_t x = startX; x < endX; ++x) {
             if (v.size() < topN) {
+                if (prune && !(acc.at(x, y) > floor)) {
+                    continue;
+                }
                 v.push_back({x, y});
                 if (v.size() == topN) {
                     std::make_heap(v.begin(), v.end(), comp);
                 }
                 //std::push_heap(v.begin(), v.end(), comp);
             } else {
-                T pixelValue = image.getPixelValue(x, y);
-                T heapMinValue = image.getPixelValue(v.front().x, v.front().y);
+                T pixelValue = acc.at(x, y);
+                T heapMinValue = acc.at(v.front().x, v.front().y);
                 
-                if (pixelValue > heapMinValue) {
+                if (pixelValue > heapMinValue && (!prune || pixelValue > floor)) {
                     std::pop_heap(v.begin(), v.end(), comp);
                     v.pop_back();
 
@@ -554,14 +964,19 @@ void processSubImage(std::vector<PixelCoord>& v, size_t topN, size_t startY, siz
                 }
             }
         }
+
+        if (bound && v.size() == topN) {
+            bound->raise(acc.at(v.front().x, v.front().y));
+        }
     }
 }
 
 
-void processSubImageSharedHeap(size_t topN, size_t startY, size_t endY, ComparePixelVal& comp) {
+template<typename Acc>
+void processSubImageSharedHeap(const Acc& acc, size_t topN, size_t startY, size_t endY, ComparePixelVal<Acc>& comp) {
         for (size_t y = startY; y < endY; ++y) {
-            for (size_t x = 0; x < image.cols(); ++x) {
-                auto pixelValue = image.getPixelValue(x, y);
+            for (size_t x = 0; x < acc.cols(); ++x) {
+                auto pixelValue = acc.at(x, y);
 
                 std::lock_guard<std::mutex> lock(heapMutex);
                 if (globalHeap.size() < topN) {
@@ -570,7 +985,7 @@ void processSubImageSharedHeap(size_t topN, size_t startY, size_t endY, CompareP
                         std::make_heap(globalHeap.begin(), globalHeap.end(), comp);
                     }
                 } else {
-                    auto heapMinValue = image.getPixelValue(globalHeap.front().x, globalHeap.front().y);
+                    auto heapMinValue = acc.at(globalHeap.front().x, globalHeap.front().y);
                     if (pixelValue > heapMinValue) {
                         std::pop_heap(globalHeap.begin(), globalHeap.end(), comp);
                         globalHeap.pop_back();
@@ -584,62 +999,91 @@ void processSubImageSharedHeap(size_t topN, size_t startY, size_t endY, CompareP
     }
 
 
-std::vector<PixelCoord> processImageParallel(size_t topN) {
+/*
+ * Merge the per-task heaps into the topN largest pixels, returned as a heap.
+ * Pairwise tree reduction on the shared pool: at each level heap i takes
+ * heap i + stride, keeping its topN best with nth_element, so P heaps are
+ * merged in log2(P) levels, each level in parallel and without locks.
+ * The heaps are emptied, not freed, and the result is a copy of heap 0: a
+ * ScratchArena keeps their buffers for the next call.
+ */
+template<typename Acc>
+std::vector<PixelCoord> mergeLocalHeaps(const Acc& acc, std::vector<std::vector<PixelCoord>>& localHeaps, size_t topN) {
+    TOPN_STAGE_TIMER(Merge);
+    TraceScope trace("mergeLocalHeaps", "merge", "heaps", localHeaps.size());
+    ComparePixelVal<Acc> comp(acc);
+    size_t numHeaps = localHeaps.size();
+
+    for (size_t stride = 1; stride < numHeaps; stride *= 2) {
+        size_t pairs = (numHeaps + stride - 1) / (2 * stride);
+        ThreadPool::instance().run(pairs, [&](size_t p) {
+            TraceScope pairTrace("merge", "merge", "stride", stride, "pair", p);
+            std::vector<PixelCoord>& dst = localHeaps[2 * stride * p];
+            std::vector<PixelCoord>& src = localHeaps[2 * stride * p + stride];
+
+            dst.insert(dst.end(), src.begin(), src.end());
+            src.clear();
+            if (dst.size() > topN) {
+                std::nth_element(dst.begin(), dst.begin() + (topN - 1), dst.end(), comp);
+                dst.erase(dst.begin() + topN, dst.end());
+            }
+        });
+    }
+
+    std::vector<PixelCoord> finalHeap;
+    if (!localHeaps.empty()) {
+        finalHeap.assign(localHeaps.front().begin(), localHeaps.front().end());
+        localHeaps.front().clear();
+    }
+    std::make_heap(finalHeap.begin(), finalHeap.end(), comp);
+    return finalHeap;
+}
 
-    size_t numThreads = std::thread::hardware_concurrency();
-    //std::cout << "Num threads " << numThreads << std::endl;
 
+std::vector<PixelCoord> processImageParallel(size_t topN) override {
     if (topN <= 0 || image.size() < 1) {
         std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
         return {};
     }
     topN = std::min(topN, image.size());
 
-    std::vector<std::vector<PixelCoord>> localHeaps(numThreads);
-    std::vector<std::thread> threads(numThreads);
-    ComparePixelVal comp(image);
+    return dispatch([&](const auto& acc) { return processImageParallelKernel(acc, topN); });
+}
 
-    for(auto& lh : localHeaps) {
-        lh.reserve(topN);
-    }
+template<typename Acc>
+std::vector<PixelCoord> processImageParallelKernel(const Acc& acc, size_t topN) {
 
-    size_t rowsPerThread = image.rows() / numThreads;
-    
-    for (size_t i = 0; i < numThreads; ++i) {
-        size_t startY = i * rowsPerThread;
-        size_t endY = (i + 1) * rowsPerThread;
-        if (i == numThreads - 1) {
-            endY = image.rows(); // last thread get rest lines
+    size_t numThreads = parallelTasks(acc);
+    //std::cout << "Num threads " << numThreads << std::endl;
+
+    ScratchArena::Lease arena(scratch);
+    std::vector<std::vector<PixelCoord>>& localHeaps = arena->localHeaps(numThreads);
+    AtomicLowerBound<T> bound;
+    ComparePixelVal<Acc> comp(acc);
+
+    {
+        TOPN_STAGE_TIMER(LocalHeap);
+        for(auto& lh : localHeaps) {
+            lh.reserve(topN);
         }
-        threads[i] = std::thread(std::bind(&ImageProcessor::processSubImage,
-         this, std::ref(localHeaps[i]), topN, startY, endY, 0, image.cols()));
     }
 
-    for (auto& thread : threads) {
-        thread.join();
-    }
+    size_t rowsPerThread = acc.rows() / numThreads;
 
-    auto start = std::chrono::high_resolution_clock::now();
-    // Combine local heaps in one global
-    std::vector<PixelCoord> finalHeap;
-    for (const auto& heap : localHeaps) {
-        for (const auto& coord : heap) {
-            finalHeap.push_back(coord);
-            if(finalHeap.size() == topN) {
-                std::make_heap(finalHeap.begin(), finalHeap.end(), comp);
-            }
-            //std::push_heap(finalHeap.begin(), finalHeap.end(), comp);
-            if (finalHeap.size() > topN) {//
-                std::push_heap(finalHeap.begin(), finalHeap.end(), comp);
-                std::pop_heap(finalHeap.begin(), finalHeap.end(), comp);
-                finalHeap.pop_back();
+    {
+        TOPN_STAGE_TIMER(Scan);
+        ThreadPool::instance().run(numThreads, [&](size_t i) {
+            size_t startY = i * rowsPerThread;
+            size_t endY = (i + 1) * rowsPerThread;
+            if (i == numThreads - 1) {
+                endY = acc.rows(); // last thread get rest lines
             }
-        }
-    } 
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::milli> execTime = end - start;
-  
-    std::cout << " Intermediar ExecTime: " << execTime.count() << " ms " << std::endl;
+            processSubImage(acc, localHeaps[i], topN, startY, endY, 0, acc.cols(), &bound, &arena->candidates(i));
+        });
+    }
+
+    // Combine local heaps in one global (stage timing: metrics.h)
+    std::vector<PixelCoord> finalHeap = mergeLocalHeaps(acc, localHeaps, topN);
 
     //std::sort_heap(finalHeap.begin(), finalHeap.end(),  ComparePixel(image));
     //std::sort_heap(v.begin(), v.end(), ComparePixel());
@@ -651,222 +1095,150 @@ std::vector<PixelCoord> processImageParallel(size_t topN) {
 
 std::vector<PixelCoord> processImageParallelV1(size_t topN) {
 
-    size_t numThreads = std::thread::hardware_concurrency();
-    std::cout << "Num threads " << numThreads << std::endl;
-
     if (topN <= 0 || image.size() < 1) {
         std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
         return {};
     }
     topN = std::min(topN, image.size());
 
-    std::vector<std::vector<PixelCoord>> localHeaps(numThreads);
-    std::vector<std::thread> threads(numThreads);
-    ComparePixelVal comp(image);
-
-    for(auto& lh : localHeaps) {
-        lh.reserve(topN);
-    }
-
-    size_t rowsPerThread = image.rows() / numThreads;
-
-    for (size_t i = 0; i < numThreads; ++i) {
-        size_t startY = i * rowsPerThread;
-        size_t endY = (i + 1) * rowsPerThread;
-        if (i == numThreads - 1) {
-            endY = image.rows(); // last thread get rest lines
-        }
-
-        //threads.emplace_back(this->processSubImage, std::ref(localHeaps[i]), topN, startY, endY, comp);
-        threads[i] = std::thread(std::bind(&ImageProcessor::processSubImage, 
-        this, std::ref(localHeaps[i]), topN, startY, endY, 0, image.cols()));
-        //threads[i] = std::thread(std::bind(&ImageProcessor::processSubImageSharedHeap, this, topN, startY, endY, comp));
-    }
-
-    for (auto& thread : threads) {
-        thread.join();
-    }
-
-
-auto start = std::chrono::high_resolution_clock::now();
+    return dispatch([&](const auto& acc) { return processImageParallelV1Kernel(acc, topN); });
+}
 
-   std::vector<PixelCoord> finalHeap;
+template<typename Acc>
+std::vector<PixelCoord> processImageParallelV1Kernel(const Acc& acc, size_t topN) {
 
-    // Swap with the first local heap
-    if (!localHeaps.empty()) {
-        finalHeap.swap(localHeaps.front());
-    }
+    size_t numThreads = parallelTasks(acc);
 
-    if (localHeaps.size() <= 1) {
-        return finalHeap;
-    }
+    ScratchArena::Lease arena(scratch);
+    std::vector<std::vector<PixelCoord>>& localHeaps = arena->localHeaps(numThreads);
+    AtomicLowerBound<T> bound;
+    ComparePixelVal<Acc> comp(acc);
 
-    // Process the heaps starting with the second one
-    for (size_t heapIndex = 1; heapIndex < localHeaps.size() && finalHeap.size() < topN; ++heapIndex) {
-        const auto& currentHeap = localHeaps[heapIndex];
-        for (const auto& coord : currentHeap) {
-            if (finalHeap.size() < topN) {
-                finalHeap.push_back(coord);
-            } else {
-            break;
-            }
+    {
+        TOPN_STAGE_TIMER(LocalHeap);
+        for(auto& lh : localHeaps) {
+            lh.reserve(topN);
         }
     }
 
-    std::make_heap(finalHeap.begin(), finalHeap.end(), comp);
+    size_t rowsPerThread = acc.rows() / numThreads;
 
-    // Process the remaining elements from all heaps, starting from where we left off
-    // only elements that can modify the heap are considered
-    for (size_t heapIndex = 1; heapIndex < localHeaps.size(); ++heapIndex) {
-        const auto& currentHeap = localHeaps[heapIndex];
-        for (const auto& coord : currentHeap) {
-            if (comp(coord, finalHeap.front())) {
-                std::pop_heap(finalHeap.begin(), finalHeap.end(), comp); 
-                finalHeap.pop_back(); 
-                finalHeap.push_back(coord);
-                std::push_heap(finalHeap.begin(), finalHeap.end(), comp); 
+    {
+        TOPN_STAGE_TIMER(Scan);
+        ThreadPool::instance().run(numThreads, [&](size_t i) {
+            size_t startY = i * rowsPerThread;
+            size_t endY = (i + 1) * rowsPerThread;
+            if (i == numThreads - 1) {
+                endY = acc.rows(); // last thread get rest lines
             }
-        }
+
+            processSubImage(acc, localHeaps[i], topN, startY, endY, 0, acc.cols(), &bound, &arena->candidates(i));
+            //processSubImageSharedHeap(acc, topN, startY, endY, comp);
+        });
     }
 
- auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::milli> execTime = end - start;
-  
-    std::cout << " Intermediar ExecTime: " << execTime.count() << " ms " << std::endl;
+   std::vector<PixelCoord> finalHeap = mergeLocalHeaps(acc, localHeaps, topN);
 
 return finalHeap;
 }
 
 
 std::vector<PixelCoord> processImageParallelNoTiling(size_t topN) {
-        size_t numThreads = std::thread::hardware_concurrency();
-        std::cout << "Num threads " << numThreads << std::endl;
-
         if (topN <= 0 || image.size() < 1) {
             std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
             return {};
         }
         topN = std::min(topN, image.size()); 
 
-        //globalHeap.reserve(topN);
+        return dispatch([&](const auto& acc) { return processImageParallelNoTilingKernel(acc, topN); });
+    }
+
+template<typename Acc>
+std::vector<PixelCoord> processImageParallelNoTilingKernel(const Acc& acc, size_t topN) {
+        size_t numThreads = parallelTasks(acc);
 
-        std::vector<std::thread> threads(numThreads);
-        size_t rowsPerThread = image.rows() / numThreads;
+        ScratchArena::Lease arena(scratch);
+        std::vector<std::vector<PixelCoord>>& localHeaps = arena->localHeaps(numThreads);
+        AtomicLowerBound<T> bound;
 
-        for (size_t i = 0; i < numThreads; ++i) {
+        size_t rowsPerThread = acc.rows() / numThreads;
+
+        // Blocks until every band is processed
+        ThreadPool::instance().run(numThreads, [&](size_t i) {
             size_t startY = i * rowsPerThread;
             size_t endY = (i + 1) * rowsPerThread;
             if (i == numThreads - 1) {
-                endY = image.rows(); // Ensure the last thread processes the remaining rows
+                endY = acc.rows(); // Ensure the last thread processes the remaining rows
             }
 
-            threads[i] = std::thread(&ImageProcessor::workerFunctionNoTiling,
-             this, topN, startY, endY);
-        }
-
-        // Wait for processing threads to finish
-        for (auto& t : threads) {
-            t.join();
-        }
+            workerFunctionNoTiling(acc, localHeaps[i], arena->candidates(i), bound, topN, startY, endY);
+        });
 
-        return globalHeap;
+        return mergeLocalHeaps(acc, localHeaps, topN);
     }
 
-    void workerFunctionNoTiling(size_t topN, size_t startY, size_t endY) {
-        std::vector<PixelCoord> localHeap;
+    template<typename Acc>
+    void workerFunctionNoTiling(const Acc& acc, std::vector<PixelCoord>& localHeap, std::vector<uint32_t>& candidates,
+                                AtomicLowerBound<T>& bound, size_t topN, size_t startY, size_t endY) {
+        TraceScope trace("band", "worker", "y0", startY, "y1", endY);
         localHeap.reserve(topN);
-        ComparePixelVal comp(image);
-        processSubImage(localHeap, topN, startY, endY, 0, image.cols());
-
-        std::lock_guard<std::mutex> guard(heapMutex);
-        if (globalHeap.empty()) {
-            // Swap directly if the global heap is empty
-            globalHeap.swap(localHeap);
-            //std::make_heap(globalHeap.begin(), globalHeap.end(), comp);
-        } else {
-            // Otherwise, merge localHeap into globalHeap
-            for (const auto& coord : localHeap) {
-                if (globalHeap.size() < topN) {
-                    globalHeap.push_back(coord);
-                    std::push_heap(globalHeap.begin(), globalHeap.end(), comp);
-                } else if (comp(coord, globalHeap.front())) {
-                    std::pop_heap(globalHeap.begin(), globalHeap.end(), comp);
-                    globalHeap.pop_back();
-
-                    globalHeap.push_back(coord);
-                    std::push_heap(globalHeap.begin(), globalHeap.end(), comp);
-                }
-            }
-        }
+        processSubImage(acc, localHeap, topN, startY, endY, 0, acc.cols(), &bound, &candidates);
     }
 
 
 
 std::vector<PixelCoord> processImageParallelWithTiling(size_t topN, size_t TILE_SIZE = 1024) {
-        size_t numThreads = std::thread::hardware_concurrency();
-        std::cout << "Num threads " << numThreads << std::endl;
-
         if (topN <= 0 || image.size() < 1) {
             std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
             return {};
         }
         topN = std::min(topN, image.size()); 
 
-        //globalHeap.reserve(topN);
+        return dispatch([&](const auto& acc) { return processImageParallelWithTilingKernel(acc, topN, TILE_SIZE); });
+    }
 
-        std::vector<std::thread> workerThreads(numThreads);
-        size_t rowsPerThread = image.rows() / numThreads;
+template<typename Acc>
+std::vector<PixelCoord> processImageParallelWithTilingKernel(const Acc& acc, size_t topN, size_t TILE_SIZE) {
+        size_t tilesX = (acc.cols() + TILE_SIZE - 1) / TILE_SIZE;
+        size_t tilesY = (acc.rows() + TILE_SIZE - 1) / TILE_SIZE;
+        size_t numTiles = tilesX * tilesY;
+        size_t numThreads = std::min(ThreadPool::instance().tasksFor(acc.rows() * acc.cols()), numTiles);
 
-        for (size_t i = 0; i < numThreads; ++i) {
-            size_t startY = i * rowsPerThread;
-            size_t endY = (i + 1) * rowsPerThread;
-            if (i == numThreads - 1) {
-                endY = image.rows(); // Ensure the last thread processes the remaining rows
-            }
+        ScratchArena::Lease arena(scratch);
+        std::vector<std::vector<PixelCoord>>& localHeaps = arena->localHeaps(numThreads);
+        AtomicLowerBound<T> bound;
 
-            workerThreads[i] = std::thread(&ImageProcessor::workerFunctionWithTiling, this, TILE_SIZE, topN, startY, endY);
+        // Each worker starts with a contiguous run of row-major tiles, the
+        // ones that finish early steal what is left from the others.
+        WorkStealingDeques<size_t> tiles(numThreads);
+        for (size_t tile = 0; tile < numTiles; ++tile) {
+            tiles.push(tile * numThreads / numTiles, tile);
         }
 
-        // Wait for processing threads to finish
-        for (auto& t : workerThreads) {
-            t.join();
-        }
+        // Blocks until every tile is processed
+        ThreadPool::instance().run(numThreads, [&](size_t i) {
+            workerFunctionWithTiling(acc, tiles, i, localHeaps[i], arena->candidates(i), bound, TILE_SIZE, tilesX, topN);
+        });
 
-        return globalHeap;
+        return mergeLocalHeaps(acc, localHeaps, topN);
     }
 
-    void workerFunctionWithTiling(size_t TILE_SIZE, size_t topN,  size_t startY, size_t endY) {
-     
-        std::vector<PixelCoord> localHeap;
-        localHeap.reserve(topN);
-        ComparePixelVal comp(image);
+    template<typename Acc>
+    void workerFunctionWithTiling(const Acc& acc, WorkStealingDeques<size_t>& tiles, size_t worker,
+                                  std::vector<PixelCoord>& localHeap, std::vector<uint32_t>& candidates,
+                                  AtomicLowerBound<T>& bound, size_t TILE_SIZE, size_t tilesX, size_t topN) {
 
-        for (size_t y = startY; y < endY; y += TILE_SIZE) {
-            size_t endTileY = std::min(y + TILE_SIZE, endY);
-            for (size_t x = 0; x < image.cols(); x += TILE_SIZE) {
-                size_t endTileX = std::min(x + TILE_SIZE, (size_t)image.cols());
-                processSubImage(localHeap, topN, y, endTileY, x, endTileX);
-            }
-        }
+        localHeap.reserve(topN);
 
-        std::lock_guard<std::mutex> guard(heapMutex);
-        if (globalHeap.empty()) {
-            // Swap directly if the global heap is empty
-            globalHeap.swap(localHeap);  //std::make_heap(globalHeap.begin(), globalHeap.end(), comp);
-        } else {
-            // Otherwise, merge localHeap into globalHeap
-            for (const auto& coord : localHeap) {
-                if (globalHeap.size() < topN) {
-                    globalHeap.push_back(coord);
-                    std::push_heap(globalHeap.begin(), globalHeap.end(), comp);
-                } else if (comp(coord, globalHeap.front())) {
-                    std::pop_heap(globalHeap.begin(), globalHeap.end(), comp);
-                    globalHeap.pop_back();
-
-                    globalHeap.push_back(coord);
-                    std::push_heap(globalHeap.begin(), globalHeap.end(), comp);
-                }
-            }
+        TraceScope trace("worker", "worker", "worker", worker);
+        size_t tile;
+        while (tiles.pop(worker, tile)) {
+            TraceScope tileTrace("tile", "worker", "tile", tile);
+            size_t y = (tile / tilesX) * TILE_SIZE;
+            size_t x = (tile % tilesX) * TILE_SIZE;
+            size_t endTileY = std::min(y + TILE_SIZE, acc.rows());
+            size_t endTileX = std::min(x + TILE_SIZE, acc.cols());
+            processSubImage(acc, localHeap, topN, y, endTileY, x, endTileX, &bound, &candidates);
         }
     }
 
@@ -874,28 +1246,144 @@ std::vector<PixelCoord> processImageParallelWithTiling(size_t topN, size_t TILE_
 
 
 std::vector<PixelCoord> processImageParallelV16(size_t topN) {
-    return processImageParallelWithTiling(16, topN);
+    return processImageParallelWithTiling(topN, 16);
 }
 
 std::vector<PixelCoord> processImageParallelV32(size_t topN) {
-    return processImageParallelWithTiling(32, topN);
+    return processImageParallelWithTiling(topN, 32);
 }
 
 
 std::vector<PixelCoord> processImageParallelV64(size_t topN) {
-    return processImageParallelWithTiling(64, topN);
+    return processImageParallelWithTiling(topN, 64);
 }
 
 std::vector<PixelCoord> processImageParallelV128(size_t topN) {
-    return processImageParallelWithTiling(128, topN);
+    return processImageParallelWithTiling(topN, 128);
 }
 
 std::vector<PixelCoord> processImageParallelV512(size_t topN) {
-    return processImageParallelWithTiling(512, topN);
+    return processImageParallelWithTiling(topN, 512);
 }
 
 std::vector<PixelCoord> processImageParallelV1024(size_t topN) {
-    return processImageParallelWithTiling(1024, topN);
+    return processImageParallelWithTiling(topN, 1024);
+}
+
+
+/*
+ * ********************************
+ *   processImageTileSummary
+ * ********************************
+ */
+static constexpr size_t SUMMARY_TILE_SIZE = 64;
+
+// Tile max/count summary of the image, built in parallel on first use and
+// kept in the DerivedPixelData of the image, so every processor of the same
+// decoded frame reuses it (on the processor for images without one). The
+// image must not change afterwards, or call invalidateTileSummary(). Asking
+// for another tile size rebuilds it.
+std::shared_ptr<const TileSummary<T>> tileSummary(size_t tileSize = SUMMARY_TILE_SIZE) {
+    std::shared_ptr<DerivedPixelData> derived = image.derivedData();
+    std::lock_guard<std::mutex> lock(derived ? derived->mutex : tileSummaryMutex);
+    std::shared_ptr<const void>& cache = derived ? derived->tileSummary : tileSummaryCache;
+    auto summary = std::static_pointer_cast<const TileSummary<T>>(cache);
+    if (!summary || summary->tileSize != tileSize) {
+        summary = dispatch([&](const auto& acc) { return buildTileSummaryKernel(acc, tileSize); });
+        cache = summary;
+    }
+    return summary;
+}
+
+void invalidateTileSummary() {
+    std::shared_ptr<DerivedPixelData> derived = image.derivedData();
+    std::lock_guard<std::mutex> lock(derived ? derived->mutex : tileSummaryMutex);
+    (derived ? derived->tileSummary : tileSummaryCache).reset();
+}
+
+template<typename Acc>
+std::shared_ptr<const TileSummary<T>> buildTileSummaryKernel(const Acc& acc, size_t tileSize) {
+    auto summary = std::make_shared<TileSummary<T>>();
+    summary->tileSize = tileSize;
+    summary->tilesX = (acc.cols() + tileSize - 1) / tileSize;
+    summary->tilesY = (acc.rows() + tileSize - 1) / tileSize;
+    size_t numTiles = summary->tilesX * summary->tilesY;
+    summary->max.assign(numTiles, std::numeric_limits<T>::lowest());
+    summary->countAtMax.assign(numTiles, 0);
+
+    // one task per band of tile rows, each writes its own tiles
+    size_t tasks = std::max<size_t>(1, std::min(parallelTasks(acc), summary->tilesY));
+    ThreadPool::instance().run(tasks, [&](size_t task) {
+        size_t firstTileY = task * summary->tilesY / tasks;
+        size_t endTileY = (task + 1) * summary->tilesY / tasks;
+        for (size_t y = firstTileY * tileSize; y < std::min(endTileY * tileSize, acc.rows()); ++y) {
+            size_t tileRow = (y / tileSize) * summary->tilesX;
+            for (size_t tx = 0; tx < summary->tilesX; ++tx) {
+                T& max = summary->max[tileRow + tx];
+                uint32_t& count = summary->countAtMax[tileRow + tx];
+                for (size_t x = tx * tileSize; x < std::min((tx + 1) * tileSize, acc.cols()); ++x) {
+                    T value = acc.at(x, y);
+                    if (value > max) {
+                        max = value;
+                        count = 1;
+                    } else if (value == max) {
+                        ++count;
+                    }
+                }
+            }
+        }
+    });
+
+    summary->order.resize(numTiles);
+    std::iota(summary->order.begin(), summary->order.end(), 0);
+    std::stable_sort(summary->order.begin(), summary->order.end(),
+                     [&](uint32_t a, uint32_t b) { return summary->max[a] > summary->max[b]; });
+    return summary;
+}
+
+// Tiles visited by descending max from the shared pool: the heaps fill with
+// the brightest pixels first, and the scan stops at the first tile whose max
+// is not above the shared bound, or below the floor of the summary counts.
+// Only the first query of a frame pays for the summary.
+std::vector<PixelCoord> processImageTileSummary(size_t topN) {
+    if (topN <= 0 || image.size() < 1) {
+        std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
+        return {};
+    }
+    topN = std::min(topN, image.size());
+
+    std::shared_ptr<const TileSummary<T>> summary = tileSummary();
+    return dispatch([&](const auto& acc) { return processImageTileSummaryKernel(acc, *summary, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageTileSummaryKernel(const Acc& acc, const TileSummary<T>& summary, size_t topN) {
+    T floor = summary.floorFor(topN);
+    size_t numTiles = summary.order.size();
+    size_t numThreads = std::max<size_t>(1, std::min(parallelTasks(acc), numTiles));
+
+    ScratchArena::Lease arena(scratch);
+    std::vector<std::vector<PixelCoord>>& localHeaps = arena->localHeaps(numThreads);
+    AtomicLowerBound<T> bound;
+    std::atomic<size_t> next{0};
+
+    ThreadPool::instance().run(numThreads, [&](size_t i) {
+        localHeaps[i].reserve(topN);
+        for (size_t k = next++; k < numTiles; k = next++) {
+            size_t tile = summary.order[k];
+            T tileMax = summary.max[tile];
+            // the order is descending: no later tile can do better
+            if (tileMax < floor || (bound.isSet() && !(tileMax > bound.get()))) {
+                break;
+            }
+            size_t y = (tile / summary.tilesX) * summary.tileSize;
+            size_t x = (tile % summary.tilesX) * summary.tileSize;
+            processSubImage(acc, localHeaps[i], topN, y, std::min(y + summary.tileSize, acc.rows()),
+                            x, std::min(x + summary.tileSize, acc.cols()), &bound, &arena->candidates(i));
+        }
+    });
+
+    return mergeLocalHeaps(acc, localHeaps, topN);
 }
 
 
@@ -911,25 +1399,31 @@ std::vector<PixelCoord> processImageCS(size_t topN) {
     }
     topN = std::min(topN, image.size());
 
+    return dispatch([&](const auto& acc) { return processImageCSKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageCSKernel(const Acc& acc, size_t topN) {
      // get the max
     //decltype(image.getPixelValue(0, 0))  maxPixelValue = 0; //the sise of that depend on Image
     T maxPixelValue = 0;
 
-    for (size_t y = 0; y < image.rows(); ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
-            T pixelValue = image.getPixelValue(x, y);
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
+            T pixelValue = acc.at(x, y);
             if (pixelValue > maxPixelValue) {
                 maxPixelValue = pixelValue;
             }
         }
     }
 
-    // use the max valuse to build buckets
-    std::vector<std::vector<PixelCoord>> buckets(maxPixelValue + 1);
+    // use the max valuse to build buckets (kept by the arena between calls)
+    ScratchArena::Lease arena(scratch);
+    std::vector<std::vector<PixelCoord>>& buckets = arena->buckets(static_cast<size_t>(maxPixelValue) + 1);
 
-    for (size_t y = 0; y < image.rows(); ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
-            T pixelValue = image.getPixelValue(x, y);
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
+            T pixelValue = acc.at(x, y);
             buckets[pixelValue].emplace_back(x, y);
         }
     }
@@ -958,12 +1452,18 @@ std::vector<PixelCoord> processImageCS_MAP( size_t topN) {
     }
     topN = std::min(topN, image.size());
 
-    std::unordered_map<T, std::vector<PixelCoord>> buckets;
+    return dispatch([&](const auto& acc) { return processImageCS_MAPKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageCS_MAPKernel(const Acc& acc, size_t topN) {
+    ScratchArena::Lease arena(scratch);
+    std::pmr::unordered_map<T, std::pmr::vector<PixelCoord>> buckets(arena->nodes());
 
     // build buckets using hashmap
-    for (size_t y = 0; y < image.rows(); ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
-            T pixelValue = image.getPixelValue(x, y);
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
+            T pixelValue = acc.at(x, y);
             buckets[pixelValue].emplace_back(x, y);
         }
     }
@@ -995,6 +1495,220 @@ std::vector<PixelCoord> processImageCS_MAP( size_t topN) {
 }
 
 
+/*
+ * ********************************
+ *   processImage Histogram Select
+ * ********************************
+ * Two streaming passes and a fixed 2^bits count array instead of one bucket
+ * vector per value: the first pass builds the histogram, the cut-off value is
+ * where the cumulative count from the top reaches topN, the second pass writes
+ * only pixels at or above the cut-off directly into their value-descending
+ * slot of a topN sized output buffer and stops as soon as it is full.
+ * The histogram is sized by the storage type of the image, so 8-bit frames
+ * only need 256 counters.
+ */
+std::vector<PixelCoord> processImageHistogramSelect(size_t topN) {
+    if (topN <= 0 || image.size() < 1) {
+        std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
+        return {};
+    }
+    topN = std::min(topN, image.size());
+
+    return dispatch([&](const auto& acc) { return processImageHistogramSelectKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageHistogramSelectKernel(const Acc& acc, size_t topN) {
+    using P = typename Acc::pixel_type;
+
+    if constexpr (!std::is_integral<P>::value || sizeof(P) > 2) {
+        return processImageHeapKernel(acc, topN); // value range too wide for a count array
+    } else {
+        if (acc.rows() * acc.cols() > std::numeric_limits<uint32_t>::max()) {
+            return processImageHeapKernel(acc, topN);
+        }
+
+        ScratchArena::Lease arena(scratch);
+        std::vector<uint32_t>& histogram = arena->histogram(size_t(1) << (8 * sizeof(P)));
+        P maxPixelValue = 0;
+
+        for (size_t y = 0; y < acc.rows(); ++y) {
+            for (size_t x = 0; x < acc.cols(); ++x) {
+                P pixelValue = acc.pixel(x, y);
+                ++histogram[pixelValue];
+                if (pixelValue > maxPixelValue) {
+                    maxPixelValue = pixelValue;
+                }
+            }
+        }
+
+        // Walk down from the max until the cut-off bucket completes topN.
+        // Saturated or uniform frames stop right at the max value.
+        size_t above = 0;
+        P cutOff = maxPixelValue;
+        while (above + histogram[cutOff] < topN) {
+            above += histogram[cutOff];
+            --cutOff;
+        }
+
+        // Reuse the buckets [cutOff, max] as write offsets in the output buffer,
+        // pixels equal to the cut-off only fill the tail up to topN.
+        uint32_t offset = 0;
+        for (size_t val = maxPixelValue; val > cutOff; --val) {
+            uint32_t count = histogram[val];
+            histogram[val] = offset;
+            offset += count;
+        }
+        histogram[cutOff] = offset;
+
+        std::vector<PixelCoord> topPixels(topN, PixelCoord(0, 0));
+        size_t remaining = topN;
+
+        for (size_t y = 0; y < acc.rows() && remaining > 0; ++y) {
+            for (size_t x = 0; x < acc.cols(); ++x) {
+                P pixelValue = acc.pixel(x, y);
+                if (pixelValue < cutOff) {
+                    continue;
+                }
+                uint32_t& slot = histogram[pixelValue];
+                if (slot < topN) {
+                    topPixels[slot++] = PixelCoord(x, y);
+                    if (--remaining == 0) {
+                        break;
+                    }
+                }
+            }
+        }
+
+        return topPixels;
+    }
+}
+
+
+/*
+ * ********************************
+ *   processImagePackedKeys
+ * ********************************
+ */
+// Heap of 8-byte PackedKey (utils.h) instead of PixelCoord: a sift is a plain
+// integer compare with no image read, ties go to the lower row-major index.
+// Keys are turned back into PixelCoord only for the result.
+std::vector<PixelCoord> processImagePackedKeys(size_t topN) {
+    if (topN <= 0 || image.size() < 1) {
+        std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
+        return {};
+    }
+    topN = std::min(topN, image.size());
+
+    return dispatch([&](const auto& acc) { return processImagePackedKeysKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImagePackedKeysKernel(const Acc& acc, size_t topN) {
+    if constexpr (!packableValue<T>()) {
+        return processImageHeapKernel(acc, topN); // value wider than the key half
+    } else {
+        if (acc.rows() * acc.cols() > std::numeric_limits<uint32_t>::max()) {
+            return processImageHeapKernel(acc, topN);
+        }
+
+        ScratchArena::Lease arena(scratch);
+        const std::vector<PackedKey>& heap = selectPackedKeys(acc, topN, *arena);
+        std::vector<PixelCoord> topPixels;
+        topPixels.reserve(heap.size());
+        for (PackedKey key : heap) {
+            topPixels.push_back(keyCoord(key, acc.cols()));
+        }
+        return topPixels;
+    }
+}
+
+// Keys of the topN pixels, as a min-heap in the packed keys of the arena.
+// T must be packable and the image at most 2^32 pixels.
+template<typename Acc>
+std::vector<PackedKey>& selectPackedKeys(const Acc& acc, size_t topN, ScratchArena& arena) {
+    PackedKeyHeap<T> heap(topN, acc.cols(), std::move(arena.packedKeys()), std::move(arena.rowCandidates()));
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        heap.pushRow(acc, y, y);
+    }
+    arena.rowCandidates() = heap.releaseCandidates();
+    return arena.packedKeys() = heap.release();
+}
+
+
+/*
+ * ********************************
+ *   processImageValues
+ * ********************************
+ */
+// topN pixels with their values, in descending value order (lower row-major
+// index first on ties). The values are decoded from the packed keys of the
+// selection, the image is not read again.
+PixelValues<T> processImageValues(size_t topN) {
+    if (topN <= 0 || image.size() < 1) {
+        std::cout << "Invalid input: topN is <= 0 or image has no pixels.\n";
+        return {};
+    }
+    topN = std::min(topN, image.size());
+
+    return dispatch([&](const auto& acc) { return processImageValuesKernel(acc, topN); });
+}
+
+template<typename Acc>
+PixelValues<T> processImageValuesKernel(const Acc& acc, size_t topN) {
+    TOPN_STAGE_TIMER(Scan);
+    if constexpr (packableValue<T>()) {
+        if (acc.rows() * acc.cols() <= std::numeric_limits<uint32_t>::max()) {
+            ScratchArena::Lease arena(scratch);
+            return sortedKeysToPixelValues<T>(selectPackedKeys(acc, topN, *arena), acc.cols());
+        }
+    }
+
+    // no packed keys: values come from the accessor
+    PixelValues<T> result;
+    result.reserve(topN);
+    std::vector<PixelCoord> pixels = processImageHeapKernel(acc, topN);
+    std::sort_heap(pixels.begin(), pixels.end(), ComparePixelVal<Acc>(acc));
+    for (const auto& p : pixels) {
+        result.push_back(p.x, p.y, acc.at(p.x, p.y));
+    }
+    return result;
+}
+
+// The values come with the selection, already in output order: the image is
+// not read again and the result not sorted again.
+void processImageTo(size_t topN, ResultWriter& writer) override {
+    writer.write(processImageValues(topN));
+}
+
+
+/*
+ * ********************************
+ *   processImageMulti
+ * ********************************
+ */
+// One selection for the largest N, ordered once (processImageValues): the
+// answer for every smaller N is a prefix of it, so the image is scanned once
+// whatever the number of requested N. Results are in the order of topNs.
+std::vector<std::vector<PixelCoord>> processImageMulti(const std::vector<size_t>& topNs) override {
+    std::vector<std::vector<PixelCoord>> results(topNs.size());
+    size_t maxN = topNs.empty() ? 0 : *std::max_element(topNs.begin(), topNs.end());
+    if (maxN == 0 || image.size() < 1) {
+        return results;
+    }
+
+    PixelValues<T> ordered = processImageValues(maxN);
+    for (size_t i = 0; i < topNs.size(); ++i) {
+        size_t n = std::min(topNs[i], ordered.size());
+        results[i].reserve(n);
+        for (size_t k = 0; k < n; ++k) {
+            results[i].emplace_back(ordered.x[k], ordered.y[k]);
+        }
+    }
+    return results;
+}
+
+
 /*
  * ********************************
  *   processImageSet
@@ -1026,7 +1740,7 @@ struct ComparePixelValAndCoordCopy {
 
 
 
-std::vector<PixelCoord> convertSetToVector(const std::set<PixelAll, ComparePixelValAndCoordCopy>& topPixels) {
+std::vector<PixelCoord> convertSetToVector(const std::pmr::set<PixelAll, ComparePixelValAndCoordCopy>& topPixels) {
     std::vector<PixelCoord> result;
     for (const auto& item : topPixels) {
         result.emplace_back(item.x, item.y);
@@ -1041,13 +1755,19 @@ std::vector<PixelCoord> processImageSetCopy(size_t topN) {
     }
     topN = std::min(topN, image.size());
 
-    std::set<PixelAll, ComparePixelValAndCoordCopy> topPixels;
+    return dispatch([&](const auto& acc) { return processImageSetCopyKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageSetCopyKernel(const Acc& acc, size_t topN) {
+    ScratchArena::Lease arena(scratch);
+    std::pmr::set<PixelAll, ComparePixelValAndCoordCopy> topPixels(arena->nodes());
 
     //topPixels.reserve(topN);
 
-    for (size_t y = 0; y < image.rows(); ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
-            T pixelValue = image.getPixelValue(x, y);
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
+            T pixelValue = acc.at(x, y);
             PixelAll currentPixel(x, y, pixelValue);
 
             if (topPixels.size() < topN) {
@@ -1074,19 +1794,25 @@ std::vector<PixelCoord> processImageSetOld(size_t topN) {
     }
     topN = std::min(topN, image.size());
 
-    ComparePixelVal comp(image);
-    std::set<PixelCoord, ComparePixelVal> topPixels{comp}; 
+    return dispatch([&](const auto& acc) { return processImageSetOldKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageSetOldKernel(const Acc& acc, size_t topN) {
+    ComparePixelVal<Acc> comp(acc);
+    ScratchArena::Lease arena(scratch);
+    std::pmr::set<PixelCoord, ComparePixelVal<Acc>> topPixels(comp, arena->nodes());
 
     //topPixels.reserve(topN);
-    for (size_t y = 0; y < image.rows(); ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
-            T pixelValue = image.getPixelValue(x, y);
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
+            T pixelValue = acc.at(x, y);
             //PixelAll currentPixel(x, y, pixelValue);
             if (topPixels.size() < topN) {
                 topPixels.insert({x,y});
             } else {
                 auto itLowest = topPixels.begin(); // The element with the smallest value is the first one
-                T pixelLowestValue = image.getPixelValue(itLowest->x, itLowest->y);
+                T pixelLowestValue = acc.at(itLowest->x, itLowest->y);
                 if (pixelValue > pixelLowestValue) {
                     topPixels.erase(itLowest); 
                     topPixels.insert({x,y});
@@ -1107,13 +1833,19 @@ std::vector<PixelCoord> processImageSet(size_t topN) {
     }
     topN = std::min(topN, image.size());
 
-    std::set<T> topPixelValues; 
-    std::unordered_map<T, std::vector<PixelCoord>> pixelValueToCoords;
+    return dispatch([&](const auto& acc) { return processImageSetKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageSetKernel(const Acc& acc, size_t topN) {
+    ScratchArena::Lease arena(scratch);
+    std::pmr::set<T> topPixelValues(arena->nodes());
+    std::pmr::unordered_map<T, std::pmr::vector<PixelCoord>> pixelValueToCoords(arena->nodes());
     size_t totalCoords = 0;
 
-    for (size_t y = 0; y < image.rows(); ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
-            T pixelValue = image.getPixelValue(x, y);
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
+            T pixelValue = acc.at(x, y);
             if (totalCoords < topN) {
                 topPixelValues.insert(pixelValue);
                 pixelValueToCoords[pixelValue].push_back({x, y});
@@ -1152,13 +1884,19 @@ std::vector<PixelCoord> processImageSetNice(size_t topN) {
     }
     topN = std::min(topN, image.size());
 
-    std::set<T> topPixelValues; 
-    std::unordered_map<T, std::unordered_map<T, size_t>> pixelValueToCoords;
+    return dispatch([&](const auto& acc) { return processImageSetNiceKernel(acc, topN); });
+}
+
+template<typename Acc>
+std::vector<PixelCoord> processImageSetNiceKernel(const Acc& acc, size_t topN) {
+    ScratchArena::Lease arena(scratch);
+    std::pmr::set<T> topPixelValues(arena->nodes());
+    std::pmr::unordered_map<T, std::pmr::unordered_map<T, size_t>> pixelValueToCoords(arena->nodes());
     size_t totalCoords = 0;
 
-    for (size_t y = 0; y < image.rows(); ++y) {
-        for (size_t x = 0; x < image.cols(); ++x) {
-            T pixelValue = image.getPixelValue(x, y);
+    for (size_t y = 0; y < acc.rows(); ++y) {
+        for (size_t x = 0; x < acc.cols(); ++x) {
+            T pixelValue = acc.at(x, y);
             if (totalCoords < topN) {
                 topPixelValues.insert(pixelValue);
                 pixelValueToCoords[pixelValue][x]++;//.push_back({x, y});
@@ -1177,8 +1915,8 @@ std::vector<PixelCoord> processImageSetNice(size_t topN) {
                         if (it->second == 0) { // If the value is 0, delete the element
                             map.erase(it);
                             if (map.empty()) { 
+                                pixelValueToCoords.erase(*itLowest); // before itLowest is invalidated
                                 topPixelValues.erase(itLowest);
-                                pixelValueToCoords.erase(*itLowest);
                             }
                         }
                     //}
@@ -1197,10 +1935,10 @@ std::vector<PixelCoord> processImageSetNice(size_t topN) {
     for (const auto& val : topPixelValues) {
         const auto& coords = pixelValueToCoords[val];
         for (const auto& xCoord : coords) {
-            int x = xCoord.first;
-            int count = xCoord.second; // The number of times val appears in column x
-            for (int y = 0; y < image.rows() && count > 0; ++y) { 
-                if (image.getPixelValue(x, y) == val) {
+            size_t x = xCoord.first;
+            size_t count = xCoord.second; // The number of times val appears in column x
+            for (size_t y = 0; y < acc.rows() && count > 0; ++y) {
+                if (acc.at(x, y) == val) {
                     result.emplace_back(x, y);
                     --count;
                 }
@@ -1223,19 +1961,100 @@ std::vector<PixelCoord> processImageSetNice(size_t topN) {
  * ********************************
  */
 
-/* 
-//
-std::shared_ptr<IImageProcessor> createImageProcessor(std::shared_ptr<IImageWrapper> wrapper) {
-    cv::Mat img = wrapper->getImage();
-    
-    switch(img.depth()) {
-        case CV_8U:
-            return std::make_shared<ImageProcessor<uint8_t>>(wrapper);
-        case CV_16U:
-            return std::make_shared<ImageProcessor<uint16_t>>(wrapper);
-        default:
-            throw std::runtime_error("Unsupported image type.");
+};//end */
+
+
+/*
+ * Push-rows front end of the packed key selection, for images that arrive in
+ * bands (streamed decode). pushRows takes the next rows of the image as an
+ * ImageView of any supported depth; the band can be freed as soon as it
+ * returns, only the topN keys are kept.
+ */
+template<typename T>
+class StreamingSelector {
+public:
+    StreamingSelector(size_t topN, size_t rows, size_t cols)
+        : imageRows(rows), imageCols(cols), heap(std::min(topN, rows * cols), cols) {
+        if (rows * cols > std::numeric_limits<uint32_t>::max()) {
+            throw std::runtime_error("Image too large for streamed selection (more than 2^32 pixels).");
+        }
     }
-}*/
 
-};//end */
+    void pushRows(const ImageView& band) {
+        if (band.cols != imageCols || nextRow + band.rows > imageRows) {
+            throw std::runtime_error("Band does not match the image geometry.");
+        }
+        if (band.encoded()) {
+            switch (band.depth) {
+                case CV_16U:
+                    pushBand(EncodedViewAccessor<T, uint16_t>(band));
+                    return;
+                case CV_32F:
+                    pushBand(EncodedViewAccessor<T, float>(band));
+                    return;
+                default:
+                    throw std::runtime_error("Unsupported image depth.");
+            }
+        }
+        switch (band.depth) {
+            case CV_8U:
+                pushBand(ViewAccessor<T, uint8_t>(band));
+                break;
+            case CV_16U:
+                pushBand(ViewAccessor<T, uint16_t>(band));
+                break;
+            case CV_32F:
+                pushBand(ViewAccessor<T, float>(band));
+                break;
+            default:
+                throw std::runtime_error("Unsupported image depth.");
+        }
+    }
+
+    size_t rowsSeen() const { return nextRow; }
+
+    std::vector<PixelCoord> result() const {
+        std::vector<PixelCoord> pixels;
+        pixels.reserve(heap.keys().size());
+        for (PackedKey key : heap.keys()) {
+            pixels.push_back(keyCoord(key, imageCols));
+        }
+        return pixels;
+    }
+
+    PixelValues<T> values() const {
+        return keysToPixelValues<T>(heap.keys(), imageCols);
+    }
+
+private:
+    size_t imageRows;
+    size_t imageCols;
+    size_t nextRow = 0;
+    PackedKeyHeap<T> heap;
+
+    template<typename Acc>
+    void pushBand(const Acc& acc) {
+        for (size_t y = 0; y < acc.rows(); ++y) {
+            heap.pushRow(acc, y, nextRow + y);
+        }
+        nextRow += acc.rows();
+    }
+};
+
+
+/*
+ * Processor matching the value type of the image: ImageProcessor<uint8_t>,
+ * <uint16_t> or <float>. The processor shares ownership of the image, and
+ * runs on arena when one is given (ImageProcessor::setScratchArena).
+ */
+inline std::shared_ptr<IImageProcessor> createImageProcessor(const AnyImage& image,
+                                                             std::shared_ptr<ScratchArena> arena = nullptr) {
+    return std::visit([&](const auto& img) -> std::shared_ptr<IImageProcessor> {
+        using T = typename std::decay_t<decltype(*img)>::value_type;
+        auto processor = std::make_shared<ImageProcessor<T>>(img);
+        if (arena) {
+            processor->setScratchArena(std::move(arena));
+        }
+        return processor;
+    }, image);
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <vector>
+
+#include "utils.h"
+
+
+/*
+ * Working memory of the strategies kept from one call to the next: the
+ * per-task heaps and SIMD candidate rows of the parallel kernels, the packed
+ * key heap, the counting sort buckets, the histogram select counts and a
+ * node pool for the std::set / unordered_map of the processImageSet*
+ * family. Buffers are cleared, never shrunk, so once the arena has grown to
+ * the frame size a call allocates only the result it returns.
+ *
+ * Slab i of a parallel section (localHeaps()[i], candidates(i)) belongs to
+ * task i alone: the tasks take no lock. The arena serves one call at a time,
+ * through a Lease.
+ */
+class ScratchArena {
+public:
+    /*
+     * Exclusive use of an arena for one call. When another call holds it
+     * (two threads on processors sharing the arena) the lease runs on a
+     * temporary arena instead: same result, no reuse.
+     */
+    class Lease {
+    public:
+        // arena may be nullptr: the lease then runs on a temporary arena.
+        explicit Lease(const std::shared_ptr<ScratchArena>& arena);
+
+        ScratchArena& operator*() const { return *current; }
+        ScratchArena* operator->() const { return current; }
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+    private:
+        std::shared_ptr<ScratchArena> held;
+        std::unique_lock<std::mutex> lock;
+        ScratchArena* current;
+    };
+
+    // numTasks empty heaps, and as many candidate rows. Call before the
+    // parallel section.
+    std::vector<std::vector<PixelCoord>>& localHeaps(size_t numTasks);
+
+    // Candidate row of task i of the last localHeaps(); sized by the caller.
+    std::vector<uint32_t>& candidates(size_t task) { return taskCandidates[task]; }
+
+    // Storage of a single-threaded kernel: the packed key heap (cleared) and
+    // its candidate row.
+    std::vector<PackedKey>& packedKeys();
+    std::vector<uint32_t>& rowCandidates() { return singleCandidates; }
+
+    // At least count buckets, all empty.
+    std::vector<std::vector<PixelCoord>>& buckets(size_t count);
+
+    // bins zeroed counters.
+    std::vector<uint32_t>& histogram(size_t bins);
+
+    // Node memory for std::pmr containers; freed blocks go back to the pool.
+    // The containers must be gone before release().
+    std::pmr::memory_resource* nodes() { return &nodePool; }
+
+    // Capacity held by the vectors, node pool not included.
+    size_t reservedBytes() const;
+
+    // Gives the memory back, after a frame much larger than the usual ones.
+    void release();
+
+private:
+    std::mutex mutex; // held by a Lease
+    std::vector<std::vector<PixelCoord>> heaps;
+    std::vector<std::vector<PixelCoord>> spareHeaps;
+    std::vector<std::vector<uint32_t>> taskCandidates;
+    std::vector<uint32_t> singleCandidates;
+    std::vector<PackedKey> keys;
+    std::vector<std::vector<PixelCoord>> bucketStorage;
+    std::vector<uint32_t> counts;
+    std::pmr::unsynchronized_pool_resource nodePool;
+};
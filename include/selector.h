@@ -0,0 +1,147 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+/*
+ * Strategies processImage can run, see ImageProcessor::runStrategy.
+ */
+enum class Strategy : uint8_t {
+    HeapBest,
+    ParallelV1,
+    ParallelV512,
+    CountingSort,
+    HistogramSelect,
+    PackedKeys,
+    TileSummary,
+    Count
+};
+
+constexpr size_t STRATEGY_COUNT = static_cast<size_t>(Strategy::Count);
+
+const char* strategyName(Strategy strategy);
+
+
+/*
+ * What the selector knows of a query: geometry, the pool tasks a parallel
+ * strategy gets, topN ratio and a sampled 64-bin histogram (see
+ * ImageProcessor::imageFeatures).
+ * dominantShare is the share of the fullest bin: close to 1 for uniform
+ * frames and dark star fields, 1/64 for noise spread over the whole range.
+ */
+struct ImageFeatures {
+    size_t rows = 0;
+    size_t cols = 0;
+    size_t tasks = 1;           // ThreadPool::tasksFor(pixels)
+    bool integralValues = true; // processor value type, CountingSort needs it
+    size_t topN = 0;
+    double topNRatio = 0;
+    double dominantShare = 0;
+
+    size_t pixels() const { return rows * cols; }
+};
+
+
+/*
+ * Node of the compiled decision tree of include/strategy_tree.h, generated by
+ * tools/train_strategy_tree from the matrix_data.csv of bench/bench.cpp.
+ * An inner node goes left when its feature is <= threshold, a leaf
+ * (feature == TREE_LEAF) holds the strategy. Nodes are stored in preorder.
+ */
+enum TreeFeature : int8_t {
+    TREE_LEAF = -1,
+    TREE_PIXELS = 0,
+    TREE_TOPN_RATIO = 1,
+};
+
+struct StrategyTreeNode {
+    int8_t feature;
+    double threshold;
+    uint16_t left;
+    uint16_t right;
+    Strategy strategy;
+};
+
+// A few compares, no I/O: fit for every processImage call.
+template<size_t N>
+constexpr Strategy evaluateStrategyTree(const StrategyTreeNode (&nodes)[N], double pixels, double topNRatio) {
+    size_t i = 0;
+    while (i < N && nodes[i].feature != TREE_LEAF) {
+        double value = nodes[i].feature == TREE_PIXELS ? pixels : topNRatio;
+        i = value <= nodes[i].threshold ? nodes[i].left : nodes[i].right;
+    }
+    return i < N ? nodes[i].strategy : Strategy::ParallelV1;
+}
+
+
+/*
+ * Linear cost model of one strategy, in microseconds:
+ *   cost = overhead + perPixel * pixels + perTaskPixel * pixels / tasks
+ *        + perHeapOp * topN * log2(topN + 1)
+ *        + perDominantPixel * pixels * dominantShare
+ * perTaskPixel is the scan of a parallel strategy, split over the pool tasks.
+ * The coefficients come from calibrate(), a short micro-benchmark of every
+ * strategy on synthetic images, and are persisted in a text file.
+ */
+struct StrategyCost {
+    double overhead = 0;
+    double perPixel = 0;
+    double perTaskPixel = 0;
+    double perHeapOp = 0;
+    double perDominantPixel = 0;
+
+    double predict(const ImageFeatures& features) const;
+
+    // Least squares fit to micros[i], the time of the query features[i],
+    // with every coefficient >= 0. What calibrate() runs on its timings.
+    static StrategyCost fit(const std::vector<ImageFeatures>& features, const std::vector<double>& micros);
+};
+
+
+/*
+ * Picks the strategy of processImage with the lowest predicted cost among
+ * those applicable to the query. Until a model is calibrated or loaded it
+ * keeps the former fixed choice, ParallelV1. Thread safe.
+ */
+class StrategySelector {
+public:
+    static StrategySelector& instance() {
+        static StrategySelector selector;
+        return selector;
+    }
+
+    Strategy choose(const ImageFeatures& features) const;
+
+    bool calibrated() const;
+    StrategyCost cost(Strategy strategy) const;
+    void setCost(Strategy strategy, const StrategyCost& cost);
+    void reset(); // back to the fixed choice, no model
+
+    // Cost file written by save(): one line per strategy, for the thread
+    // count of the pool it was measured with. False when it is missing,
+    // unreadable or measured with another pool size.
+    bool load(const std::string& path);
+    void save(const std::string& path) const;
+
+    // Micro-benchmark (a few seconds) of every strategy on synthetic 16-bit
+    // images of several classes, sizes and topN ratios; least squares fit of
+    // each StrategyCost. The sizes are several times the pool grain, so the
+    // parallel strategies are measured on as many tasks as they get in use.
+    void calibrate();
+
+    // Startup entry point: load path, or calibrate and save to it.
+    // Returns true when the model was loaded.
+    bool loadOrCalibrate(const std::string& path);
+
+    static bool applicable(Strategy strategy, const ImageFeatures& features);
+
+private:
+    mutable std::mutex mutex;
+    std::array<StrategyCost, STRATEGY_COUNT> costs{};
+    bool hasModel = false;
+};
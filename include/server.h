@@ -0,0 +1,105 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "image.h"
+#include "imagecache.h"
+
+
+/*
+ * Daemon mode: answers top N requests over a local Unix domain socket, so
+ * the process, the worker pool and the decoders stay warm between images.
+ *
+ * Line protocol, any number of requests per connection:
+ *   TOPN <top_n> <json|bin> path <image_path>\n
+ *   TOPN <top_n> <json|bin> raw <rows> <cols> <u8|u16|f32>\n<rows*cols pixels, host order>
+ * Replies:
+ *   OK <length>\n<length bytes: the JSON document or the binary result>
+ *   ERR <message>\n
+ * "STATS\n" replies with the image cache counters as a JSON object,
+ * "METRICS\n" with the stage timers of metrics.h as Prometheus text.
+ * A malformed request line, or a raw image over the byte limit, gets an ERR
+ * and the connection is closed, as does any failure once a raw request line
+ * is accepted (its pixels may be left unread).
+ */
+class TopNServer {
+public:
+    static constexpr size_t DEFAULT_MAX_RAW_BYTES = size_t(256) << 20;
+
+    // Binds and listens right away: clients may connect before run().
+    // With cacheBytes > 0 images read by path are kept decoded in a
+    // CachingImageReader of that budget (PNG then skips the band streaming).
+    // Raw requests of more than maxRawBytes of pixels are refused.
+    explicit TopNServer(const std::string& socketPath, size_t cacheBytes = 0,
+                        size_t maxRawBytes = DEFAULT_MAX_RAW_BYTES);
+    ~TopNServer();
+
+    TopNServer(const TopNServer&) = delete;
+    TopNServer& operator=(const TopNServer&) = delete;
+
+    // Accepts and serves connections, one thread each, until stop().
+    void run();
+
+    // Makes run() return; safe from another thread or a signal handler.
+    void stop();
+
+    size_t requestsServed() const { return served; }
+    ImageCacheStats cacheStats() const;
+
+private:
+    struct Connection {
+        int fd = -1;
+        std::thread thread;
+        std::atomic<bool> done{false};
+    };
+
+    std::string path;
+    int listenFd = -1;
+    int wakePipe[2] = {-1, -1};
+    size_t maxRaw;
+    std::atomic<size_t> served{0};
+    std::unique_ptr<CachingImageReader> cache;
+
+    std::mutex connectionsMutex;
+    std::list<Connection> connections;
+
+    void serve(Connection& connection);
+    void reapConnections(bool all);
+};
+
+
+/*
+ * Client side of the TopNServer protocol: one connection, requests are
+ * answered in order. Returns the result bytes, throws std::runtime_error
+ * with the server message on ERR.
+ */
+class TopNClient {
+public:
+    explicit TopNClient(const std::string& socketPath);
+    ~TopNClient();
+
+    TopNClient(const TopNClient&) = delete;
+    TopNClient& operator=(const TopNClient&) = delete;
+
+    std::string queryPath(const std::string& imagePath, size_t topN, bool binary = false);
+
+    // Sends the pixels inline (CV_8U, CV_16U or CV_32F, single channel).
+    std::string queryBuffer(const cv::Mat& image, size_t topN, bool binary = false);
+
+    // Image cache counters of the server, JSON.
+    std::string queryStats();
+
+    // Stage timers of the server, Prometheus text.
+    std::string queryMetrics();
+
+private:
+    int fd = -1;
+    std::string buffered; // received, not yet consumed
+
+    std::string exchange(const std::string& request, const cv::Mat* payload);
+};
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+
+/*
+ * SIMD candidate filter for the heap scan loops.
+ * filterAbove writes to idx the positions i in [0, n) with row[i] > threshold
+ * and returns how many were written; idx must have room for n entries.
+ * It compares 16-64 pixels per step and only stores the indices that beat the
+ * threshold, so the caller touches its heap only for real candidates.
+ *
+ * The implementation is picked once at runtime from the CPU features
+ * (scalar, SSE4.2, AVX2, AVX-512), so a single binary runs on every x86-64
+ * machine; other architectures use the scalar build.
+ */
+enum class SimdLevel {
+    Scalar = 0,
+    SSE42 = 1,
+    AVX2 = 2,
+    AVX512 = 3
+};
+
+// Best level supported by this CPU.
+SimdLevel detectSimdLevel();
+
+// Level used by filterAbove.
+SimdLevel simdLevel();
+
+// Force a level, clamped to detectSimdLevel(). Used by tests and benchmarks.
+void setSimdLevel(SimdLevel level);
+
+const char* simdLevelName(SimdLevel level);
+
+size_t filterAbove(const uint8_t* row, size_t n, uint8_t threshold, uint32_t* idx);
+size_t filterAbove(const uint16_t* row, size_t n, uint16_t threshold, uint32_t* idx);
+size_t filterAbove(const float* row, size_t n, float threshold, uint32_t* idx);
+
+
+/*
+ * True when rows of storage type P can be filtered in the storage domain for a
+ * processor of value type T: P has a filterAbove overload and the P -> T
+ * conversion keeps the order, so p > p0 holds for every p with T(p) > T(p0).
+ */
+template<typename P, typename T>
+constexpr bool simdFilterable() {
+    constexpr bool supported = std::is_same<P, uint8_t>::value
+                            || std::is_same<P, uint16_t>::value
+                            || std::is_same<P, float>::value;
+    constexpr bool monotone = std::is_same<P, T>::value
+                           || (std::is_integral<P>::value && std::is_integral<T>::value
+                               && std::is_unsigned<P>::value && std::is_unsigned<T>::value
+                               && sizeof(T) >= sizeof(P));
+    return supported && monotone;
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// Generated by tools/train_strategy_tree from matrix_data.csv, do not edit:
+// make strategy_tree regenerates it.
+// 240 samples, 3 nodes, total time 2024.007 ms against 1999.287 ms
+// for the best pick of every sample.
+
+#include "selector.h"
+
+inline constexpr StrategyTreeNode STRATEGY_TREE[] = {
+    {TREE_TOPN_RATIO, 0.072277307510375977, 1, 2, Strategy::ParallelV1}, // 0
+    {TREE_LEAF, 0, 0, 0, Strategy::PackedKeys}, // 1
+    {TREE_LEAF, 0, 0, 0, Strategy::HistogramSelect}, // 2
+};
@@ -0,0 +1,260 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+
+
+/*
+ * Process-wide pool of persistent worker threads shared by all parallel
+ * strategies, so a call no longer pays thread creation and join.
+ *
+ * run(numTasks, task) executes task(0) .. task(numTasks - 1) and blocks until
+ * all of them finished. The calling thread takes part in the work, so a pool
+ * of size N keeps N - 1 workers and a pool of size 1 runs everything inline.
+ * Nested calls from a task are safe: the caller simply does the work itself
+ * when every worker is busy.
+ *
+ * tasksFor(pixels) is the minimum-grain policy: an image gets at most one
+ * task per minGrain pixels, so small images stay on the calling thread.
+ */
+class ThreadPool {
+public:
+    static constexpr size_t DEFAULT_MIN_GRAIN = 1 << 16; // pixels per task
+
+    static ThreadPool& instance() {
+        static ThreadPool pool(std::max(1u, std::thread::hardware_concurrency()));
+        return pool;
+    }
+
+    explicit ThreadPool(size_t numThreads) {
+        start(numThreads);
+    }
+
+    ~ThreadPool() {
+        stop();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // Change the number of threads (caller included). Must not be called
+    // while a run() is in progress.
+    void resize(size_t numThreads) {
+        stop();
+        start(numThreads);
+    }
+
+    size_t size() const { return numThreads; }
+
+    void setMinGrain(size_t pixels) { minGrain = std::max<size_t>(1, pixels); }
+    size_t getMinGrain() const { return minGrain; }
+
+    // Number of tasks worth running for an image of the given pixel count.
+    size_t tasksFor(size_t pixels) const {
+        size_t tasks = pixels / minGrain;
+        return std::max<size_t>(1, std::min(tasks, numThreads));
+    }
+
+    void run(size_t numTasks, const std::function<void(size_t)>& task) {
+        if (numTasks == 0) {
+            return;
+        }
+        if (numTasks == 1 || workers.empty()) {
+            for (size_t i = 0; i < numTasks; ++i) {
+                task(i);
+            }
+            return;
+        }
+
+        auto batch = std::make_shared<Batch>(numTasks, task);
+        size_t helpers = std::min(numTasks - 1, workers.size());
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            for (size_t i = 0; i < helpers; ++i) {
+                queue.emplace_back([batch] { batch->work(); });
+            }
+        }
+        queueCv.notify_all();
+
+        batch->work();
+
+        std::unique_lock<std::mutex> lock(batch->doneMutex);
+        if (batch->remaining.load() != 0) {
+            TraceScope wait("ThreadPool::run", "lock wait"); // idle until the helpers finish
+            batch->doneCv.wait(lock, [&] { return batch->remaining.load() == 0; });
+        }
+        if (batch->error) {
+            std::rethrow_exception(batch->error);
+        }
+    }
+
+private:
+    // One run() call: tasks are claimed by index by the caller and the helpers.
+    struct Batch {
+        const std::function<void(size_t)>& task;
+        size_t numTasks;
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> remaining;
+        std::mutex doneMutex;
+        std::condition_variable doneCv;
+        std::exception_ptr error;
+
+        Batch(size_t n, const std::function<void(size_t)>& t) : task(t), numTasks(n), remaining(n) {}
+
+        void work() {
+            for (size_t i = next++; i < numTasks; i = next++) {
+                try {
+                    task(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(doneMutex);
+                    if (!error) {
+                        error = std::current_exception();
+                    }
+                }
+                if (--remaining == 0) {
+                    std::lock_guard<std::mutex> lock(doneMutex);
+                    doneCv.notify_all();
+                }
+            }
+        }
+    };
+
+    size_t numThreads = 1;
+    size_t minGrain = DEFAULT_MIN_GRAIN;
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> queue;
+    std::mutex queueMutex;
+    std::condition_variable queueCv;
+    bool stopping = false;
+
+    void start(size_t n) {
+        numThreads = std::max<size_t>(1, n);
+        stopping = false;
+        for (size_t i = 1; i < numThreads; ++i) {
+            workers.emplace_back([this] { workerLoop(); });
+        }
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            stopping = true;
+        }
+        queueCv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+    }
+
+    void workerLoop() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueCv.wait(lock, [this] { return stopping || !queue.empty(); });
+                if (queue.empty()) {
+                    return; // stopping and drained
+                }
+                job = std::move(queue.front());
+                queue.pop_front();
+            }
+            job();
+        }
+    }
+};
+
+
+/*
+ * Per-worker deques of work items with stealing, used to balance tiles
+ * between the tasks of one ThreadPool::run. Each worker takes its own items
+ * from the front, in the order they were pushed (row-major tiles stay
+ * sequential in memory); a worker whose deque is empty steals from the back
+ * of the others, far from where their owner is working.
+ */
+template<typename Item>
+class WorkStealingDeques {
+public:
+    explicit WorkStealingDeques(size_t numWorkers) {
+        for (size_t i = 0; i < std::max<size_t>(1, numWorkers); ++i) {
+            slots.emplace_back(std::make_unique<Slot>());
+        }
+    }
+
+    size_t size() const { return slots.size(); }
+
+    void push(size_t worker, const Item& item) {
+        Slot& slot = *slots[worker];
+        std::lock_guard<std::mutex> lock(slot.mutex);
+        slot.items.push_back(item);
+    }
+
+    // Next item for worker, own first then stolen; false when all are empty.
+    bool pop(size_t worker, Item& item) {
+        {
+            Slot& own = *slots[worker];
+            TOPN_TIMED_LOCK(lock, own.mutex, "WorkStealingDeques");
+            if (!own.items.empty()) {
+                item = own.items.front();
+                own.items.pop_front();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < slots.size(); ++i) {
+            Slot& victim = *slots[(worker + i) % slots.size()];
+            TOPN_TIMED_LOCK(lock, victim.mutex, "WorkStealingDeques");
+            if (!victim.items.empty()) {
+                item = victim.items.back();
+                victim.items.pop_back();
+                ++steals;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t stealCount() const { return steals.load(); }
+
+private:
+    struct Slot {
+        std::mutex mutex;
+        std::deque<Item> items;
+    };
+    std::vector<std::unique_ptr<Slot>> slots;
+    std::atomic<size_t> steals{0};
+};
+
+
+/*
+ * Lower bound shared by the tasks of one parallel selection. A task whose
+ * heap is full raises it to its heap minimum; since that task already holds
+ * topN pixels at or above the bound, the others can skip every pixel that is
+ * not above it. The value only grows; lowest() means nothing was published.
+ */
+template<typename V>
+class AtomicLowerBound {
+public:
+    V get() const { return value.load(std::memory_order_relaxed); }
+
+    bool isSet() const { return get() > std::numeric_limits<V>::lowest(); }
+
+    void raise(V v) {
+        V current = get();
+        while (current < v && !value.compare_exchange_weak(current, v, std::memory_order_relaxed)) {
+        }
+    }
+
+private:
+    std::atomic<V> value{std::numeric_limits<V>::lowest()};
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+
+/*
+ * Timeline of the parallel strategies: per-thread begin / end of bands,
+ * tiles, merges and waits, dumped as Chrome trace_event JSON
+ * (chrome://tracing, Perfetto). The waits are those of the ThreadPool::run
+ * caller for its helpers and the contended WorkStealingDeques slot locks
+ * (tracedLock): they show the imbalance of a static row split and where the
+ * cores wait.
+ *
+ * Off until start(): a TraceScope then costs one relaxed load. While
+ * recording, every thread appends to its own buffer (an uncontended lock,
+ * no sharing); a thread keeps at most MAX_EVENTS_PER_THREAD events, later
+ * ones are counted as dropped. writeJson() may run while threads record.
+ */
+class TraceRecorder {
+public:
+    static constexpr size_t MAX_EVENTS_PER_THREAD = 1 << 20;
+
+    static TraceRecorder& instance() {
+        static TraceRecorder recorder;
+        return recorder;
+    }
+
+    // Clears the previous events and starts recording.
+    void start();
+    void stop();
+    bool recording() const { return active.load(std::memory_order_relaxed); }
+
+    // Chrome trace_event JSON of the events recorded so far.
+    std::string json() const;
+    void writeJson(const std::string& path) const;
+
+    size_t eventCount() const;
+    size_t droppedCount() const;
+
+    // One complete event of the calling thread; begin / end from nowNs().
+    // arg0 / arg1 are shown as the event arguments when argName0 / argName1
+    // are set.
+    void record(const char* name, const char* category, uint64_t beginNs, uint64_t endNs,
+                const char* argName0 = nullptr, int64_t arg0 = 0,
+                const char* argName1 = nullptr, int64_t arg1 = 0);
+
+    static uint64_t nowNs() {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+private:
+    struct Event {
+        const char* name;
+        const char* category;
+        uint64_t beginNs;
+        uint64_t endNs;
+        const char* argName0;
+        int64_t arg0;
+        const char* argName1;
+        int64_t arg1;
+    };
+
+    struct ThreadBuffer {
+        size_t tid = 0;
+        mutable std::mutex mutex;
+        std::vector<Event> events;
+        size_t dropped = 0;
+    };
+
+    std::atomic<bool> active{false};
+    std::atomic<uint64_t> originNs{0};
+
+    mutable std::mutex buffersMutex;
+    std::vector<std::shared_ptr<ThreadBuffer>> buffers;
+
+    ThreadBuffer& threadBuffer();
+};
+
+
+// Records its lifetime as one event when the recorder is on at construction.
+// name, category and argument names must be string literals (kept as is).
+class TraceScope {
+public:
+    TraceScope(const char* name, const char* category,
+               const char* argName0 = nullptr, int64_t arg0 = 0,
+               const char* argName1 = nullptr, int64_t arg1 = 0)
+        : name(name), category(category), argName0(argName0), arg0(arg0), argName1(argName1), arg1(arg1),
+          beginNs(TraceRecorder::instance().recording() ? TraceRecorder::nowNs() : 0) {}
+
+    ~TraceScope() {
+        if (beginNs != 0) {
+            TraceRecorder::instance().record(name, category, beginNs, TraceRecorder::nowNs(),
+                                             argName0, arg0, argName1, arg1);
+        }
+    }
+
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* name;
+    const char* category;
+    const char* argName0;
+    int64_t arg0;
+    const char* argName1;
+    int64_t arg1;
+    uint64_t beginNs;
+};
+
+
+// Locks mutex; when it is held by another thread the wait is traced as an
+// event named after the mutex, category "lock wait".
+template<typename Mutex>
+std::unique_lock<Mutex> tracedLock(Mutex& mutex, const char* mutexName) {
+    std::unique_lock<Mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {
+        TraceScope wait(mutexName, "lock wait");
+        lock.lock();
+    }
+    return lock;
+}
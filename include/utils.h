@@ -1,6 +1,10 @@
 #pragma once
 
 #include <vector>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <limits>
 #include "image.h"
 
 struct PixelCoord {
@@ -9,6 +13,70 @@ struct PixelCoord {
 };
 
 
+/*
+ * 64-bit selection key: the order-preserving bits of the pixel value in the
+ * high half, the inverted linear index y * cols + x in the low half.
+ * Keys compare as plain integers: larger value first, lower index first on
+ * ties. Images with more than 2^32 pixels cannot be packed.
+ */
+using PackedKey = uint64_t;
+
+// Value types whose order fits in the 32 high bits of a key.
+template<typename V>
+constexpr bool packableValue() {
+    return (std::is_integral<V>::value && sizeof(V) <= 4) || std::is_same<V, float>::value;
+}
+
+// Unsigned bits with the same order as v: signed integers get their sign bit
+// flipped, floats are flipped whole when negative and on the sign otherwise.
+template<typename V>
+uint32_t orderedBits(V v) {
+    static_assert(packableValue<V>(), "value does not fit in a packed key");
+    if constexpr (std::is_same<V, float>::value) {
+        uint32_t bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+    } else if constexpr (std::is_signed<V>::value) {
+        return static_cast<uint32_t>(static_cast<int64_t>(v) - std::numeric_limits<V>::min());
+    } else {
+        return static_cast<uint32_t>(v);
+    }
+}
+
+// Inverse of orderedBits.
+template<typename V>
+V valueFromBits(uint32_t bits) {
+    static_assert(packableValue<V>(), "value does not fit in a packed key");
+    if constexpr (std::is_same<V, float>::value) {
+        bits = (bits & 0x80000000u) ? (bits & 0x7FFFFFFFu) : ~bits;
+        V v;
+        std::memcpy(&v, &bits, sizeof(v));
+        return v;
+    } else if constexpr (std::is_signed<V>::value) {
+        return static_cast<V>(static_cast<int64_t>(bits) + std::numeric_limits<V>::min());
+    } else {
+        return static_cast<V>(bits);
+    }
+}
+
+inline PackedKey packKey(uint32_t valueBits, size_t index) {
+    return (static_cast<uint64_t>(valueBits) << 32) | static_cast<uint32_t>(~static_cast<uint32_t>(index));
+}
+
+inline uint32_t keyValueBits(PackedKey key) {
+    return static_cast<uint32_t>(key >> 32);
+}
+
+inline size_t keyIndex(PackedKey key) {
+    return static_cast<uint32_t>(~static_cast<uint32_t>(key));
+}
+
+inline PixelCoord keyCoord(PackedKey key, size_t cols) {
+    size_t index = keyIndex(key);
+    return PixelCoord(index % cols, index / cols);
+}
+
+
 template<typename T>
  struct ComparePixelVal {
         const IImage<T>& img;
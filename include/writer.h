@@ -0,0 +1,229 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+
+/*
+ * Selected pixels together with their values, as produced by the selection
+ * (ImageProcessor::processImageValues): the writers never read the image.
+ * Stored as separate x, y and value arrays, in descending value order.
+ */
+template<typename T>
+struct PixelValues {
+    std::vector<uint32_t> x;
+    std::vector<uint32_t> y;
+    std::vector<T> value;
+
+    size_t size() const { return value.size(); }
+
+    void reserve(size_t n) {
+        x.reserve(n);
+        y.reserve(n);
+        value.reserve(n);
+    }
+
+    void push_back(size_t px, size_t py, T v) {
+        x.push_back(static_cast<uint32_t>(px));
+        y.push_back(static_cast<uint32_t>(py));
+        value.push_back(v);
+    }
+};
+
+
+/*
+ * Base Interface class for writing a selection result.
+ * One overload per value type a processor can be instantiated with.
+ */
+class ResultWriter {
+public:
+    virtual void write(const PixelValues<uint8_t>& pixels) = 0;
+    virtual void write(const PixelValues<uint16_t>& pixels) = 0;
+    virtual void write(const PixelValues<float>& pixels) = 0;
+    virtual ~ResultWriter() = default;
+};
+
+
+/*
+ * Keeps the result of a selection to write it later, e.g. from another
+ * thread (batch pipeline).
+ */
+class CapturedResult : public ResultWriter {
+public:
+    void write(const PixelValues<uint8_t>& pixels) override { result = pixels; }
+    void write(const PixelValues<uint16_t>& pixels) override { result = pixels; }
+    void write(const PixelValues<float>& pixels) override { result = pixels; }
+
+    bool empty() const { return result.index() == 0; }
+
+    void writeTo(ResultWriter& writer) const {
+        std::visit([&](const auto& pixels) {
+            if constexpr (!std::is_same<std::decay_t<decltype(pixels)>, std::monostate>::value) {
+                writer.write(pixels);
+            }
+        }, result);
+    }
+
+private:
+    std::variant<std::monostate, PixelValues<uint8_t>, PixelValues<uint16_t>, PixelValues<float>> result;
+};
+
+
+/*
+ * JSON output, same document as toJson:
+ * { "pixels": [{"x": 1,"y": 2,"value": 3},...], "number": N}
+ * Numbers are formatted with std::to_chars into a reusable buffer that is
+ * flushed to the stream in blocks of BLOCK_SIZE bytes.
+ */
+class JsonResultWriter : public ResultWriter {
+public:
+    static constexpr size_t BLOCK_SIZE = 1 << 16;
+
+    explicit JsonResultWriter(std::ostream& output) : out(output), buffer(BLOCK_SIZE + MAX_ENTRY) {}
+
+    void write(const PixelValues<uint8_t>& pixels) override { writePixels(pixels); }
+    void write(const PixelValues<uint16_t>& pixels) override { writePixels(pixels); }
+    void write(const PixelValues<float>& pixels) override { writePixels(pixels); }
+
+private:
+    static constexpr size_t MAX_ENTRY = 128; // one formatted pixel fits in it
+
+    std::ostream& out;
+    std::vector<char> buffer;
+    size_t used = 0;
+
+    void flush() {
+        out.write(buffer.data(), used);
+        used = 0;
+    }
+
+    void append(const char* text, size_t n) {
+        std::memcpy(buffer.data() + used, text, n);
+        used += n;
+    }
+
+    template<size_t N>
+    void append(const char (&text)[N]) {
+        append(text, N - 1);
+    }
+
+    template<typename V>
+    void appendNumber(V v) {
+        char* end = buffer.data() + buffer.size();
+        std::to_chars_result r;
+        if constexpr (std::is_floating_point<V>::value) {
+            r = std::to_chars(buffer.data() + used, end, v);
+        } else {
+            r = std::to_chars(buffer.data() + used, end, static_cast<uint64_t>(v));
+        }
+        used = static_cast<size_t>(r.ptr - buffer.data());
+    }
+
+    template<typename T>
+    void writePixels(const PixelValues<T>& pixels) {
+        append("{ \"pixels\": [");
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            append("{\"x\": ");
+            appendNumber(pixels.x[i]);
+            append(",\"y\": ");
+            appendNumber(pixels.y[i]);
+            append(",\"value\": ");
+            appendNumber(pixels.value[i]);
+            append("}");
+            if (i < pixels.size() - 1) append(",");
+            if (used >= BLOCK_SIZE) {
+                flush();
+            }
+        }
+        append("], \"number\": ");
+        appendNumber(pixels.size());
+        append("} \n");
+        flush();
+        out.flush();
+    }
+};
+
+
+/*
+ * Compact binary output, in host byte order (little-endian on x86-64):
+ *   char     magic[4]   "TOPN"
+ *   uint8_t  version    1
+ *   uint8_t  valueType  1 = uint8, 2 = uint16, 3 = float32
+ *   uint16_t reserved   0
+ *   uint64_t count
+ *   uint32_t x[count]
+ *   uint32_t y[count]
+ *   T        value[count]
+ */
+class BinaryResultWriter : public ResultWriter {
+public:
+    static constexpr uint8_t VERSION = 1;
+
+    explicit BinaryResultWriter(std::ostream& output) : out(output) {}
+
+    void write(const PixelValues<uint8_t>& pixels) override { writePixels(pixels, 1); }
+    void write(const PixelValues<uint16_t>& pixels) override { writePixels(pixels, 2); }
+    void write(const PixelValues<float>& pixels) override { writePixels(pixels, 3); }
+
+private:
+    std::ostream& out;
+
+    template<typename V>
+    void writeArray(const std::vector<V>& values) {
+        out.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(V));
+    }
+
+    template<typename T>
+    void writePixels(const PixelValues<T>& pixels, uint8_t valueType) {
+        char header[16] = {'T', 'O', 'P', 'N', static_cast<char>(VERSION), static_cast<char>(valueType), 0, 0};
+        uint64_t count = pixels.size();
+        std::memcpy(header + 8, &count, sizeof(count));
+        out.write(header, sizeof(header));
+
+        writeArray(pixels.x);
+        writeArray(pixels.y);
+        writeArray(pixels.value);
+        out.flush();
+    }
+};
+
+
+/*
+ * Factory for the result writer of an output path: ".bin" files get the
+ * binary format, anything else JSON. The writer owns the file stream.
+ */
+class FileResultWriter : public ResultWriter {
+public:
+    explicit FileResultWriter(const std::string& path) : file(path, std::ios::binary) {
+        if (!file.is_open()) {
+            throw std::runtime_error("Could not open the output file.");
+        }
+        bool binary = path.size() >= 4 && path.compare(path.size() - 4, 4, ".bin") == 0;
+        if (binary) {
+            writer = std::make_unique<BinaryResultWriter>(file);
+        } else {
+            writer = std::make_unique<JsonResultWriter>(file);
+        }
+    }
+
+    void write(const PixelValues<uint8_t>& pixels) override { writer->write(pixels); }
+    void write(const PixelValues<uint16_t>& pixels) override { writer->write(pixels); }
+    void write(const PixelValues<float>& pixels) override { writer->write(pixels); }
+
+private:
+    std::ofstream file;
+    std::unique_ptr<ResultWriter> writer;
+};
+
+inline std::unique_ptr<ResultWriter> createResultWriter(const std::string& path) {
+    return std::make_unique<FileResultWriter>(path);
+}
@@ -0,0 +1,97 @@
+#include <atomic>
+
+#include "alloctrack.h"
+
+
+namespace {
+
+std::atomic<size_t> liveCounter{0};
+std::atomic<size_t> peakCounter{0};
+std::atomic<size_t> totalCounter{0};
+std::atomic<size_t> allocationCounter{0};
+
+} // namespace
+
+
+/*
+ * ********************************
+ *   AllocationTracker
+ * ********************************
+ */
+void AllocationTracker::allocated(size_t bytes) noexcept {
+    size_t live = liveCounter.fetch_add(bytes, std::memory_order_relaxed) + bytes;
+    totalCounter.fetch_add(bytes, std::memory_order_relaxed);
+    allocationCounter.fetch_add(1, std::memory_order_relaxed);
+    size_t peak = peakCounter.load(std::memory_order_relaxed);
+    while (live > peak && !peakCounter.compare_exchange_weak(peak, live, std::memory_order_relaxed)) {
+    }
+}
+
+void AllocationTracker::freed(size_t bytes) noexcept {
+    liveCounter.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+size_t AllocationTracker::liveBytes() noexcept {
+    return liveCounter.load(std::memory_order_relaxed);
+}
+
+bool AllocationTracker::active() noexcept {
+    return allocationCounter.load(std::memory_order_relaxed) != 0;
+}
+
+
+/*
+ * ********************************
+ *   AllocationScope
+ * ********************************
+ */
+AllocationScope::AllocationScope() noexcept
+    : baseLive(liveCounter.load(std::memory_order_relaxed)),
+      baseTotal(totalCounter.load(std::memory_order_relaxed)),
+      baseCount(allocationCounter.load(std::memory_order_relaxed)) {
+    peakCounter.store(baseLive, std::memory_order_relaxed);
+}
+
+AllocationStats AllocationScope::stats() const noexcept {
+    AllocationStats stats;
+    size_t peak = peakCounter.load(std::memory_order_relaxed);
+    stats.peakBytes = peak > baseLive ? peak - baseLive : 0;
+    stats.totalBytes = totalCounter.load(std::memory_order_relaxed) - baseTotal;
+    stats.allocations = allocationCounter.load(std::memory_order_relaxed) - baseCount;
+    return stats;
+}
+
+
+/*
+ * ********************************
+ *   TrackingMatAllocator
+ * ********************************
+ */
+TrackingMatAllocator& TrackingMatAllocator::instance() {
+    static TrackingMatAllocator allocator;
+    return allocator;
+}
+
+cv::UMatData* TrackingMatAllocator::allocate(int dims, const int* sizes, int type, void* data, size_t* step,
+                                             cv::AccessFlag flags, cv::UMatUsageFlags usageFlags) const {
+    cv::UMatData* u = inner->allocate(dims, sizes, type, data, step, flags, usageFlags);
+    if (u != nullptr) {
+        u->currAllocator = this; // Mat releases through us, we hand over to inner
+        if (!(u->flags & cv::UMatData::USER_ALLOCATED)) {
+            AllocationTracker::allocated(u->size);
+        }
+    }
+    return u;
+}
+
+bool TrackingMatAllocator::allocate(cv::UMatData* data, cv::AccessFlag accessFlags,
+                                    cv::UMatUsageFlags usageFlags) const {
+    return inner->allocate(data, accessFlags, usageFlags);
+}
+
+void TrackingMatAllocator::deallocate(cv::UMatData* data) const {
+    if (data != nullptr && !(data->flags & cv::UMatData::USER_ALLOCATED)) {
+        AllocationTracker::freed(data->size);
+    }
+    inner->deallocate(data);
+}
@@ -0,0 +1,140 @@
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <sys/stat.h>
+
+#include "imagecache.h"
+
+
+namespace {
+
+// New image over the pixels of a cached one, keeping it alive.
+template<typename T>
+std::shared_ptr<IImage<T>> sharePixels(const std::shared_ptr<IImage<T>>& image) {
+    ImageView v = image->view();
+    if (v.data == nullptr) {
+        return image;
+    }
+    cv::Mat mat(static_cast<int>(v.rows), static_cast<int>(v.cols), v.depth, const_cast<uchar*>(v.data), v.stride);
+    auto shared = std::make_shared<ImageWrapper<T>>(mat, image, v.bigEndian, v.flipSign);
+    shared->shareDerivedData(image->derivedData()); // one tile summary per cached frame
+    return shared;
+}
+
+AnyImage sharePixels(const AnyImage& image) {
+    return std::visit([](const auto& img) { return AnyImage(sharePixels(img)); }, image);
+}
+
+size_t pixelBytes(const AnyImage& image) {
+    return std::visit([](const auto& img) {
+        ImageView v = img->view();
+        if (v.data != nullptr) {
+            return v.rows * v.stride;
+        }
+        return img->size() * sizeof(typename std::decay_t<decltype(*img)>::value_type);
+    }, image);
+}
+
+} // namespace
+
+
+CachingImageReader::CachingImageReader(size_t byteBudget, ReaderFactory factory)
+    : budget(byteBudget), readerFor(std::move(factory)) {
+    counters.budget = byteBudget;
+}
+
+std::unique_ptr<IImage<uint16_t>> CachingImageReader::readImage(const std::string& imagePath) {
+    AnyImage image = read(imagePath, false);
+    const auto& cached = std::get<std::shared_ptr<IImage<uint16_t>>>(image);
+    ImageView v = cached->view();
+    if (v.data == nullptr) {
+        throw std::runtime_error("Cached image has no pixel buffer.");
+    }
+    cv::Mat mat(static_cast<int>(v.rows), static_cast<int>(v.cols), v.depth, const_cast<uchar*>(v.data), v.stride);
+    auto shared = std::make_unique<ImageWrapper<uint16_t>>(mat, cached, v.bigEndian, v.flipSign);
+    shared->shareDerivedData(cached->derivedData());
+    return shared;
+}
+
+AnyImage CachingImageReader::readImageAnyDepth(const std::string& imagePath) {
+    return read(imagePath, true);
+}
+
+AnyImage CachingImageReader::read(const std::string& imagePath, bool anyDepth) {
+    struct stat st;
+    if (::stat(imagePath.c_str(), &st) != 0) {
+        throw std::runtime_error("Error opening the image file: " + imagePath);
+    }
+    FileStamp stamp;
+    stamp.size = static_cast<uint64_t>(st.st_size);
+    stamp.mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+    std::string key = (anyDepth ? "a:" : "u16:") + imagePath;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            if (it->second->stamp == stamp) {
+                lru.splice(lru.begin(), lru, it->second);
+                ++counters.hits;
+                return sharePixels(it->second->image);
+            }
+            counters.bytes -= it->second->bytes; // file changed since it was cached
+            lru.erase(it->second);
+            index.erase(it);
+        }
+        ++counters.misses;
+    }
+
+    // decode outside the lock, other paths stay served meanwhile
+    auto reader = readerFor(imagePath);
+    Entry entry;
+    entry.key = std::move(key);
+    entry.stamp = stamp;
+    if (anyDepth) {
+        entry.image = reader->readImageAnyDepth(imagePath);
+    } else {
+        entry.image = std::shared_ptr<IImage<uint16_t>>(reader->readImage(imagePath));
+    }
+    entry.bytes = pixelBytes(entry.image);
+
+    AnyImage result = sharePixels(entry.image);
+    if (entry.bytes <= budget) {
+        insert(std::move(entry));
+    }
+    return result;
+}
+
+void CachingImageReader::insert(Entry entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = index.find(entry.key);
+    if (it != index.end()) { // decoded by two threads at once
+        counters.bytes -= it->second->bytes;
+        lru.erase(it->second);
+        index.erase(it);
+    }
+    while (!lru.empty() && counters.bytes + entry.bytes > budget) {
+        counters.bytes -= lru.back().bytes;
+        index.erase(lru.back().key);
+        lru.pop_back();
+        ++counters.evictions;
+    }
+    counters.bytes += entry.bytes;
+    lru.push_front(std::move(entry));
+    index[lru.front().key] = lru.begin();
+}
+
+ImageCacheStats CachingImageReader::stats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    ImageCacheStats s = counters;
+    s.entries = lru.size();
+    return s;
+}
+
+void CachingImageReader::clear() {
+    std::lock_guard<std::mutex> lock(mutex);
+    lru.clear();
+    index.clear();
+    counters.bytes = 0;
+}
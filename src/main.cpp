@@ -1,5 +1,4 @@
 
-#include <sys/resource.h>
 #include <iostream>
 #include <fstream>
 #include <chrono>
@@ -10,263 +9,186 @@
 #include "utils.h"
 #include "image.h"
 #include "processor.h"
-
-
-// GenerateMatrix.cpp
-#include <opencv2/opencv.hpp>
-#include <opencv2/highgui/highgui.hpp>
-
-#include <cstdlib> // Pentru rand()
-
-
-cv::Mat generateMatrixGray(size_t size) {
-    cv::Mat image(size, size, CV_8UC1);
-
-    for (size_t i = 0; i < size; ++i) {
-        for (size_t j = 0; j < size; ++j) {
-            uchar value = static_cast<uchar>(rand() % 256);
-            image.at<uchar>(i, j) = value;
-        }
+#include "pngstream.h"
+#include "pipeline.h"
+#include "server.h"
+#include "selector.h"
+#include "metrics.h"
+#include "trace.h"
+#include <csignal>
+#include <cstdlib>
+
+
+// TOPN_COST_FILE=<path>: processImage picks its strategy with the cost model
+// of path, measured into it by the first run. Without it the decision tree
+// compiled into include/strategy_tree.h picks, at no startup cost.
+void initStrategySelector() {
+    const char* path = std::getenv("TOPN_COST_FILE");
+    if (path == nullptr || *path == '\0') {
+        return;
     }
-
-    return image;
+    auto start = std::chrono::high_resolution_clock::now();
+    bool loaded = StrategySelector::instance().loadOrCalibrate(path);
+    auto end = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<double, std::milli> duration = end - start;
+    std::cout << "Strategy costs " << (loaded ? "loaded from " : "calibrated into ") << path
+        << " in " << duration.count() << " ms\n";
 }
 
-cv::Mat generateMatrixUniform(size_t size) {
-    cv::Mat image(size, size, CV_8UC1);
-
-    for (size_t i = 0; i < size; ++i) {
-        for (size_t j = 0; j < size; ++j) {
-            image.at<uchar>(i, j) = 17;
-        }
+// --batch <list_file|directory> <top_n> <output_dir> [--binary]
+int runBatchMode(int argc, char** argv) {
+    if (argc != 5 && !(argc == 6 && std::string(argv[5]) == "--binary")) {
+        std::cerr << "Usage: " << argv[0] << " --batch <list_file|directory> <top_n> <output_dir> [--binary]\n";
+        return 1;
     }
-
-    return image;
-}
-
-cv::Mat generateMatrix(size_t size) {
-    cv::Mat image(size, size, CV_16U);
-
-    for (size_t i = 0; i < size; ++i) {
-        for (size_t j = 0; j < size; ++j) {
-            uint16_t value = static_cast<uint16_t>(rand() % 65536); // 2^16 = 65536
-            image.at<uint16_t>(i, j) = value;
-        }
+    try {
+        BatchOptions options;
+        options.topN = std::stoul(argv[3]);
+        options.outputDir = argv[4];
+        options.binary = argc == 6;
+
+        std::vector<std::string> inputs = listBatchInputs(argv[2]);
+        auto start = std::chrono::high_resolution_clock::now();
+        BatchStats stats = runBatch(inputs, options);
+        auto end = std::chrono::high_resolution_clock::now();
+        std::chrono::duration<double, std::milli> duration = end - start;
+        std::cout << "Batch of " << inputs.size() << " images: " << stats.processed << " written, "
+            << stats.failed << " failed, " << duration.count() << " ms\n";
+        return stats.failed == 0 ? 0 : 1;
+    } catch (const std::exception& e) {
+        std::cerr << "Error occurred: " << e.what() << "\n";
+        return 1;
     }
-
-    //cv::imshow("Generated Image", image);
-    //cv::waitKey(0);
-
-    return image;
 }
 
-cv::Mat generateMatrixSort(size_t size, int increment) {
-    uint16_t start = 0;
-    cv::Mat image(size, size, CV_16U);
 
-    if(increment < 0) start = size * size - 1;
-    for (size_t i = 0; i < size; ++i) {
-        for (size_t j = 0; j < size; ++j) {
-            image.at<uint16_t>(j, i) = start;
-            start += increment;
+// TOPN_METRICS_FILE=<path>: stage timers written when main returns, Prometheus
+// text (JSON for a .json path). Recorded only in a "make METRICS=1" build.
+struct MetricsExport {
+    ~MetricsExport() {
+        const char* path = std::getenv("TOPN_METRICS_FILE");
+        if (path == nullptr || *path == '\0') {
+            return;
+        }
+        try {
+            Metrics::instance().writeFile(path);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
         }
     }
+};
 
-    //cv::imshow("Generated Image", image);
-    //cv::waitKey(0);
-    return image;
-}
-
-cv::Mat generateMatrixSortA(size_t size) {
-    return generateMatrixSort(size, 1);
-}
-cv::Mat generateMatrixSortD(size_t size) {
-    return generateMatrixSort(size, -1);
-}
-
-
-cv::Mat generateMatrixWithDistribution(size_t size) {
-    size_t regionsX = 4; // nb region per h.
-    size_t regionsY = 4; // nb region per v.
-
-    cv::Mat image = generateMatrixWithVariableRegions(size, regionsX, regionsY);
-
-    //cv::imshow("Generated Image", image);
-    //cv::waitKey(0);
-
-    return image;
-}
-
-std::vector<size_t> generateTopNValues(size_t size, size_t steps) {
-    size_t totalPixels = size * size;
-    std::vector<size_t> topNValues;
-    double startPercentage = 0.001; // Start cu 0.1%
-    double endPercentage = 0.999;   // End cu 99.9%
-    double step = (endPercentage - startPercentage) / (steps - 1);
+// TOPN_TRACE_FILE=<path>: timeline of the parallel strategies recorded for the
+// whole run, written when main returns as Chrome trace_event JSON.
+struct TraceExport {
+    const char* path = std::getenv("TOPN_TRACE_FILE");
 
-    for (size_t i = 0; i < steps; ++i) {
-        double currentPercentage = startPercentage + step * i;
-        topNValues.push_back(static_cast<size_t>(currentPercentage * totalPixels));
+    TraceExport() {
+        if (path != nullptr && *path != '\0') {
+            TraceRecorder::instance().start();
+        }
     }
-
-    return topNValues;
-}
-
-
-void processAndMeasure(size_t idx, size_t dimm, size_t topN, 
-    const std::string& outputFile, 
-    ImageProcessor<uint16_t>& ip,
-    size_t processid,
-    std::vector<std::function<std::vector<PixelCoord>(ImageProcessor<uint16_t>&, size_t)>>& processFunctions
-
-) {
-    
-    if (processid >= processFunctions.size()) {
-            std::cout << "ID unavailable!." << std::endl;
+    ~TraceExport() {
+        if (path == nullptr || *path == '\0') {
             return;
-    } 
+        }
+        TraceRecorder::instance().stop();
+        try {
+            TraceRecorder::instance().writeJson(path);
+        } catch (const std::exception& e) {
+            std::cerr << e.what() << "\n";
+        }
+    }
+};
 
-    struct rusage usageStart, usageEnd;
-    getrusage(RUSAGE_SELF, &usageStart);
-    auto start = std::chrono::high_resolution_clock::now();
-    auto topPixels = processFunctions[processid](ip, topN);
-    auto end = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::milli> execTime = end - start;
-    getrusage(RUSAGE_SELF, &usageEnd);
-    
-    long memoryUsed = usageEnd.ru_maxrss - usageStart.ru_maxrss;
-    long cost = execTime.count() * 0.8 + memoryUsed * 0.2;
 
-    std::ofstream file(outputFile, std::ios_base::app);
-    file <<  idx << "," << dimm << "," << topN << "," << processid << 
-"," << execTime.count() << "," << memoryUsed <<  "," << cost << "\n";
-    file.close();
+TopNServer* runningServer = nullptr;
 
-    std::cout << "TopN: " << topN << ", IDMethod: " << processid << 
-    ", ExecTime: " << execTime.count() << " ms, MemUsed: " << memoryUsed << " KB" << std::endl;
+void stopServer(int) {
+    if (runningServer != nullptr) {
+        runningServer->stop();
+    }
 }
 
-#define GENERATE_FUNC_PAIR(func) {func, #func}
-
-int simulate(size_t maxImgColAndRowSize, size_t topNgranularity) {
-
-  //init CSV with head
-    std::string outputFile = "matrix_data.csv";
-    std::ofstream file(outputFile);
-    file << "Type,Dimension,topN,IDMethod,ExecTime,MemUsed,Cost\n";
-    file.close();
-
-
-    std::vector<std::function<std::vector<PixelCoord>(ImageProcessor<uint16_t>&, size_t)>>
-    processFunctions = {
-        &ImageProcessor<uint16_t>::processImageHeapBest,
-        &ImageProcessor<uint16_t>::processImageParallelV512,
-        &ImageProcessor<uint16_t>::processImageCS
-    };
-
-   // matrix list generators
-    using MatrixGeneratorFunc = std::function<cv::Mat(size_t)>;
-    using MatrixGeneratorWithDescription = std::pair<MatrixGeneratorFunc, std::string>;
-    std::vector<MatrixGeneratorWithDescription> matrixGenerators = {
-        {generateMatrix, "random Matrix"},
-        {generateMatrixSortA, "Sorted Ascending"},
-        {generateMatrixSortD, "Sorted Descending"},
-        {generateMatrixWithDistribution, "With Specific Distribution"},
-        {generateMatrixUniform, "Uniform Distribution"}
-        // add here static fc for generate matrix with description
-    };
-
-    size_t idx = 0;
-    for (auto& generatorWithDesc : matrixGenerators) {
-        auto generateMatrix = generatorWithDesc.first; // fc generator
-        const auto& description = generatorWithDesc.second; // Descrierea
-
-        std::cout << std::endl;
-        std::cout << description << std::endl ;
-    
-        for (size_t size = 100; size <= maxImgColAndRowSize; size *= 2) {
-            cv::Mat image = generateMatrix(size);
-            ImageWrapper<uint16_t> wrapper(image);
-            ImageProcessor<uint16_t> ip(wrapper);
-            //auto wrapper = createImageWrapper(image);
-            //auto ip = createImageProcessor(std::move(wrapper));
-            
-             std::cout << "size " << size << std::endl ;
-            //get relevant topN values
-            std::vector<size_t> topNValues = generateTopNValues(size, topNgranularity); // Generate 5 values
-            for (auto topN : topNValues) {
-                //std::cout << "Img row: " << image.rows << " img col: " <<  image.cols << std::endl;    
-                std::cout << "Running: " << description << " | Img row: " << image.rows << " img col: " << image.cols << std::endl;      
-                for(size_t i = 0; i < processFunctions.size(); ++i) {                     
-                    processAndMeasure(idx, wrapper.size(), topN,  outputFile, ip, i, processFunctions); 
-                }
-            }
-        }
-
-        ++idx;
+// --serve <socket_path> [cache_mb] [max_raw_mb]: answer requests until SIGINT / SIGTERM
+int runServerMode(const std::string& socketPath, size_t cacheMegabytes, size_t maxRawMegabytes) {
+    try {
+        TopNServer server(socketPath, cacheMegabytes << 20, maxRawMegabytes << 20);
+        runningServer = &server;
+        std::signal(SIGINT, stopServer);
+        std::signal(SIGTERM, stopServer);
+        std::cout << "Listening on " << socketPath << std::endl;
+        server.run();
+        runningServer = nullptr;
+        ImageCacheStats cache = server.cacheStats();
+        std::cout << "Served " << server.requestsServed() << " requests, image cache: " << cache.hits << " hits, "
+            << cache.misses << " misses, " << cache.evictions << " evictions\n";
+        return 0;
+    } catch (const std::exception& e) {
+        std::cerr << "Error occurred: " << e.what() << "\n";
+        return 1;
     }
-
-
-    return 0;
 }
 
 
-
-
-
-
 int main(int argc, char** argv) {
+    MetricsExport metricsExport;
+    TraceExport traceExport;
+    initStrategySelector();
+    if (argc >= 2 && std::string(argv[1]) == "--batch") {
+        return runBatchMode(argc, argv);
+    }
+    if (argc >= 3 && argc <= 5 && std::string(argv[1]) == "--serve") {
+        return runServerMode(argv[2], argc >= 4 ? std::stoul(argv[3]) : 0,
+                             argc == 5 ? std::stoul(argv[4]) : TopNServer::DEFAULT_MAX_RAW_BYTES >> 20);
+    }
     if (argc != 4) {
         std::cerr << "Usage: " << argv[0] << " <image_path> <top_n> <output_json_path>\n";
+        std::cerr << "       " << argv[0] << " --batch <list_file|directory> <top_n> <output_dir> [--binary]\n";
+        std::cerr << "       " << argv[0] << " --serve <socket_path> [cache_mb] [max_raw_mb]\n";
         return 1;
     }
     std::string imagePath = argv[1];
     size_t topN = std::stoi(argv[2]);
     std::string outputJsonPath = argv[3];
-    std::string outputJsonPathParallel = std::string("Parallel_") + argv[3];
-
-    size_t topNgranularity = 10;
-    size_t maxImgColAndRowSize = 1000; // Max image row and col size
-
-    simulate(maxImgColAndRowSize, topNgranularity);
 
     try {
-       
+        if (PngBandReader::isPng(imagePath)) {
+            // Decode and select band by band, the frame is never fully in memory
+            auto start = std::chrono::high_resolution_clock::now();
+            auto writer = createResultWriter(outputJsonPath);
+            streamPngTopN(imagePath, topN, *writer);
+            auto end = std::chrono::high_resolution_clock::now();
+            std::chrono::duration<double, std::milli> duration = end - start;
+            std::cout << "Time to stream " << topN << " pixels: " << duration.count() << " ms\n";
+            std::cout << "JSON file has been successfully generated at: " << outputJsonPath << "\n";
+            return 0;
+        }
 
-        auto imageReader = ImageReaderFactory::createImageReader();
-        auto image = imageReader->readImage(imagePath);
+        AnyImage image;
+        {
+            TOPN_STAGE_TIMER(Decode);
+            auto imageReader = ImageReaderFactory::createImageReader(imagePath);
+            image = imageReader->readImageAnyDepth(imagePath);
+        }
 
     auto start = std::chrono::high_resolution_clock::now();
-        ImageProcessor<uint16_t> ip(*image.get());
-        auto topPixels = ip.processImage(topN);
+        CapturedResult selection;
+        createImageProcessor(image)->processImageTo(topN, selection);
     auto end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<double, std::milli> duration = end - start;
     std::cout << "Time to execute " << topN << " pixels: " << duration.count() << " ms\n";
     
 
-        //std::string jsonOutput = toJson(*image, topPixels);
-
-        std::ofstream outputFile(outputJsonPath);
-        if (!outputFile.is_open()) {
-            throw std::runtime_error("Could not open the output file.");
+        // The timed selection is the one written, a ".bin" path gets the binary format
+        {
+            TOPN_STAGE_TIMER(Output);
+            auto writer = createResultWriter(outputJsonPath);
+            selection.writeTo(*writer);
         }
-        //outputFile << jsonOutput;
-        outputFile.close();
 
         std::cout << "JSON file has been successfully generated at: " << outputJsonPath << "\n";
 
-        //Parallel
-        topPixels = ip.processImageParallel(topN);
-
-        //jsonOutput = toJson(*image, topPixels);
-        outputFile.open(outputJsonPathParallel);
-        if (!outputFile.is_open()) {
-            throw std::runtime_error("Could not open the output file.");
-        }
-        //outputFile << jsonOutput;
-        outputFile.close();
-
-
     } catch (const std::exception& e) {
         std::cerr << "Error occurred: " << e.what() << "\n";
         return 1;
@@ -0,0 +1,123 @@
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "metrics.h"
+
+
+namespace {
+
+const char* const STAGE_NAMES[STAGE_COUNT] = {"decode", "scan", "local_heap", "merge", "output"};
+
+double seconds(uint64_t ns) {
+    return static_cast<double>(ns) / 1e9;
+}
+
+bool endsWith(const std::string& text, const std::string& suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+} // namespace
+
+
+const char* stageName(Stage stage) {
+    size_t i = static_cast<size_t>(stage);
+    return i < STAGE_COUNT ? STAGE_NAMES[i] : "unknown";
+}
+
+std::string Metrics::prometheus() const {
+    std::ostringstream out;
+    out.precision(9);
+    out << "# HELP topn_metrics_enabled 1 when built with TOPN_METRICS.\n"
+        << "# TYPE topn_metrics_enabled gauge\n"
+        << "topn_metrics_enabled " << (enabled() ? 1 : 0) << "\n";
+
+    out << "# HELP topn_stage_seconds_total Time spent per stage.\n"
+        << "# TYPE topn_stage_seconds_total counter\n";
+    for (size_t i = 0; i < STAGE_COUNT; ++i) {
+        out << "topn_stage_seconds_total{stage=\"" << STAGE_NAMES[i] << "\"} "
+            << seconds(stages[i].totalNs.load(std::memory_order_relaxed)) << "\n";
+    }
+    out << "# HELP topn_stage_runs_total Runs per stage.\n"
+        << "# TYPE topn_stage_runs_total counter\n";
+    for (size_t i = 0; i < STAGE_COUNT; ++i) {
+        out << "topn_stage_runs_total{stage=\"" << STAGE_NAMES[i] << "\"} "
+            << stages[i].count.load(std::memory_order_relaxed) << "\n";
+    }
+    out << "# HELP topn_stage_max_seconds Longest single run per stage.\n"
+        << "# TYPE topn_stage_max_seconds gauge\n";
+    for (size_t i = 0; i < STAGE_COUNT; ++i) {
+        out << "topn_stage_max_seconds{stage=\"" << STAGE_NAMES[i] << "\"} "
+            << seconds(stages[i].maxNs.load(std::memory_order_relaxed)) << "\n";
+    }
+
+    out << "# HELP topn_thread_busy_seconds_total Time each thread spent in band scans.\n"
+        << "# TYPE topn_thread_busy_seconds_total counter\n";
+    for (size_t t = 0; t < MAX_THREADS; ++t) {
+        uint64_t ns = threadBusyNs[t].load(std::memory_order_relaxed);
+        if (ns != 0) {
+            out << "topn_thread_busy_seconds_total{thread=\"" << t << "\"} " << seconds(ns) << "\n";
+        }
+    }
+
+    out << "# HELP topn_lock_wait_seconds_total Time spent waiting for the work queue locks.\n"
+        << "# TYPE topn_lock_wait_seconds_total counter\n"
+        << "topn_lock_wait_seconds_total " << seconds(lockWaitNs.load(std::memory_order_relaxed)) << "\n"
+        << "# HELP topn_lock_acquisitions_total Acquisitions of the work queue locks.\n"
+        << "# TYPE topn_lock_acquisitions_total counter\n"
+        << "topn_lock_acquisitions_total " << lockAcquisitions.load(std::memory_order_relaxed) << "\n";
+    return out.str();
+}
+
+std::string Metrics::json() const {
+    std::ostringstream out;
+    out.precision(9);
+    out << "{\"enabled\": " << (enabled() ? "true" : "false") << ", \"stages\": {";
+    for (size_t i = 0; i < STAGE_COUNT; ++i) {
+        out << (i ? ", " : "") << "\"" << STAGE_NAMES[i] << "\": {\"runs\": "
+            << stages[i].count.load(std::memory_order_relaxed) << ", \"seconds\": "
+            << seconds(stages[i].totalNs.load(std::memory_order_relaxed)) << ", \"max_seconds\": "
+            << seconds(stages[i].maxNs.load(std::memory_order_relaxed)) << "}";
+    }
+    out << "}, \"thread_busy_seconds\": {";
+    bool first = true;
+    for (size_t t = 0; t < MAX_THREADS; ++t) {
+        uint64_t ns = threadBusyNs[t].load(std::memory_order_relaxed);
+        if (ns != 0) {
+            out << (first ? "" : ", ") << "\"" << t << "\": " << seconds(ns);
+            first = false;
+        }
+    }
+    out << "}, \"locks\": {\"acquisitions\": " << lockAcquisitions.load(std::memory_order_relaxed)
+        << ", \"wait_seconds\": " << seconds(lockWaitNs.load(std::memory_order_relaxed)) << "}}\n";
+    return out.str();
+}
+
+void Metrics::writeFile(const std::string& path) const {
+    // written aside and renamed: a scraper never reads a partial file
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream file(temporary);
+        if (!file.is_open()) {
+            throw std::runtime_error("Could not open the metrics file: " + path);
+        }
+        file << (endsWith(path, ".json") ? json() : prometheus());
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        throw std::runtime_error("Could not write the metrics file: " + path);
+    }
+}
+
+void Metrics::reset() {
+    for (StageCounters& s : stages) {
+        s.count = 0;
+        s.totalNs = 0;
+        s.maxNs = 0;
+    }
+    for (auto& ns : threadBusyNs) {
+        ns = 0;
+    }
+    lockAcquisitions = 0;
+    lockWaitNs = 0;
+}
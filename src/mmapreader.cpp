@@ -0,0 +1,285 @@
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "mmapreader.h"
+
+
+/*
+ * ********************************
+ *   MappedFile
+ * ********************************
+ */
+MappedFile::MappedFile(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw std::runtime_error("Error opening the image file: " + path);
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || st.st_size <= 0) {
+        ::close(fd);
+        throw std::runtime_error("Empty or unreadable image file: " + path);
+    }
+    length = static_cast<size_t>(st.st_size);
+
+    void* p = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // the mapping keeps its own reference to the file
+    if (p == MAP_FAILED) {
+        throw std::runtime_error("Error mapping the image file: " + path);
+    }
+    ::madvise(p, length, MADV_SEQUENTIAL);
+    bytes = static_cast<uint8_t*>(p);
+}
+
+MappedFile::~MappedFile() {
+    if (bytes != nullptr) {
+        ::munmap(bytes, length);
+    }
+}
+
+
+/*
+ * ********************************
+ *   Headers
+ * ********************************
+ */
+
+// Where the pixels are and how they are stored, from a file header.
+struct MappedLayout {
+    RawGeometry geometry;
+    bool flipSign = false; // FITS BZERO = 32768: signed 16-bit stored, unsigned meant
+};
+
+static bool isPgm(const uint8_t* data, size_t size) {
+    return size >= 3 && data[0] == 'P' && data[1] == '5' && std::isspace(data[2]);
+}
+
+static bool isFits(const uint8_t* data, size_t size) {
+    return size >= 2880 && std::memcmp(data, "SIMPLE  =", 9) == 0;
+}
+
+// Largest rows or cols of an image: cv::Mat takes them as int.
+static constexpr size_t MAX_DIMENSION = static_cast<size_t>(std::numeric_limits<int>::max());
+
+// Next whitespace separated number of a PGM header, skipping # comments.
+// Numbers above MAX_DIMENSION are rejected before they can overflow.
+static size_t pgmNumber(const uint8_t* data, size_t size, size_t& pos) {
+    for (;;) {
+        while (pos < size && std::isspace(data[pos])) {
+            ++pos;
+        }
+        if (pos < size && data[pos] == '#') {
+            while (pos < size && data[pos] != '\n') {
+                ++pos;
+            }
+            continue;
+        }
+        break;
+    }
+    if (pos >= size || !std::isdigit(data[pos])) {
+        throw std::runtime_error("Malformed PGM header.");
+    }
+    size_t value = 0;
+    while (pos < size && std::isdigit(data[pos])) {
+        size_t digit = data[pos++] - '0';
+        if (value > (MAX_DIMENSION - digit) / 10) {
+            throw std::runtime_error("PGM header number out of range.");
+        }
+        value = value * 10 + digit;
+    }
+    return value;
+}
+
+static MappedLayout parsePgm(const uint8_t* data, size_t size) {
+    size_t pos = 2;
+    MappedLayout layout;
+    layout.geometry.cols = pgmNumber(data, size, pos);
+    layout.geometry.rows = pgmNumber(data, size, pos);
+    size_t maxValue = pgmNumber(data, size, pos);
+    if (maxValue == 0 || maxValue > 65535) {
+        throw std::runtime_error("Unsupported PGM max value.");
+    }
+    // 16-bit samples are big-endian (netpbm)
+    layout.geometry.depth = maxValue < 256 ? CV_8U : CV_16U;
+    layout.geometry.bigEndian = maxValue >= 256;
+    layout.geometry.offset = pos + 1; // exactly one whitespace after the max value
+    return layout;
+}
+
+// FITS primary header: 80 character cards in 2880 byte blocks up to END.
+static MappedLayout parseFits(const uint8_t* data, size_t size) {
+    long bitpix = 0, naxis = 0, naxis1 = 0, naxis2 = 0;
+    double bzero = 0;
+
+    size_t card = 0;
+    for (; card + 80 <= size; card += 80) {
+        std::string key(reinterpret_cast<const char*>(data + card), 8);
+        key.erase(key.find_last_not_of(' ') + 1);
+        if (key == "END") {
+            break;
+        }
+        std::string value(reinterpret_cast<const char*>(data + card + 10), 70);
+        if (key == "BITPIX") bitpix = std::stol(value);
+        else if (key == "NAXIS") naxis = std::stol(value);
+        else if (key == "NAXIS1") naxis1 = std::stol(value);
+        else if (key == "NAXIS2") naxis2 = std::stol(value);
+        else if (key == "BZERO") bzero = std::stod(value);
+    }
+    if (card + 80 > size || naxis != 2 || naxis1 <= 0 || naxis2 <= 0) {
+        throw std::runtime_error("Unsupported FITS image: a 2D primary image is required.");
+    }
+    if (static_cast<unsigned long>(naxis1) > MAX_DIMENSION || static_cast<unsigned long>(naxis2) > MAX_DIMENSION) {
+        throw std::runtime_error("FITS image dimensions out of range.");
+    }
+
+    MappedLayout layout;
+    layout.geometry.cols = naxis1;
+    layout.geometry.rows = naxis2;
+    layout.geometry.offset = (card / 2880 + 1) * 2880;
+    layout.geometry.bigEndian = true;
+    switch (bitpix) {
+        case 8:
+            layout.geometry.depth = CV_8U;
+            break;
+        case 16:
+            layout.flipSign = (bzero == 32768);
+            layout.geometry.depth = layout.flipSign ? CV_16U : CV_16S;
+            break;
+        case -32:
+            layout.geometry.depth = CV_32F;
+            break;
+        default:
+            throw std::runtime_error("Unsupported FITS BITPIX.");
+    }
+    return layout;
+}
+
+
+/*
+ * ********************************
+ *   MappedImageReader
+ * ********************************
+ */
+
+static size_t sampleSizeOf(int depth) {
+    switch (depth) {
+        case CV_8U:
+        case CV_8S:
+            return 1;
+        case CV_16U:
+        case CV_16S:
+            return 2;
+        case CV_32F:
+            return 4;
+        default:
+            throw std::runtime_error("Unsupported depth for a mapped image.");
+    }
+}
+
+// Host order copy of stored pixels, for the depths read through a
+// conversion (signed 16-bit FITS).
+static cv::Mat decodedCopy(const cv::Mat& stored, bool bigEndian, bool flipSign) {
+    cv::Mat decoded(stored.rows, stored.cols, stored.type());
+    size_t sampleSize = stored.elemSize1();
+    for (int y = 0; y < stored.rows; ++y) {
+        const uchar* src = stored.ptr(y);
+        uchar* dst = decoded.ptr(y);
+        for (int x = 0; x < stored.cols; ++x) {
+            const uchar* sample = src + x * sampleSize;
+            if (sampleSize == 2) {
+                uint16_t value = loadSample<uint16_t>(sample, bigEndian, flipSign);
+                std::memcpy(dst + x * sampleSize, &value, sizeof value);
+            } else if (sampleSize == 4) {
+                uint32_t value = loadSample<uint32_t>(sample, bigEndian, flipSign);
+                std::memcpy(dst + x * sampleSize, &value, sizeof value);
+            } else {
+                dst[x] = *sample;
+            }
+        }
+    }
+    return decoded;
+}
+
+static bool nativeDepth(int depth) {
+    return depth == CV_8U || depth == CV_16U || depth == CV_32F;
+}
+
+MappedImageReader::MappedPixels MappedImageReader::mapImage(const std::string& imagePath) const {
+    MappedPixels mapped;
+    mapped.file = std::make_shared<MappedFile>(imagePath);
+    const MappedFile& file = *mapped.file;
+
+    MappedLayout layout;
+    if (raw) {
+        layout.geometry = *raw;
+    } else if (isPgm(file.data(), file.size())) {
+        layout = parsePgm(file.data(), file.size());
+    } else if (isFits(file.data(), file.size())) {
+        layout = parseFits(file.data(), file.size());
+    } else {
+        throw std::runtime_error("Not a PGM (P5) or FITS image: " + imagePath);
+    }
+
+    const RawGeometry& g = layout.geometry;
+    size_t sampleSize = sampleSizeOf(g.depth);
+    if (g.rows == 0 || g.cols == 0 || g.rows > MAX_DIMENSION || g.cols > MAX_DIMENSION) {
+        throw std::runtime_error("Unsupported image geometry: " + imagePath);
+    }
+    // rows * cols * sampleSize > available, without the product wrapping
+    if (g.offset > file.size() || g.rows > (file.size() - g.offset) / sampleSize / g.cols) {
+        throw std::runtime_error("Image file is smaller than its geometry: " + imagePath);
+    }
+
+    // The pixels stay as stored, possibly big-endian and off the sample
+    // alignment (odd PGM header): the accessors decode them, so the mapping
+    // is never written and its pages stay shared with the page cache.
+    mapped.image = cv::Mat(static_cast<int>(g.rows), static_cast<int>(g.cols), CV_MAKETYPE(g.depth, 1),
+                           const_cast<uint8_t*>(file.data() + g.offset));
+    mapped.bigEndian = g.bigEndian && sampleSize > 1;
+    mapped.flipSign = layout.flipSign;
+    return mapped;
+}
+
+std::unique_ptr<IImage<uint16_t>> MappedImageReader::readImage(const std::string& imagePath) {
+    MappedPixels mapped = mapImage(imagePath);
+    if (!nativeDepth(mapped.image.depth())) {
+        cv::Mat converted;
+        decodedCopy(mapped.image, mapped.bigEndian, mapped.flipSign).convertTo(converted, CV_32F);
+        return std::make_unique<ImageWrapper<uint16_t>>(converted);
+    }
+    return std::make_unique<ImageWrapper<uint16_t>>(mapped.image, mapped.file, mapped.bigEndian, mapped.flipSign);
+}
+
+AnyImage MappedImageReader::readImageAnyDepth(const std::string& imagePath) {
+    MappedPixels mapped = mapImage(imagePath);
+    if (!nativeDepth(mapped.image.depth())) {
+        return createImageWrapper(decodedCopy(mapped.image, mapped.bigEndian, mapped.flipSign));
+    }
+    return createImageWrapper(mapped.image, mapped.file, mapped.bigEndian, mapped.flipSign);
+}
+
+bool MappedImageReader::canRead(const std::string& imagePath) {
+    char head[9] = {};
+    std::ifstream in(imagePath, std::ios::binary);
+    in.read(head, sizeof(head));
+    size_t n = static_cast<size_t>(in.gcount());
+    const uint8_t* data = reinterpret_cast<const uint8_t*>(head);
+    return isPgm(data, n) || (n == sizeof(head) && std::memcmp(head, "SIMPLE  =", 9) == 0);
+}
+
+
+std::unique_ptr<ImageReader> ImageReaderFactory::createImageReader(const std::string& imagePath) {
+    if (MappedImageReader::canRead(imagePath)) {
+        return std::make_unique<MappedImageReader>();
+    }
+    return createImageReader();
+}
@@ -0,0 +1,169 @@
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+
+#include "image.h"
+#include "metrics.h"
+#include "pipeline.h"
+#include "processor.h"
+#include "writer.h"
+
+
+namespace {
+
+struct DecodedImage {
+    size_t index = 0;
+    AnyImage image;
+};
+
+struct SelectedImage {
+    size_t index = 0;
+    std::shared_ptr<CapturedResult> result;
+};
+
+std::string outputPathFor(const std::string& input, const BatchOptions& options) {
+    std::filesystem::path name = std::filesystem::path(input).filename();
+    name += options.binary ? ".bin" : ".json";
+    return (std::filesystem::path(options.outputDir) / name).string();
+}
+
+// Results are named after the file name alone: two inputs of the same name
+// (from different directories) would overwrite each other's result.
+void checkOutputNames(const std::vector<std::string>& inputs, const BatchOptions& options) {
+    std::map<std::string, const std::string*> writers;
+    for (const std::string& input : inputs) {
+        auto [it, inserted] = writers.emplace(outputPathFor(input, options), &input);
+        if (!inserted) {
+            throw std::runtime_error("Batch inputs " + *it->second + " and " + input
+                                     + " would both write " + it->first);
+        }
+    }
+}
+
+void reportFailure(const std::string& input, const std::exception& e, std::atomic<size_t>& failed) {
+    ++failed;
+    std::cerr << "Error occurred on " << input << ": " << e.what() << "\n";
+}
+
+} // namespace
+
+
+BatchStats runBatch(const std::vector<std::string>& inputs, const BatchOptions& options) {
+    checkOutputNames(inputs, options);
+
+    BoundedQueue<DecodedImage> decoded(options.queueCapacity);
+    BoundedQueue<SelectedImage> selected(options.queueCapacity);
+
+    std::atomic<size_t> nextInput{0};
+    std::atomic<size_t> failed{0};
+    std::atomic<size_t> processed{0};
+
+    size_t readerThreads = std::max<size_t>(1, options.readerThreads);
+    size_t computeThreads = std::max<size_t>(1, options.computeThreads);
+    std::atomic<size_t> readersLeft{readerThreads};
+    std::atomic<size_t> computeLeft{computeThreads};
+
+    std::vector<std::thread> threads;
+
+    // read
+    for (size_t r = 0; r < readerThreads; ++r) {
+        threads.emplace_back([&] {
+            for (size_t i = nextInput++; i < inputs.size(); i = nextInput++) {
+                try {
+                    AnyImage image;
+                    {
+                        TOPN_STAGE_TIMER(Decode);
+                        image = options.cache != nullptr
+                            ? options.cache->readImageAnyDepth(inputs[i])
+                            : ImageReaderFactory::createImageReader(inputs[i])->readImageAnyDepth(inputs[i]);
+                    }
+                    decoded.push(DecodedImage{i, std::move(image)});
+                } catch (const std::exception& e) {
+                    reportFailure(inputs[i], e, failed);
+                }
+            }
+            if (--readersLeft == 0) {
+                decoded.close();
+            }
+        });
+    }
+
+    // select
+    for (size_t c = 0; c < computeThreads; ++c) {
+        threads.emplace_back([&] {
+            auto arena = std::make_shared<ScratchArena>(); // reused by the images of this thread
+            DecodedImage job;
+            while (decoded.pop(job)) {
+                try {
+                    auto result = std::make_shared<CapturedResult>();
+                    createImageProcessor(job.image, arena)->processImageTo(options.topN, *result);
+                    job.image = AnyImage(); // free the pixels before waiting on the writer
+                    selected.push(SelectedImage{job.index, std::move(result)});
+                } catch (const std::exception& e) {
+                    reportFailure(inputs[job.index], e, failed);
+                }
+            }
+            if (--computeLeft == 0) {
+                selected.close();
+            }
+        });
+    }
+
+    // write
+    threads.emplace_back([&] {
+        SelectedImage job;
+        while (selected.pop(job)) {
+            try {
+                TOPN_STAGE_TIMER(Output);
+                auto writer = createResultWriter(outputPathFor(inputs[job.index], options));
+                job.result->writeTo(*writer);
+                ++processed;
+            } catch (const std::exception& e) {
+                reportFailure(inputs[job.index], e, failed);
+            }
+        }
+    });
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+
+    BatchStats stats;
+    stats.processed = processed;
+    stats.failed = failed;
+    return stats;
+}
+
+
+std::vector<std::string> listBatchInputs(const std::string& listOrDirectory) {
+    std::vector<std::string> inputs;
+
+    if (std::filesystem::is_directory(listOrDirectory)) {
+        for (const auto& entry : std::filesystem::directory_iterator(listOrDirectory)) {
+            if (entry.is_regular_file()) {
+                inputs.push_back(entry.path().string());
+            }
+        }
+        std::sort(inputs.begin(), inputs.end());
+        return inputs;
+    }
+
+    std::ifstream list(listOrDirectory);
+    if (!list.is_open()) {
+        throw std::runtime_error("Could not open the batch list: " + listOrDirectory);
+    }
+    std::string line;
+    while (std::getline(list, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        if (!line.empty()) {
+            inputs.push_back(line);
+        }
+    }
+    return inputs;
+}
@@ -0,0 +1,146 @@
+#include <csetjmp>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#include <png.h>
+
+#include "pngstream.h"
+
+
+struct PngBandReader::State {
+    FILE* file = nullptr;
+    png_structp png = nullptr;
+    png_infop info = nullptr;
+    size_t rows = 0;
+    size_t cols = 0;
+    int depth = CV_8U;
+    size_t rowBytes = 0;
+    size_t nextRow = 0;
+
+    ~State() {
+        if (png != nullptr) {
+            png_destroy_read_struct(&png, info != nullptr ? &info : nullptr, nullptr);
+        }
+        if (file != nullptr) {
+            std::fclose(file);
+        }
+    }
+};
+
+
+PngBandReader::PngBandReader(const std::string& imagePath) : state(std::make_unique<State>()) {
+    State& s = *state;
+    s.file = std::fopen(imagePath.c_str(), "rb");
+    if (s.file == nullptr) {
+        throw std::runtime_error("Error opening the image file: " + imagePath);
+    }
+    s.png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    s.info = s.png != nullptr ? png_create_info_struct(s.png) : nullptr;
+    if (s.info == nullptr) {
+        throw std::runtime_error("Error creating the PNG decoder.");
+    }
+
+    // libpng reports errors with longjmp to here
+    if (setjmp(png_jmpbuf(s.png))) {
+        throw std::runtime_error("Error reading the PNG header: " + imagePath);
+    }
+
+    png_init_io(s.png, s.file);
+    png_read_info(s.png, s.info);
+
+    int colorType = png_get_color_type(s.png, s.info);
+    int bitDepth = png_get_bit_depth(s.png, s.info);
+    if (png_get_interlace_type(s.png, s.info) != PNG_INTERLACE_NONE) {
+        throw std::runtime_error("Interlaced PNG cannot be streamed: " + imagePath);
+    }
+
+    if (colorType == PNG_COLOR_TYPE_PALETTE) {
+        png_set_palette_to_rgb(s.png);
+    }
+    if (colorType == PNG_COLOR_TYPE_GRAY && bitDepth < 8) {
+        png_set_expand_gray_1_2_4_to_8(s.png);
+    }
+    if (colorType & PNG_COLOR_MASK_ALPHA) {
+        png_set_strip_alpha(s.png);
+    }
+    if (colorType & PNG_COLOR_MASK_COLOR) {
+        // Rec.601 weights of OpenCV's imread (0.299 R + 0.587 G + 0.114 B),
+        // not the libpng default: the same file gives the same gray values
+        // whichever reader decodes it
+        png_set_rgb_to_gray(s.png, 1, 0.299, 0.587);
+    }
+    if (bitDepth == 16) {
+        uint16_t probe = 1;
+        if (*reinterpret_cast<uint8_t*>(&probe) == 1) {
+            png_set_swap(s.png); // PNG is big-endian
+        }
+    }
+    png_read_update_info(s.png, s.info);
+
+    if (png_get_channels(s.png, s.info) != 1) {
+        throw std::runtime_error("Unsupported PNG color layout: " + imagePath);
+    }
+    s.rows = png_get_image_height(s.png, s.info);
+    s.cols = png_get_image_width(s.png, s.info);
+    s.depth = png_get_bit_depth(s.png, s.info) == 16 ? CV_16U : CV_8U;
+    s.rowBytes = png_get_rowbytes(s.png, s.info);
+}
+
+PngBandReader::~PngBandReader() = default;
+
+size_t PngBandReader::rows() const { return state->rows; }
+size_t PngBandReader::cols() const { return state->cols; }
+int PngBandReader::depth() const { return state->depth; }
+size_t PngBandReader::rowsLeft() const { return state->rows - state->nextRow; }
+
+ImageView PngBandReader::readBand(std::vector<uint8_t>& buffer, size_t maxRows) {
+    State& s = *state;
+    size_t n = std::min(maxRows, rowsLeft());
+
+    ImageView v;
+    v.cols = s.cols;
+    v.stride = s.rowBytes;
+    v.depth = s.depth;
+    if (n == 0) {
+        return v;
+    }
+
+    buffer.resize(n * s.rowBytes);
+    std::vector<png_bytep> rowPointers(n);
+    for (size_t i = 0; i < n; ++i) {
+        rowPointers[i] = buffer.data() + i * s.rowBytes;
+    }
+
+    if (setjmp(png_jmpbuf(s.png))) {
+        throw std::runtime_error("Error decoding the PNG rows.");
+    }
+    png_read_rows(s.png, rowPointers.data(), nullptr, static_cast<png_uint_32>(n));
+    s.nextRow += n;
+
+    v.data = buffer.data();
+    v.rows = n;
+    return v;
+}
+
+bool PngBandReader::isPng(const std::string& imagePath) {
+    unsigned char signature[8] = {};
+    FILE* file = std::fopen(imagePath.c_str(), "rb");
+    if (file == nullptr) {
+        return false;
+    }
+    size_t n = std::fread(signature, 1, sizeof(signature), file);
+    std::fclose(file);
+    return n == sizeof(signature) && png_sig_cmp(signature, 0, sizeof(signature)) == 0;
+}
+
+
+void streamPngTopN(const std::string& imagePath, size_t topN, ResultWriter& writer, size_t bandRows) {
+    PngBandReader reader(imagePath);
+    if (reader.depth() == CV_16U) {
+        writer.write(selectTopNFromPng<uint16_t>(reader, topN, bandRows));
+    } else {
+        writer.write(selectTopNFromPng<uint8_t>(reader, topN, bandRows));
+    }
+}
@@ -0,0 +1,78 @@
+#include "scratch.h"
+
+
+ScratchArena::Lease::Lease(const std::shared_ptr<ScratchArena>& arena) : held(arena) {
+    if (held) {
+        lock = std::unique_lock<std::mutex>(held->mutex, std::try_to_lock);
+    }
+    if (!lock.owns_lock()) {
+        held = std::make_shared<ScratchArena>();
+    }
+    current = held.get();
+}
+
+std::vector<std::vector<PixelCoord>>& ScratchArena::localHeaps(size_t numTasks) {
+    // heaps beyond numTasks wait in spareHeaps: a call with fewer tasks does
+    // not free the buffers of the next one with more
+    while (heaps.size() > numTasks) {
+        spareHeaps.push_back(std::move(heaps.back()));
+        heaps.pop_back();
+    }
+    while (heaps.size() < numTasks && !spareHeaps.empty()) {
+        heaps.push_back(std::move(spareHeaps.back()));
+        spareHeaps.pop_back();
+    }
+    heaps.resize(numTasks);
+    if (taskCandidates.size() < numTasks) {
+        taskCandidates.resize(numTasks);
+    }
+    for (auto& heap : heaps) {
+        heap.clear();
+    }
+    return heaps;
+}
+
+std::vector<PackedKey>& ScratchArena::packedKeys() {
+    keys.clear();
+    return keys;
+}
+
+std::vector<std::vector<PixelCoord>>& ScratchArena::buckets(size_t count) {
+    for (auto& bucket : bucketStorage) {
+        bucket.clear();
+    }
+    if (bucketStorage.size() < count) {
+        bucketStorage.resize(count);
+    }
+    return bucketStorage;
+}
+
+std::vector<uint32_t>& ScratchArena::histogram(size_t bins) {
+    counts.assign(bins, 0);
+    return counts;
+}
+
+size_t ScratchArena::reservedBytes() const {
+    size_t bytes = keys.capacity() * sizeof(PackedKey)
+                 + (singleCandidates.capacity() + counts.capacity()) * sizeof(uint32_t);
+    for (const auto* list : {&heaps, &spareHeaps, &bucketStorage}) {
+        for (const auto& pixels : *list) {
+            bytes += pixels.capacity() * sizeof(PixelCoord);
+        }
+    }
+    for (const auto& row : taskCandidates) {
+        bytes += row.capacity() * sizeof(uint32_t);
+    }
+    return bytes;
+}
+
+void ScratchArena::release() {
+    std::vector<std::vector<PixelCoord>>().swap(heaps);
+    std::vector<std::vector<PixelCoord>>().swap(spareHeaps);
+    std::vector<std::vector<uint32_t>>().swap(taskCandidates);
+    std::vector<uint32_t>().swap(singleCandidates);
+    std::vector<PackedKey>().swap(keys);
+    std::vector<std::vector<PixelCoord>>().swap(bucketStorage);
+    std::vector<uint32_t>().swap(counts);
+    nodePool.release();
+}
@@ -0,0 +1,305 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <vector>
+
+#include "processor.h"
+#include "selector.h"
+#include "threadpool.h"
+
+
+namespace {
+
+const char* const STRATEGY_NAMES[STRATEGY_COUNT] = {
+    "HeapBest", "ParallelV1", "ParallelV512", "CountingSort", "HistogramSelect", "PackedKeys", "TileSummary"
+};
+
+constexpr size_t COST_TERMS = 5;
+
+std::array<double, COST_TERMS> costTerms(const ImageFeatures& features) {
+    double pixels = static_cast<double>(features.pixels());
+    double tasks = static_cast<double>(std::max<size_t>(1, features.tasks));
+    double topN = static_cast<double>(features.topN);
+    return {1.0, pixels, pixels / tasks, topN * std::log2(topN + 1), pixels * features.dominantShare};
+}
+
+/*
+ * ********************************
+ *   Calibration
+ * ********************************
+ */
+
+// Synthetic 16-bit frames of the classes the cost model has to tell apart.
+cv::Mat calibrationImage(size_t size, int imageClass, std::mt19937& gen) {
+    cv::Mat mat(static_cast<int>(size), static_cast<int>(size), CV_16U);
+    uint16_t* pixels = mat.ptr<uint16_t>(0);
+    size_t n = size * size;
+    for (size_t i = 0; i < n; ++i) {
+        switch (imageClass) {
+            case 0: pixels[i] = static_cast<uint16_t>(gen()); break;      // noise over the full range
+            case 1: pixels[i] = static_cast<uint16_t>(gen() % 40);        // star field: dark noise ...
+                    if (gen() % 500 == 0) pixels[i] = 1000 + gen() % 60000; // ... and a few stars
+                    break;
+            default: pixels[i] = 17; break;                               // uniform
+        }
+    }
+    return mat;
+}
+
+// Least squares fit of y = X c with c >= 0: terms that come out negative are
+// pinned to 0 and the others refitted. Columns are scaled to 1 first.
+StrategyCost fitCost(const std::vector<std::array<double, COST_TERMS>>& x, const std::vector<double>& y) {
+    std::array<double, COST_TERMS> scale{};
+    for (const auto& row : x) {
+        for (size_t j = 0; j < COST_TERMS; ++j) {
+            scale[j] = std::max(scale[j], std::abs(row[j]));
+        }
+    }
+    std::array<bool, COST_TERMS> active;
+    active.fill(true);
+    std::array<double, COST_TERMS> c{};
+
+    for (size_t pass = 0; pass < COST_TERMS; ++pass) {
+        // normal equations of the active terms, small ridge for rank deficient sets
+        double a[COST_TERMS][COST_TERMS + 1] = {};
+        for (size_t r = 0; r < x.size(); ++r) {
+            for (size_t i = 0; i < COST_TERMS; ++i) {
+                if (!active[i] || scale[i] == 0) continue;
+                for (size_t j = 0; j < COST_TERMS; ++j) {
+                    if (!active[j] || scale[j] == 0) continue;
+                    a[i][j] += x[r][i] / scale[i] * x[r][j] / scale[j];
+                }
+                a[i][COST_TERMS] += x[r][i] / scale[i] * y[r];
+            }
+        }
+        for (size_t i = 0; i < COST_TERMS; ++i) {
+            a[i][i] += 1e-9;
+        }
+        // Gaussian elimination with partial pivoting
+        for (size_t i = 0; i < COST_TERMS; ++i) {
+            size_t pivot = i;
+            for (size_t k = i + 1; k < COST_TERMS; ++k) {
+                if (std::abs(a[k][i]) > std::abs(a[pivot][i])) pivot = k;
+            }
+            std::swap(a[i], a[pivot]);
+            for (size_t k = 0; k < COST_TERMS; ++k) {
+                if (k == i || a[i][i] == 0) continue;
+                double f = a[k][i] / a[i][i];
+                for (size_t j = i; j <= COST_TERMS; ++j) {
+                    a[k][j] -= f * a[i][j];
+                }
+            }
+        }
+        bool negative = false;
+        for (size_t i = 0; i < COST_TERMS; ++i) {
+            c[i] = (active[i] && scale[i] != 0 && a[i][i] != 0) ? a[i][COST_TERMS] / a[i][i] / scale[i] : 0;
+            if (c[i] < 0) {
+                active[i] = false;
+                negative = true;
+            }
+        }
+        if (!negative) {
+            break;
+        }
+    }
+
+    StrategyCost cost;
+    cost.overhead = std::max(0.0, c[0]);
+    cost.perPixel = std::max(0.0, c[1]);
+    cost.perTaskPixel = std::max(0.0, c[2]);
+    cost.perHeapOp = std::max(0.0, c[3]);
+    cost.perDominantPixel = std::max(0.0, c[4]);
+    return cost;
+}
+
+} // namespace
+
+
+const char* strategyName(Strategy strategy) {
+    size_t i = static_cast<size_t>(strategy);
+    return i < STRATEGY_COUNT ? STRATEGY_NAMES[i] : "Unknown";
+}
+
+double StrategyCost::predict(const ImageFeatures& features) const {
+    auto terms = costTerms(features);
+    return overhead * terms[0] + perPixel * terms[1] + perTaskPixel * terms[2]
+         + perHeapOp * terms[3] + perDominantPixel * terms[4];
+}
+
+StrategyCost StrategyCost::fit(const std::vector<ImageFeatures>& features, const std::vector<double>& micros) {
+    std::vector<std::array<double, COST_TERMS>> terms;
+    terms.reserve(features.size());
+    for (const ImageFeatures& f : features) {
+        terms.push_back(costTerms(f));
+    }
+    return fitCost(terms, micros);
+}
+
+
+/*
+ * ********************************
+ *   StrategySelector
+ * ********************************
+ */
+bool StrategySelector::applicable(Strategy strategy, const ImageFeatures& features) {
+    switch (strategy) {
+        case Strategy::CountingSort:
+        case Strategy::HistogramSelect:
+            return features.integralValues; // one bucket per value
+        default:
+            return strategy < Strategy::Count;
+    }
+}
+
+Strategy StrategySelector::choose(const ImageFeatures& features) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!hasModel) {
+        return Strategy::ParallelV1;
+    }
+    Strategy best = Strategy::ParallelV1;
+    double bestCost = costs[static_cast<size_t>(best)].predict(features);
+    for (size_t i = 0; i < STRATEGY_COUNT; ++i) {
+        Strategy strategy = static_cast<Strategy>(i);
+        double cost = costs[i].predict(features);
+        if (applicable(strategy, features) && cost < bestCost) {
+            best = strategy;
+            bestCost = cost;
+        }
+    }
+    return best;
+}
+
+bool StrategySelector::calibrated() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return hasModel;
+}
+
+StrategyCost StrategySelector::cost(Strategy strategy) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return costs[static_cast<size_t>(strategy)];
+}
+
+void StrategySelector::setCost(Strategy strategy, const StrategyCost& cost) {
+    std::lock_guard<std::mutex> lock(mutex);
+    costs[static_cast<size_t>(strategy)] = cost;
+    hasModel = true;
+}
+
+void StrategySelector::reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    costs = {};
+    hasModel = false;
+}
+
+bool StrategySelector::load(const std::string& path) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    std::array<StrategyCost, STRATEGY_COUNT> loaded{};
+    std::array<bool, STRATEGY_COUNT> seen{};
+    size_t threads = 0;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string name;
+        if (!(fields >> name) || name[0] == '#') {
+            continue;
+        }
+        if (name == "threads") {
+            fields >> threads;
+            continue;
+        }
+        auto it = std::find_if(std::begin(STRATEGY_NAMES), std::end(STRATEGY_NAMES),
+                               [&](const char* n) { return name == n; });
+        StrategyCost cost;
+        if (it == std::end(STRATEGY_NAMES)
+            || !(fields >> cost.overhead >> cost.perPixel >> cost.perTaskPixel
+                        >> cost.perHeapOp >> cost.perDominantPixel)) {
+            return false; // unknown strategy, or a file of an older model
+        }
+        size_t i = static_cast<size_t>(it - std::begin(STRATEGY_NAMES));
+        loaded[i] = cost;
+        seen[i] = true;
+    }
+    if (threads != ThreadPool::instance().size()
+        || std::find(seen.begin(), seen.end(), false) != seen.end()) {
+        return false; // measured on another pool, or an older strategy set
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    costs = loaded;
+    hasModel = true;
+    return true;
+}
+
+void StrategySelector::save(const std::string& path) const {
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open the strategy cost file: " + path);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    file << "# strategy cost model, microseconds: overhead perPixel perTaskPixel perHeapOp perDominantPixel\n";
+    file << "threads " << ThreadPool::instance().size() << "\n";
+    file.precision(9);
+    for (size_t i = 0; i < STRATEGY_COUNT; ++i) {
+        file << STRATEGY_NAMES[i] << " " << costs[i].overhead << " " << costs[i].perPixel << " "
+             << costs[i].perTaskPixel << " " << costs[i].perHeapOp << " " << costs[i].perDominantPixel << "\n";
+    }
+}
+
+void StrategySelector::calibrate() {
+    constexpr size_t REPETITIONS = 2; // best of, against scheduling noise
+    std::mt19937 gen(12345);
+
+    std::vector<ImageFeatures> features;
+    std::vector<std::vector<double>> timings(STRATEGY_COUNT);
+
+    // 4, 9 and 16 times the default grain: every parallel strategy runs on
+    // min(grains, pool size) tasks, as it does on real frames
+    for (size_t size : {512, 768, 1024}) {
+        for (int imageClass = 0; imageClass < 3; ++imageClass) {
+            cv::Mat mat = calibrationImage(size, imageClass, gen);
+            ImageWrapper<uint16_t> img(mat);
+            for (double ratio : {0.001, 0.05, 0.5}) {
+                size_t topN = std::max<size_t>(1, static_cast<size_t>(ratio * size * size));
+                features.push_back(ImageProcessor<uint16_t>(img).imageFeatures(topN));
+
+                for (size_t s = 0; s < STRATEGY_COUNT; ++s) {
+                    double best = std::numeric_limits<double>::max();
+                    for (size_t r = 0; r < REPETITIONS; ++r) {
+                        ImageProcessor<uint16_t> ip(img);
+                        ip.invalidateTileSummary(); // kept with the image: TileSummary pays its summary
+                        auto start = std::chrono::steady_clock::now();
+                        ip.runStrategy(static_cast<Strategy>(s), topN);
+                        std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+                        best = std::min(best, elapsed.count());
+                    }
+                    timings[s].push_back(best);
+                }
+            }
+        }
+    }
+
+    for (size_t s = 0; s < STRATEGY_COUNT; ++s) {
+        setCost(static_cast<Strategy>(s), StrategyCost::fit(features, timings[s]));
+    }
+}
+
+bool StrategySelector::loadOrCalibrate(const std::string& path) {
+    if (load(path)) {
+        return true;
+    }
+    calibrate();
+    try {
+        save(path);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << "\n"; // the model still applies to this run
+    }
+    return false;
+}
@@ -0,0 +1,401 @@
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "pngstream.h"
+#include "processor.h"
+#include "server.h"
+#include "writer.h"
+
+
+namespace {
+
+constexpr size_t MAX_LINE = 4096;
+
+/*
+ * ********************************
+ *   Socket I/O
+ * ********************************
+ */
+
+// Reads more bytes into buffered; false on end of stream.
+bool receiveMore(int fd, std::string& buffered) {
+    char chunk[1 << 16];
+    for (;;) {
+        ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+        if (n > 0) {
+            buffered.append(chunk, static_cast<size_t>(n));
+            return true;
+        }
+        if (n == 0 || errno != EINTR) {
+            return false;
+        }
+    }
+}
+
+bool receiveLine(int fd, std::string& buffered, std::string& line) {
+    size_t end;
+    while ((end = buffered.find('\n')) == std::string::npos) {
+        if (buffered.size() > MAX_LINE || !receiveMore(fd, buffered)) {
+            return false;
+        }
+    }
+    line.assign(buffered, 0, end);
+    buffered.erase(0, end + 1);
+    return true;
+}
+
+bool receiveExact(int fd, std::string& buffered, uint8_t* out, size_t n) {
+    size_t fromBuffer = std::min(n, buffered.size());
+    std::memcpy(out, buffered.data(), fromBuffer);
+    buffered.erase(0, fromBuffer);
+    for (size_t got = fromBuffer; got < n;) {
+        ssize_t r = ::recv(fd, out + got, n - got, 0);
+        if (r > 0) {
+            got += static_cast<size_t>(r);
+        } else if (r == 0 || errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool sendAll(int fd, const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t r = ::send(fd, data, n, MSG_NOSIGNAL);
+        if (r > 0) {
+            data += r;
+            n -= static_cast<size_t>(r);
+        } else if (r < 0 && errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+}
+
+sockaddr_un socketAddress(const std::string& socketPath) {
+    sockaddr_un address{};
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        throw std::runtime_error("Socket path too long: " + socketPath);
+    }
+    address.sun_family = AF_UNIX;
+    std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+    return address;
+}
+
+
+/*
+ * ********************************
+ *   Requests
+ * ********************************
+ */
+
+struct ProtocolError : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+int depthFromName(const std::string& name) {
+    if (name == "u8") return CV_8U;
+    if (name == "u16") return CV_16U;
+    if (name == "f32") return CV_32F;
+    throw ProtocolError("unknown pixel type " + name);
+}
+
+size_t depthBytes(int depth) {
+    return depth == CV_8U ? 1 : depth == CV_16U ? 2 : 4;
+}
+
+const char* depthName(int depth) {
+    switch (depth) {
+        case CV_8U: return "u8";
+        case CV_16U: return "u16";
+        case CV_32F: return "f32";
+        default: throw std::runtime_error("Unsupported image depth for an inline request.");
+    }
+}
+
+std::string statsJson(const ImageCacheStats& s) {
+    return "{\"hits\": " + std::to_string(s.hits) + ", \"misses\": " + std::to_string(s.misses)
+        + ", \"evictions\": " + std::to_string(s.evictions) + ", \"entries\": " + std::to_string(s.entries)
+        + ", \"bytes\": " + std::to_string(s.bytes) + ", \"budget\": " + std::to_string(s.budget) + "}";
+}
+
+// Runs one request; the pixels of a raw request are read from the socket.
+// rawHeader is set once a raw request line is accepted: from there on a
+// failure may leave pixels unread, and the connection cannot be resynced.
+std::string answer(const std::string& line, int fd, std::string& buffered, CachingImageReader* cache,
+                   const std::shared_ptr<ScratchArena>& arena, size_t maxRawBytes, bool& rawHeader) {
+    if (line == "STATS") {
+        return statsJson(cache != nullptr ? cache->stats() : ImageCacheStats());
+    }
+    if (line == "METRICS") {
+        return Metrics::instance().prometheus();
+    }
+    std::istringstream request(line);
+    std::string command, format, source;
+    size_t topN = 0;
+    if (!(request >> command >> topN >> format >> source) || command != "TOPN"
+        || (format != "json" && format != "bin")) {
+        throw ProtocolError("malformed request");
+    }
+
+    std::ostringstream out;
+    std::unique_ptr<ResultWriter> writer;
+    if (format == "bin") {
+        writer = std::make_unique<BinaryResultWriter>(out);
+    } else {
+        writer = std::make_unique<JsonResultWriter>(out);
+    }
+
+    if (source == "raw") {
+        size_t rows = 0, cols = 0;
+        std::string type;
+        if (!(request >> rows >> cols >> type) || rows == 0 || cols == 0
+            || rows > static_cast<size_t>(std::numeric_limits<int>::max())
+            || cols > static_cast<size_t>(std::numeric_limits<int>::max()) / 4) {
+            throw ProtocolError("malformed raw geometry");
+        }
+        int depth = depthFromName(type);
+        size_t elemSize = depthBytes(depth);
+        if (rows > maxRawBytes / elemSize / cols) {
+            throw ProtocolError("raw image larger than " + std::to_string(maxRawBytes) + " bytes");
+        }
+        rawHeader = true;
+        cv::Mat mat(static_cast<int>(rows), static_cast<int>(cols), depth);
+        if (!receiveExact(fd, buffered, mat.data, rows * cols * elemSize)) {
+            throw ProtocolError("truncated pixels");
+        }
+        createImageProcessor(createImageWrapper(mat), arena)->processImageTo(topN, *writer);
+    } else if (source == "path") {
+        std::string imagePath;
+        std::getline(request >> std::ws, imagePath);
+        if (cache == nullptr && PngBandReader::isPng(imagePath)) {
+            streamPngTopN(imagePath, topN, *writer); // decode and selection interleaved, no stages
+        } else {
+            AnyImage image;
+            {
+                TOPN_STAGE_TIMER(Decode);
+                image = cache != nullptr
+                    ? cache->readImageAnyDepth(imagePath)
+                    : ImageReaderFactory::createImageReader(imagePath)->readImageAnyDepth(imagePath);
+            }
+            createImageProcessor(image, arena)->processImageTo(topN, *writer);
+        }
+    } else {
+        throw ProtocolError("unknown source " + source);
+    }
+    return out.str();
+}
+
+std::string errorReply(const std::string& message) {
+    std::string reply = "ERR " + message;
+    for (char& c : reply) {
+        if (c == '\n' || c == '\r') c = ' ';
+    }
+    return reply + "\n";
+}
+
+} // namespace
+
+
+/*
+ * ********************************
+ *   TopNServer
+ * ********************************
+ */
+TopNServer::TopNServer(const std::string& socketPath, size_t cacheBytes, size_t maxRawBytes)
+    : path(socketPath), maxRaw(maxRawBytes) {
+    if (cacheBytes > 0) {
+        cache = std::make_unique<CachingImageReader>(cacheBytes);
+    }
+    sockaddr_un address = socketAddress(socketPath);
+    if (::pipe(wakePipe) != 0) {
+        throw std::runtime_error("Error creating the server wake pipe.");
+    }
+    listenFd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenFd < 0) {
+        throw std::runtime_error("Error creating the server socket.");
+    }
+    ::unlink(socketPath.c_str()); // stale socket of a previous run
+    if (::bind(listenFd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+        || ::listen(listenFd, SOMAXCONN) != 0) {
+        std::string reason = std::strerror(errno);
+        ::close(listenFd);
+        ::close(wakePipe[0]);
+        ::close(wakePipe[1]);
+        throw std::runtime_error("Error listening on " + socketPath + ": " + reason);
+    }
+}
+
+TopNServer::~TopNServer() {
+    reapConnections(true);
+    ::close(listenFd);
+    ::unlink(path.c_str());
+    ::close(wakePipe[0]);
+    ::close(wakePipe[1]);
+}
+
+ImageCacheStats TopNServer::cacheStats() const {
+    return cache != nullptr ? cache->stats() : ImageCacheStats();
+}
+
+void TopNServer::stop() {
+    char byte = 0;
+    ssize_t ignored = ::write(wakePipe[1], &byte, 1);
+    (void)ignored;
+}
+
+void TopNServer::run() {
+    pollfd fds[2] = {{listenFd, POLLIN, 0}, {wakePipe[0], POLLIN, 0}};
+    for (;;) {
+        if (::poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        if (fds[1].revents != 0) {
+            char byte;
+            ssize_t ignored = ::read(wakePipe[0], &byte, 1);
+            (void)ignored;
+            break;
+        }
+        int fd = ::accept(listenFd, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+
+        reapConnections(false);
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        Connection& connection = connections.emplace_back();
+        connection.fd = fd;
+        connection.thread = std::thread([this, &connection] { serve(connection); });
+    }
+    reapConnections(true);
+}
+
+void TopNServer::serve(Connection& connection) {
+    std::string buffered;
+    std::string line;
+    auto arena = std::make_shared<ScratchArena>(); // working memory of the requests of this connection
+    while (receiveLine(connection.fd, buffered, line)) {
+        std::string reply;
+        bool keepOpen = true;
+        bool rawHeader = false;
+        try {
+            std::string body = answer(line, connection.fd, buffered, cache.get(), arena, maxRaw, rawHeader);
+            reply = "OK " + std::to_string(body.size()) + "\n" + body;
+            ++served;
+        } catch (const ProtocolError& e) {
+            reply = errorReply(e.what());
+            keepOpen = false;
+        } catch (const std::exception& e) {
+            reply = errorReply(e.what());
+            keepOpen = !rawHeader; // the pixels may be partly unread
+        }
+        bool sent;
+        {
+            TOPN_STAGE_TIMER(Output); // answer() only formats, this is the write
+            sent = sendAll(connection.fd, reply.data(), reply.size());
+        }
+        if (!sent || !keepOpen) {
+            break;
+        }
+    }
+    ::shutdown(connection.fd, SHUT_RDWR);
+    connection.done = true;
+}
+
+// Joins the finished connections, or all of them after waking them up.
+void TopNServer::reapConnections(bool all) {
+    std::lock_guard<std::mutex> lock(connectionsMutex);
+    for (auto it = connections.begin(); it != connections.end();) {
+        if (all) {
+            ::shutdown(it->fd, SHUT_RDWR); // unblocks a pending recv
+        }
+        if (all || it->done) {
+            it->thread.join();
+            ::close(it->fd);
+            it = connections.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+
+/*
+ * ********************************
+ *   TopNClient
+ * ********************************
+ */
+TopNClient::TopNClient(const std::string& socketPath) {
+    sockaddr_un address = socketAddress(socketPath);
+    fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        std::string reason = std::strerror(errno);
+        if (fd >= 0) ::close(fd);
+        throw std::runtime_error("Error connecting to " + socketPath + ": " + reason);
+    }
+}
+
+TopNClient::~TopNClient() {
+    ::close(fd);
+}
+
+std::string TopNClient::queryPath(const std::string& imagePath, size_t topN, bool binary) {
+    std::string request = "TOPN " + std::to_string(topN) + (binary ? " bin" : " json") + " path " + imagePath + "\n";
+    return exchange(request, nullptr);
+}
+
+std::string TopNClient::queryBuffer(const cv::Mat& image, size_t topN, bool binary) {
+    if (image.channels() != 1) {
+        throw std::runtime_error("Only single channel images can be sent inline.");
+    }
+    std::string request = "TOPN " + std::to_string(topN) + (binary ? " bin" : " json") + " raw "
+        + std::to_string(image.rows) + " " + std::to_string(image.cols) + " " + depthName(image.depth()) + "\n";
+    return exchange(request, &image);
+}
+
+std::string TopNClient::queryStats() {
+    return exchange("STATS\n", nullptr);
+}
+
+std::string TopNClient::queryMetrics() {
+    return exchange("METRICS\n", nullptr);
+}
+
+std::string TopNClient::exchange(const std::string& request, const cv::Mat* payload) {
+    bool sent = sendAll(fd, request.data(), request.size());
+    if (payload != nullptr) {
+        size_t rowBytes = payload->cols * payload->elemSize();
+        for (int y = 0; sent && y < payload->rows; ++y) {
+            sent = sendAll(fd, reinterpret_cast<const char*>(payload->ptr(y)), rowBytes);
+        }
+    }
+
+    std::string status;
+    if (!sent || !receiveLine(fd, buffered, status)) {
+        throw std::runtime_error("Connection to the server lost.");
+    }
+    if (status.compare(0, 4, "ERR ") == 0) {
+        throw std::runtime_error(status.substr(4));
+    }
+    if (status.compare(0, 3, "OK ") != 0) {
+        throw std::runtime_error("Unexpected server reply: " + status);
+    }
+    std::string body(std::stoull(status.substr(3)), '\0');
+    if (!receiveExact(fd, buffered, reinterpret_cast<uint8_t*>(&body[0]), body.size())) {
+        throw std::runtime_error("Connection to the server lost.");
+    }
+    return body;
+}
@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <atomic>
+
+#include "simd.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86 1
+#endif
+
+
+/*
+ * ********************************
+ *   Scalar
+ * ********************************
+ */
+
+// Scalar loop over [i, n), also used for the remainder of the vector loops.
+template<typename P>
+static inline size_t filterTail(const P* row, size_t i, size_t n, P threshold, uint32_t* idx, size_t found) {
+    for (; i < n; ++i) {
+        idx[found] = static_cast<uint32_t>(i);
+        found += (row[i] > threshold); // branchless, the slot is overwritten when not taken
+    }
+    return found;
+}
+
+template<typename P>
+static size_t filterAboveScalar(const P* row, size_t n, P threshold, uint32_t* idx) {
+    return filterTail(row, 0, n, threshold, idx, 0);
+}
+
+
+#ifdef SIMD_X86
+
+// Append the set bits of mask as indices base + bit.
+static inline size_t storeMask(uint64_t mask, size_t base, uint32_t* idx, size_t found) {
+    while (mask) {
+        idx[found++] = static_cast<uint32_t>(base + __builtin_ctzll(mask));
+        mask &= mask - 1;
+    }
+    return found;
+}
+
+/*
+ * ********************************
+ *   SSE4.2
+ * ********************************
+ * There is no unsigned compare before AVX-512: a > t  <=>  max(a, t + 1) == a.
+ */
+__attribute__((target("sse4.2")))
+static size_t filterAboveSSE42(const uint8_t* row, size_t n, uint8_t threshold, uint32_t* idx) {
+    if (threshold == UINT8_MAX) {
+        return 0;
+    }
+    const __m128i t1 = _mm_set1_epi8(static_cast<char>(threshold + 1));
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i + 16));
+        uint64_t mask = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(a, t1), a)))
+                      | static_cast<uint64_t>(static_cast<uint32_t>(
+                            _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(b, t1), b)))) << 16;
+        found = storeMask(mask, i, idx, found);
+    }
+    return filterTail(row, i, n, threshold, idx, found);
+}
+
+__attribute__((target("sse4.2")))
+static size_t filterAboveSSE42(const uint16_t* row, size_t n, uint16_t threshold, uint32_t* idx) {
+    if (threshold == UINT16_MAX) {
+        return 0;
+    }
+    const __m128i t1 = _mm_set1_epi16(static_cast<short>(threshold + 1));
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i + 8));
+        __m128i gtA = _mm_cmpeq_epi16(_mm_max_epu16(a, t1), a);
+        __m128i gtB = _mm_cmpeq_epi16(_mm_max_epu16(b, t1), b);
+        // lanes are all ones or all zeros, saturating pack keeps them and their order
+        __m128i gt = _mm_packs_epi16(gtA, gtB);
+        found = storeMask(static_cast<uint32_t>(_mm_movemask_epi8(gt)), i, idx, found);
+    }
+    return filterTail(row, i, n, threshold, idx, found);
+}
+
+__attribute__((target("sse4.2")))
+static size_t filterAboveSSE42(const float* row, size_t n, float threshold, uint32_t* idx) {
+    const __m128 t = _mm_set1_ps(threshold);
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint64_t mask = static_cast<uint64_t>(_mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(row + i), t)))
+                      | static_cast<uint64_t>(_mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(row + i + 4), t))) << 4
+                      | static_cast<uint64_t>(_mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(row + i + 8), t))) << 8
+                      | static_cast<uint64_t>(_mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(row + i + 12), t))) << 12;
+        found = storeMask(mask, i, idx, found);
+    }
+    return filterTail(row, i, n, threshold, idx, found);
+}
+
+
+/*
+ * ********************************
+ *   AVX2
+ * ********************************
+ */
+__attribute__((target("avx2")))
+static size_t filterAboveAVX2(const uint8_t* row, size_t n, uint8_t threshold, uint32_t* idx) {
+    if (threshold == UINT8_MAX) {
+        return 0;
+    }
+    const __m256i t1 = _mm256_set1_epi8(static_cast<char>(threshold + 1));
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i + 32));
+        uint64_t mask = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(a, t1), a)))
+                      | static_cast<uint64_t>(static_cast<uint32_t>(
+                            _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_max_epu8(b, t1), b)))) << 32;
+        found = storeMask(mask, i, idx, found);
+    }
+    return filterTail(row, i, n, threshold, idx, found);
+}
+
+__attribute__((target("avx2")))
+static size_t filterAboveAVX2(const uint16_t* row, size_t n, uint16_t threshold, uint32_t* idx) {
+    if (threshold == UINT16_MAX) {
+        return 0;
+    }
+    const __m256i t1 = _mm256_set1_epi16(static_cast<short>(threshold + 1));
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row + i + 16));
+        __m256i gtA = _mm256_cmpeq_epi16(_mm256_max_epu16(a, t1), a);
+        __m256i gtB = _mm256_cmpeq_epi16(_mm256_max_epu16(b, t1), b);
+        // the pack works per 128-bit lane, restore the order of the 64-bit quarters
+        __m256i gt = _mm256_permute4x64_epi64(_mm256_packs_epi16(gtA, gtB), 0xD8);
+        found = storeMask(static_cast<uint32_t>(_mm256_movemask_epi8(gt)), i, idx, found);
+    }
+    return filterTail(row, i, n, threshold, idx, found);
+}
+
+__attribute__((target("avx2")))
+static size_t filterAboveAVX2(const float* row, size_t n, float threshold, uint32_t* idx) {
+    const __m256 t = _mm256_set1_ps(threshold);
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        uint64_t mask = static_cast<uint64_t>(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(row + i), t, _CMP_GT_OQ)))
+                      | static_cast<uint64_t>(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(row + i + 8), t, _CMP_GT_OQ))) << 8
+                      | static_cast<uint64_t>(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(row + i + 16), t, _CMP_GT_OQ))) << 16
+                      | static_cast<uint64_t>(_mm256_movemask_ps(_mm256_cmp_ps(_mm256_loadu_ps(row + i + 24), t, _CMP_GT_OQ))) << 24;
+        found = storeMask(mask, i, idx, found);
+    }
+    return filterTail(row, i, n, threshold, idx, found);
+}
+
+
+/*
+ * ********************************
+ *   AVX-512
+ * ********************************
+ * Native unsigned compares into mask registers, and the indices are written
+ * with compress-store, 16 per instruction, without a scalar bit loop.
+ */
+__attribute__((target("avx512f,avx512bw")))
+static inline size_t compressStore16(uint32_t* idx, size_t found, __mmask16 mask, size_t base) {
+    const __m512i iota = _mm512_set_epi32(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+    __m512i indices = _mm512_add_epi32(iota, _mm512_set1_epi32(static_cast<int>(base)));
+    _mm512_mask_compressstoreu_epi32(idx + found, mask, indices);
+    return found + static_cast<size_t>(__builtin_popcount(mask));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t filterAboveAVX512(const uint8_t* row, size_t n, uint8_t threshold, uint32_t* idx) {
+    const __m512i t = _mm512_set1_epi8(static_cast<char>(threshold));
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __mmask64 mask = _mm512_cmpgt_epu8_mask(_mm512_loadu_si512(row + i), t);
+        if (mask == 0) {
+            continue;
+        }
+        found = compressStore16(idx, found, static_cast<__mmask16>(mask), i);
+        found = compressStore16(idx, found, static_cast<__mmask16>(mask >> 16), i + 16);
+        found = compressStore16(idx, found, static_cast<__mmask16>(mask >> 32), i + 32);
+        found = compressStore16(idx, found, static_cast<__mmask16>(mask >> 48), i + 48);
+    }
+    return filterTail(row, i, n, threshold, idx, found);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t filterAboveAVX512(const uint16_t* row, size_t n, uint16_t threshold, uint32_t* idx) {
+    const __m512i t = _mm512_set1_epi16(static_cast<short>(threshold));
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __mmask32 mask = _mm512_cmpgt_epu16_mask(_mm512_loadu_si512(row + i), t);
+        if (mask == 0) {
+            continue;
+        }
+        found = compressStore16(idx, found, static_cast<__mmask16>(mask), i);
+        found = compressStore16(idx, found, static_cast<__mmask16>(mask >> 16), i + 16);
+    }
+    return filterTail(row, i, n, threshold, idx, found);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t filterAboveAVX512(const float* row, size_t n, float threshold, uint32_t* idx) {
+    const __m512 t = _mm512_set1_ps(threshold);
+    size_t found = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __mmask16 maskA = _mm512_cmp_ps_mask(_mm512_loadu_ps(row + i), t, _CMP_GT_OQ);
+        __mmask16 maskB = _mm512_cmp_ps_mask(_mm512_loadu_ps(row + i + 16), t, _CMP_GT_OQ);
+        if ((maskA | maskB) == 0) {
+            continue;
+        }
+        found = compressStore16(idx, found, maskA, i);
+        found = compressStore16(idx, found, maskB, i + 16);
+    }
+    return filterTail(row, i, n, threshold, idx, found);
+}
+
+#endif
+
+
+/*
+ * ********************************
+ *   Runtime dispatch
+ * ********************************
+ */
+SimdLevel detectSimdLevel() {
+#ifdef SIMD_X86
+    static const SimdLevel detected = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")) {
+            return SimdLevel::AVX512;
+        }
+        if (__builtin_cpu_supports("avx2")) {
+            return SimdLevel::AVX2;
+        }
+        if (__builtin_cpu_supports("sse4.2")) {
+            return SimdLevel::SSE42;
+        }
+        return SimdLevel::Scalar;
+    }();
+    return detected;
+#else
+    return SimdLevel::Scalar;
+#endif
+}
+
+static std::atomic<int> activeLevel{-1};
+
+SimdLevel simdLevel() {
+    int level = activeLevel.load(std::memory_order_relaxed);
+    if (level < 0) {
+        level = static_cast<int>(detectSimdLevel());
+        activeLevel.store(level, std::memory_order_relaxed);
+    }
+    return static_cast<SimdLevel>(level);
+}
+
+void setSimdLevel(SimdLevel level) {
+    level = std::min(level, detectSimdLevel());
+    activeLevel.store(static_cast<int>(level), std::memory_order_relaxed);
+}
+
+const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::SSE42:
+            return "sse4.2";
+        case SimdLevel::AVX2:
+            return "avx2";
+        case SimdLevel::AVX512:
+            return "avx512";
+        default:
+            return "scalar";
+    }
+}
+
+template<typename P>
+static inline size_t filterAboveDispatch(const P* row, size_t n, P threshold, uint32_t* idx) {
+#ifdef SIMD_X86
+    switch (simdLevel()) {
+        case SimdLevel::AVX512:
+            return filterAboveAVX512(row, n, threshold, idx);
+        case SimdLevel::AVX2:
+            return filterAboveAVX2(row, n, threshold, idx);
+        case SimdLevel::SSE42:
+            return filterAboveSSE42(row, n, threshold, idx);
+        default:
+            break;
+    }
+#endif
+    return filterAboveScalar(row, n, threshold, idx);
+}
+
+size_t filterAbove(const uint8_t* row, size_t n, uint8_t threshold, uint32_t* idx) {
+    return filterAboveDispatch(row, n, threshold, idx);
+}
+
+size_t filterAbove(const uint16_t* row, size_t n, uint16_t threshold, uint32_t* idx) {
+    return filterAboveDispatch(row, n, threshold, idx);
+}
+
+size_t filterAbove(const float* row, size_t n, float threshold, uint32_t* idx) {
+    return filterAboveDispatch(row, n, threshold, idx);
+}
@@ -0,0 +1,112 @@
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+#include "trace.h"
+
+
+void TraceRecorder::start() {
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    for (auto& buffer : buffers) {
+        std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+        buffer->events.clear();
+        buffer->dropped = 0;
+    }
+    originNs.store(nowNs(), std::memory_order_relaxed);
+    active.store(true, std::memory_order_relaxed);
+}
+
+void TraceRecorder::stop() {
+    active.store(false, std::memory_order_relaxed);
+}
+
+TraceRecorder::ThreadBuffer& TraceRecorder::threadBuffer() {
+    // the buffer outlives its thread: the recorder keeps a reference
+    thread_local std::shared_ptr<ThreadBuffer> buffer;
+    if (!buffer) {
+        buffer = std::make_shared<ThreadBuffer>();
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        buffer->tid = buffers.size();
+        buffers.push_back(buffer);
+    }
+    return *buffer;
+}
+
+void TraceRecorder::record(const char* name, const char* category, uint64_t beginNs, uint64_t endNs,
+                           const char* argName0, int64_t arg0, const char* argName1, int64_t arg1) {
+    ThreadBuffer& buffer = threadBuffer();
+    std::lock_guard<std::mutex> lock(buffer.mutex);
+    if (buffer.events.size() >= MAX_EVENTS_PER_THREAD) {
+        ++buffer.dropped;
+        return;
+    }
+    buffer.events.push_back({name, category, beginNs, endNs, argName0, arg0, argName1, arg1});
+}
+
+size_t TraceRecorder::eventCount() const {
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    size_t count = 0;
+    for (const auto& buffer : buffers) {
+        std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+        count += buffer->events.size();
+    }
+    return count;
+}
+
+size_t TraceRecorder::droppedCount() const {
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    size_t count = 0;
+    for (const auto& buffer : buffers) {
+        std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+        count += buffer->dropped;
+    }
+    return count;
+}
+
+std::string TraceRecorder::json() const {
+    uint64_t origin = originNs.load(std::memory_order_relaxed);
+    auto micros = [origin](uint64_t ns) { return ns > origin ? (ns - origin) / 1e3 : 0.0; };
+
+    std::ostringstream out;
+    out.precision(3);
+    out << std::fixed << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    bool first = true;
+    auto separator = [&]() -> std::ostream& {
+        out << (first ? "  " : ",\n  ");
+        first = false;
+        return out;
+    };
+
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    for (const auto& buffer : buffers) {
+        std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+        if (buffer->events.empty()) {
+            continue;
+        }
+        separator() << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << buffer->tid
+                    << ", \"args\": {\"name\": \"thread " << buffer->tid << "\"}}";
+        for (const Event& e : buffer->events) {
+            separator() << "{\"name\": \"" << e.name << "\", \"cat\": \"" << e.category
+                        << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << buffer->tid << ", \"ts\": "
+                        << micros(e.beginNs) << ", \"dur\": " << (e.endNs - e.beginNs) / 1e3;
+            if (e.argName0 != nullptr) {
+                out << ", \"args\": {\"" << e.argName0 << "\": " << e.arg0;
+                if (e.argName1 != nullptr) {
+                    out << ", \"" << e.argName1 << "\": " << e.arg1;
+                }
+                out << "}";
+            }
+            out << "}";
+        }
+    }
+    out << "\n]}\n";
+    return out.str();
+}
+
+void TraceRecorder::writeJson(const std::string& path) const {
+    std::ofstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open the trace file: " + path);
+    }
+    file << json();
+}
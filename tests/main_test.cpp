@@ -1,5 +1,6 @@
 #include <gtest/gtest.h>
 #include <chrono>
+#include <filesystem>
 #include <random>
 #include <tuple>
 #include <vector>
@@ -7,6 +8,16 @@
 #include "utils.h"
 #include "image.h"
 #include "processor.h"
+#include "mmapreader.h"
+#include "pngstream.h"
+#include "pipeline.h"
+#include "server.h"
+#include "imagecache.h"
+#include "selector.h"
+#include "alloctrack.h"
+#include "metrics.h"
+#include "trace.h"
+#include <png.h>
 #include "utils.h"
 #include "image.h"
 #include "processor.h"
@@ -293,6 +304,1168 @@ TEST(Test, RandomImageGeneration) {
 }
 
 
+// Histogram select must return the same values as a full sort, brightest first
+TEST(Test, HistogramSelect) {
+    unsigned int maxTopN = 12;
+    unsigned int maxPixels = 8;
+    unsigned int minX = 0, maxX = 10, minY = 0, maxY = 10, minColor = 0, maxColor = 65535;
+
+    for(unsigned int numPixels = 0; numPixels < maxPixels; ++numPixels) {
+        VectorImage<uint16_t> img(generatePixels<uint16_t>(
+            numPixels, minX, maxX, minY, maxY, minColor, maxColor));
+        ImageProcessor<uint16_t> ip(img);
+
+        for(unsigned int topN = 0; topN < maxTopN; ++topN ) {
+            std::vector<PixelCoord> topNpix = ip.processImageHistogramSelect(topN);
+            std::vector<PixelCoord> pixImg = sortImageAndGetTopN<uint16_t>(img, topN);
+            ASSERT_EQ(topNpix.size(), pixImg.size());
+            for (size_t i = 0; i < topNpix.size(); ++i) {
+                ASSERT_EQ(img.getPixelValue(topNpix[i].x, topNpix[i].y),
+                          img.getPixelValue(pixImg[i].x, pixImg[i].y));
+            }
+        }
+    }
+}
+
+// Uniform image: the cut-off is the max value, first topN pixels in scan order
+TEST(ImageProcessing, HistogramSelectUniform) {
+    std::vector<std::tuple<uint16_t, int, int>> pixels;
+    for (int y = 0; y < 3; ++y) {
+        for (int x = 0; x < 3; ++x) {
+            pixels.emplace_back(17, x, y);
+        }
+    }
+    VectorImage<uint16_t> img(pixels);
+    ImageProcessor<uint16_t> ip(img);
+
+    std::vector<PixelCoord> topNpix = ip.processImageHistogramSelect(4);
+    ASSERT_EQ(topNpix.size(), 4);
+    ASSERT_EQ(topNpix[3].x, 0);
+    ASSERT_EQ(topNpix[3].y, 1);
+}
+
+
+// Raw view kernels must agree with the virtual getPixelValue reference,
+// also for 8-bit data processed as uint16_t
+TEST(ImageProcessing, ViewKernelsMatchVirtualPath) {
+    for (int depth : {CV_8U, CV_16U}) {
+        cv::Mat mat(37, 23, depth);
+        cv::randu(mat, cv::Scalar(0), cv::Scalar(depth == CV_8U ? 256 : 65536));
+        ImageWrapper<uint16_t> img(mat);
+        ImageProcessor<uint16_t> ip(img);
+
+        for (size_t topN : {1, 10, 500, 851}) {
+            std::vector<PixelCoord> pixImg = sortImageAndGetTopN<uint16_t>(img, topN);
+            std::vector<std::vector<PixelCoord>> results = {
+                ip.processImageHeapBest(topN), ip.processImageHistogramSelect(topN),
+                ip.processImageCS(topN), ip.processImageParallelV1(topN)
+            };
+            for (auto& topNpix : results) {
+                sortPixelByValue(topNpix, img);
+                ASSERT_EQ(topNpix.size(), pixImg.size());
+                for (size_t i = 0; i < topNpix.size(); ++i) {
+                    ASSERT_EQ(img.getPixelValue(topNpix[i].x, topNpix[i].y),
+                              img.getPixelValue(pixImg[i].x, pixImg[i].y));
+                }
+            }
+        }
+    }
+}
+
+
+// Every SIMD level this CPU supports must select the same indices as scalar
+TEST(ImageProcessing, SimdFilterAboveLevels) {
+    std::mt19937 gen(42);
+    std::vector<uint8_t> row8(300);
+    std::vector<uint16_t> row16(300);
+    std::vector<float> rowF(300);
+    for (size_t i = 0; i < row8.size(); ++i) {
+        row8[i] = gen() % 256;
+        row16[i] = gen() % 65536;
+        rowF[i] = std::uniform_real_distribution<float>(-100, 100)(gen);
+    }
+
+    auto filterAll = [&](size_t n, auto threshold8, auto threshold16, float thresholdF) {
+        std::vector<std::vector<uint32_t>> out(3, std::vector<uint32_t>(n + 1));
+        out[0].resize(filterAbove(row8.data(), n, threshold8, out[0].data()));
+        out[1].resize(filterAbove(row16.data(), n, threshold16, out[1].data()));
+        out[2].resize(filterAbove(rowF.data(), n, thresholdF, out[2].data()));
+        return out;
+    };
+
+    for (int level = 0; level <= static_cast<int>(detectSimdLevel()); ++level) {
+        for (size_t n : {0, 1, 15, 16, 33, 64, 65, 129, 300}) {
+            for (int t : {0, 100, 200, 255}) {
+                uint8_t t8 = static_cast<uint8_t>(t);
+                uint16_t t16 = static_cast<uint16_t>(t == 255 ? 65535 : t * 250);
+                float tF = t - 128.0f;
+
+                setSimdLevel(SimdLevel::Scalar);
+                auto expected = filterAll(n, t8, t16, tF);
+                setSimdLevel(static_cast<SimdLevel>(level));
+                auto actual = filterAll(n, t8, t16, tF);
+                ASSERT_EQ(expected, actual) << simdLevelName(simdLevel()) << " n=" << n << " t=" << t;
+            }
+        }
+    }
+    setSimdLevel(detectSimdLevel());
+}
+
+
+// Pool runs every task exactly once, also when nested, and rethrows task errors
+TEST(ImageProcessing, ThreadPoolRunTasks) {
+    ThreadPool pool(4);
+    std::vector<std::atomic<int>> hits(100);
+    pool.run(hits.size(), [&](size_t i) {
+        hits[i]++;
+        pool.run(3, [](size_t) {});
+    });
+    for (auto& hit : hits) {
+        ASSERT_EQ(hit.load(), 1);
+    }
+
+    ASSERT_THROW(pool.run(8, [](size_t i) {
+        if (i == 5) throw std::runtime_error("task failed");
+    }), std::runtime_error);
+
+    pool.setMinGrain(100);
+    ASSERT_EQ(pool.tasksFor(50), 1);
+    ASSERT_EQ(pool.tasksFor(250), 2);
+    ASSERT_EQ(pool.tasksFor(100000), 4);
+}
+
+// Row bands on several pool threads give the same values as a full sort
+TEST(ImageProcessing, ParallelOnSharedPool) {
+    ThreadPool& pool = ThreadPool::instance();
+    size_t oldSize = pool.size();
+    size_t oldGrain = pool.getMinGrain();
+    pool.resize(5); // odd, one heap waits a level in the merge tree
+    pool.setMinGrain(1);
+
+    cv::Mat mat(61, 47, CV_16U);
+    cv::randu(mat, cv::Scalar(0), cv::Scalar(65536));
+    ImageWrapper<uint16_t> img(mat);
+    ImageProcessor<uint16_t> ip(img);
+
+    using Method = std::vector<PixelCoord> (ImageProcessor<uint16_t>::*)(size_t);
+    std::vector<Method> methods = {
+        &ImageProcessor<uint16_t>::processImageParallel,
+        &ImageProcessor<uint16_t>::processImageParallelV1,
+        &ImageProcessor<uint16_t>::processImageParallelNoTiling,
+        &ImageProcessor<uint16_t>::processImageParallelV16,
+    };
+
+    for (Method method : methods) {
+        // the same processor is reused on purpose, calls must not leak state
+        for (size_t topN : {1, 7, 300, 2867}) {
+            std::vector<PixelCoord> topNpix = (ip.*method)(topN);
+            std::vector<PixelCoord> pixImg = sortImageAndGetTopN<uint16_t>(img, topN);
+            sortPixelByValue(topNpix, img);
+            ASSERT_EQ(topNpix.size(), pixImg.size());
+            for (size_t i = 0; i < topNpix.size(); ++i) {
+                ASSERT_EQ(img.getPixelValue(topNpix[i].x, topNpix[i].y),
+                          img.getPixelValue(pixImg[i].x, pixImg[i].y));
+            }
+        }
+    }
+
+    pool.resize(oldSize);
+    pool.setMinGrain(oldGrain);
+}
+
+
+TEST(ImageProcessing, WorkStealingDequesSteal) {
+    WorkStealingDeques<size_t> deques(2);
+    for (size_t i = 0; i < 10; ++i) {
+        deques.push(0, i);
+    }
+
+    size_t item;
+    ASSERT_TRUE(deques.pop(1, item)); // worker 1 has nothing, steals the back
+    ASSERT_EQ(item, 9);
+    ASSERT_TRUE(deques.pop(0, item)); // owner keeps the front
+    ASSERT_EQ(item, 0);
+    ASSERT_EQ(deques.stealCount(), 1);
+
+    std::vector<size_t> seen = {9, 0};
+    while (deques.pop(seen.size() % 2, item)) {
+        seen.push_back(item);
+    }
+    std::sort(seen.begin(), seen.end());
+    ASSERT_EQ(seen.size(), 10);
+    for (size_t i = 0; i < seen.size(); ++i) {
+        ASSERT_EQ(seen[i], i);
+    }
+}
+
+TEST(ImageProcessing, ParallelWithTilingPartialTiles) {
+    cv::Mat mat(70, 45, CV_16U);
+    cv::randu(mat, cv::Scalar(0), cv::Scalar(65536));
+    ImageWrapper<uint16_t> img(mat);
+
+    for (size_t topN : {1, 33, 500}) {
+        ImageProcessor<uint16_t> ip(img);
+        std::vector<PixelCoord> topNpix = ip.processImageParallelWithTiling(topN, 16);
+        std::vector<PixelCoord> pixImg = sortImageAndGetTopN<uint16_t>(img, topN);
+        sortPixelByValue(topNpix, img);
+        ASSERT_EQ(topNpix.size(), pixImg.size());
+        for (size_t i = 0; i < topNpix.size(); ++i) {
+            ASSERT_EQ(img.getPixelValue(topNpix[i].x, topNpix[i].y),
+                      img.getPixelValue(pixImg[i].x, pixImg[i].y));
+        }
+    }
+}
+
+// One bright band and a dark rest full of ties: the other bands prune with
+// the bound published by the bright one, the result must not change.
+TEST(ImageProcessing, SharedBoundBrightBand) {
+    ThreadPool& pool = ThreadPool::instance();
+    size_t oldSize = pool.size();
+    size_t oldGrain = pool.getMinGrain();
+    pool.resize(4);
+    pool.setMinGrain(1);
+
+    cv::Mat mat(16, 24, CV_8U);
+    std::vector<std::tuple<uint16_t, int, int>> pixels;
+    for (int y = 0; y < mat.rows; ++y) {
+        for (int x = 0; x < mat.cols; ++x) {
+            uint8_t value = y < 2 ? 200 + x % 7 : (x + y) % 3;
+            mat.at<uint8_t>(y, x) = value;
+            pixels.push_back(std::make_tuple(value, x, y));
+        }
+    }
+    ImageWrapper<uint16_t> wrapped(mat);  // raw rows, SIMD filter
+    VectorImage vectorImg(pixels);        // virtual accessor, scalar loop
+
+    for (IImage<uint16_t>* img : std::vector<IImage<uint16_t>*>{&wrapped, &vectorImg}) {
+        ImageProcessor<uint16_t> ip(*img);
+        for (size_t topN : {5, 48, 60, 200}) {
+            std::vector<PixelCoord> pixImg = sortImageAndGetTopN<uint16_t>(*img, topN);
+            std::vector<std::vector<PixelCoord>> results = {
+                ip.processImageParallel(topN), ip.processImageParallelV1(topN),
+                ip.processImageParallelNoTiling(topN), ip.processImageParallelWithTiling(topN, 8)
+            };
+            for (auto& topNpix : results) {
+                sortPixelByValue(topNpix, *img);
+                ASSERT_EQ(topNpix.size(), pixImg.size());
+                for (size_t i = 0; i < topNpix.size(); ++i) {
+                    ASSERT_EQ(img->getPixelValue(topNpix[i].x, topNpix[i].y),
+                              img->getPixelValue(pixImg[i].x, pixImg[i].y));
+                }
+            }
+        }
+    }
+
+    pool.resize(oldSize);
+    pool.setMinGrain(oldGrain);
+}
+
+TEST(Test, PackedKeys) {
+    unsigned int maxTopN = 12;
+    unsigned int maxPixels = 8;
+    unsigned int minX = 0, maxX = 10, minY = 0, maxY = 10, minColor = 0, maxColor = 65535;
+
+    for(unsigned int numPixels = 0; numPixels < maxPixels; ++numPixels) {
+        VectorImage<uint16_t> img(generatePixels<uint16_t>(
+            numPixels, minX, maxX, minY, maxY, minColor, maxColor));
+        ImageProcessor<uint16_t> ip(img);
+
+        for(unsigned int topN = 0; topN < maxTopN; ++topN ) {
+            std::vector<PixelCoord> topNpix = ip.processImagePackedKeys(topN);
+            std::vector<PixelCoord> pixImg = sortImageAndGetTopN<uint16_t>(img, topN);
+            sortPixelByValue(topNpix, img);
+            ASSERT_EQ(topNpix.size(), pixImg.size());
+            for (size_t i = 0; i < topNpix.size(); ++i) {
+                ASSERT_EQ(img.getPixelValue(topNpix[i].x, topNpix[i].y),
+                          img.getPixelValue(pixImg[i].x, pixImg[i].y));
+            }
+        }
+    }
+}
+
+// Key order is value order, ties keep the lowest row-major index
+TEST(ImageProcessing, PackedKeysOrderAndTies) {
+    std::vector<float> floats = {-1e30f, -2.5f, -0.0f, 0.0f, 1e-30f, 3.0f, 1e30f};
+    for (size_t i = 1; i < floats.size(); ++i) {
+        ASSERT_LE(orderedBits(floats[i - 1]), orderedBits(floats[i]));
+    }
+    ASSERT_LT(orderedBits(int16_t(-3)), orderedBits(int16_t(2)));
+    ASSERT_GT(packKey(7, 0), packKey(7, 1));
+    ASSERT_GT(packKey(8, 5), packKey(7, 0));
+    ASSERT_EQ(keyIndex(packKey(3, 12345)), 12345);
+
+    cv::Mat mat(9, 7, CV_32F, cv::Scalar(-4.0f));
+    mat.at<float>(8, 6) = 2.0f;
+    mat.at<float>(4, 3) = 2.0f;
+    ImageWrapper<float> img(mat);
+    ImageProcessor<float> ip(img);
+
+    std::vector<PixelCoord> topNpix = ip.processImagePackedKeys(12);
+    std::sort(topNpix.begin(), topNpix.end(), [](const PixelCoord& a, const PixelCoord& b) {
+        return a.y * 7 + a.x < b.y * 7 + b.x;
+    });
+    ASSERT_EQ(topNpix.size(), 12);
+    for (size_t i = 0; i < 10; ++i) {
+        ASSERT_EQ(topNpix[i].y * 7 + topNpix[i].x, i);
+    }
+    ASSERT_EQ(topNpix[10].y * 7 + topNpix[10].x, 4 * 7 + 3);
+    ASSERT_EQ(topNpix[11].y * 7 + topNpix[11].x, 8 * 7 + 6);
+}
+
+// The factory picks the processor of the real depth, geometry is not cut to T
+TEST(ImageProcessing, CreateImageProcessorPerDepth) {
+    cv::Mat mat8(3, 300, CV_8U, cv::Scalar(1));
+    mat8.at<uint8_t>(2, 299) = 9;
+    AnyImage img8 = createImageWrapper(mat8);
+    ASSERT_EQ(img8.index(), 0);
+    ASSERT_EQ(std::get<0>(img8)->cols(), 300);
+
+    std::vector<PixelCoord> top8 = createImageProcessor(img8)->processImage(1);
+    ASSERT_EQ(top8.size(), 1);
+    ASSERT_EQ(top8[0].x, 299);
+    ASSERT_EQ(top8[0].y, 2);
+
+    cv::Mat matF(4, 5, CV_32F, cv::Scalar(0.25f));
+    matF.at<float>(3, 1) = 0.75f;
+    matF.at<float>(0, 4) = 0.5f;
+    AnyImage imgF = createImageWrapper(matF);
+    ASSERT_EQ(imgF.index(), 2);
+    ASSERT_EQ(std::get<2>(imgF)->getPixelValue(1, 3), 0.75f);
+
+    std::vector<PixelCoord> topF = createImageProcessor(imgF)->processImageParallel(2);
+    sortPixelByValue(topF, *std::get<2>(imgF));
+    ASSERT_EQ(topF.size(), 2);
+    ASSERT_EQ(topF[0].x, 1);
+    ASSERT_EQ(topF[0].y, 3);
+    ASSERT_EQ(topF[1].x, 4);
+    ASSERT_EQ(topF[1].y, 0);
+
+    cv::Mat mat16(2, 2, CV_16U, cv::Scalar(7));
+    ASSERT_EQ(createImageWrapper(mat16).index(), 1);
+}
+
+TEST(ImageProcessing, ResultWriters) {
+    cv::Mat mat(3, 4, CV_16U, cv::Scalar(5));
+    mat.at<uint16_t>(2, 1) = 900;
+    mat.at<uint16_t>(0, 3) = 70;
+    ImageWrapper<uint16_t> img(mat);
+    ImageProcessor<uint16_t> ip(img);
+
+    PixelValues<uint16_t> pixels = ip.processImageValues(3);
+    ASSERT_EQ(pixels.size(), 3);
+    ASSERT_EQ(pixels.value, std::vector<uint16_t>({900, 70, 5}));
+    ASSERT_EQ(pixels.x, std::vector<uint32_t>({1, 3, 0}));
+    ASSERT_EQ(pixels.y, std::vector<uint32_t>({2, 0, 0}));
+
+    std::ostringstream json;
+    JsonResultWriter jsonWriter(json);
+    ip.processImageTo(3, jsonWriter);
+    ASSERT_EQ(json.str(), "{ \"pixels\": [{\"x\": 1,\"y\": 2,\"value\": 900},"
+                          "{\"x\": 3,\"y\": 0,\"value\": 70},"
+                          "{\"x\": 0,\"y\": 0,\"value\": 5}], \"number\": 3} \n");
+
+    std::ostringstream bin;
+    BinaryResultWriter binWriter(bin);
+    ip.processImageTo(3, binWriter);
+    std::string data = bin.str();
+    ASSERT_EQ(data.size(), 16 + 3 * (4 + 4 + 2));
+    ASSERT_EQ(data.substr(0, 4), "TOPN");
+    ASSERT_EQ(data[5], 2);
+    uint64_t count;
+    std::memcpy(&count, data.data() + 8, sizeof(count));
+    ASSERT_EQ(count, 3);
+    uint16_t values[3];
+    std::memcpy(values, data.data() + 16 + 3 * 8, sizeof(values));
+    ASSERT_EQ(values[0], 900);
+    ASSERT_EQ(values[2], 5);
+
+    // a captured selection, written later, in the same order
+    CapturedResult captured;
+    ip.processImageTo(3, captured);
+    std::ostringstream written;
+    JsonResultWriter writtenWriter(written);
+    captured.writeTo(writtenWriter);
+    ASSERT_EQ(written.str(), json.str());
+
+    // float values keep their fraction
+    cv::Mat matF(1, 2, CV_32F, cv::Scalar(-1.5f));
+    matF.at<float>(0, 1) = 0.25f;
+    ImageWrapper<float> imgF(matF);
+    ImageProcessor<float> ipF(imgF);
+    std::ostringstream jsonF;
+    JsonResultWriter jsonWriterF(jsonF);
+    ipF.processImageTo(2, jsonWriterF);
+    ASSERT_EQ(jsonF.str(), "{ \"pixels\": [{\"x\": 1,\"y\": 0,\"value\": 0.25},"
+                           "{\"x\": 0,\"y\": 0,\"value\": -1.5}], \"number\": 2} \n");
+}
+
+TEST(ImageProcessing, MappedImageReader) {
+    std::string dir = testing::TempDir();
+    auto writeFile = [](const std::string& path, const std::string& bytes) {
+        std::ofstream(path, std::ios::binary).write(bytes.data(), bytes.size());
+    };
+
+    // 16-bit PGM: big-endian samples after an odd-length header
+    std::string pgm16 = "P5\n# sensor dump\n3 2\n65535\n";
+    for (uint16_t v : {1, 2, 300, 4, 65535, 6}) {
+        pgm16 += char(v >> 8);
+        pgm16 += char(v & 0xFF);
+    }
+    writeFile(dir + "mapped16.pgm", pgm16);
+
+    auto reader = ImageReaderFactory::createImageReader(dir + "mapped16.pgm");
+    ASSERT_NE(dynamic_cast<MappedImageReader*>(reader.get()), nullptr);
+    AnyImage img16 = reader->readImageAnyDepth(dir + "mapped16.pgm");
+    ASSERT_EQ(img16.index(), 1);
+    auto& pixels16 = *std::get<1>(img16);
+    ASSERT_EQ(pixels16.cols(), 3);
+    ASSERT_EQ(pixels16.rows(), 2);
+    ASSERT_EQ(pixels16.getPixelValue(2, 0), 300);
+    ASSERT_EQ(pixels16.getPixelValue(1, 1), 65535);
+
+    std::vector<PixelCoord> top = createImageProcessor(img16)->processImage(1);
+    ASSERT_EQ(top[0].x, 1);
+    ASSERT_EQ(top[0].y, 1);
+
+    // the mapping is read as stored: big-endian, unaligned, bytes untouched
+    ImageView v16 = pixels16.view();
+    ASSERT_TRUE(v16.encoded());
+    size_t header = pgm16.size() - 12;
+    ASSERT_EQ(std::memcmp(v16.data, pgm16.data() + header, 12), 0);
+    ImageProcessor<uint16_t> encoded(std::get<1>(img16));
+    ASSERT_EQ(encoded.processImageParallelV1(1)[0].x, 1);
+    ASSERT_EQ(encoded.processImageCS(2)[1].x, 2);
+
+    // 8-bit PGM keeps its depth
+    writeFile(dir + "mapped8.pgm", std::string("P5 2 2 255\n") + char(9) + char(200) + char(7) + char(1));
+    AnyImage img8 = MappedImageReader().readImageAnyDepth(dir + "mapped8.pgm");
+    ASSERT_EQ(img8.index(), 0);
+    ASSERT_EQ(std::get<0>(img8)->getPixelValue(1, 0), 200);
+
+    // FITS, unsigned 16-bit stored as signed with BZERO = 32768
+    auto card = [](const std::string& text) { return text + std::string(80 - text.size(), ' '); };
+    std::string fits = card("SIMPLE  =                    T") + card("BITPIX  =                   16")
+                     + card("NAXIS   =                    2") + card("NAXIS1  =                    2")
+                     + card("NAXIS2  =                    1") + card("BZERO   =                32768")
+                     + card("END");
+    fits += std::string(2880 - fits.size(), ' ');
+    for (uint16_t v : {40000, 12}) {
+        uint16_t stored = v ^ 0x8000;
+        fits += char(stored >> 8);
+        fits += char(stored & 0xFF);
+    }
+    writeFile(dir + "mapped.fits", fits);
+    AnyImage imgFits = ImageReaderFactory::createImageReader(dir + "mapped.fits")->readImageAnyDepth(dir + "mapped.fits");
+    ASSERT_EQ(std::get<1>(imgFits)->getPixelValue(0, 0), 40000);
+    ASSERT_EQ(std::get<1>(imgFits)->getPixelValue(1, 0), 12);
+
+    // headerless raw in host order
+    std::vector<uint16_t> raw = {5, 6, 7, 8, 9, 10};
+    writeFile(dir + "mapped.raw", std::string(reinterpret_cast<const char*>(raw.data()), raw.size() * 2));
+    RawGeometry geometry;
+    geometry.rows = 3;
+    geometry.cols = 2;
+    std::unique_ptr<IImage<uint16_t>> imgRaw = MappedImageReader(geometry).readImage(dir + "mapped.raw");
+    ASSERT_EQ(imgRaw->getPixelValue(1, 2), 10);
+    auto fallback = ImageReaderFactory::createImageReader(dir + "mapped.raw");
+    ASSERT_NE(dynamic_cast<OpenCVImageReader*>(fallback.get()), nullptr);
+
+    geometry.rows = 4; // larger than the file
+    ASSERT_THROW(MappedImageReader(geometry).readImage(dir + "mapped.raw"), std::runtime_error);
+    geometry.rows = size_t(1) << 32; // rows * cols * 2 wraps to 0
+    geometry.cols = size_t(1) << 31;
+    ASSERT_THROW(MappedImageReader(geometry).readImage(dir + "mapped.raw"), std::runtime_error);
+
+    // header numbers beyond the int range of cv::Mat, or that overflow
+    writeFile(dir + "huge.pgm", "P5 4294967296 2147483648 65535\n" + std::string(8, char(1)));
+    ASSERT_THROW(MappedImageReader().readImage(dir + "huge.pgm"), std::runtime_error);
+    writeFile(dir + "overflow.pgm", "P5 1 99999999999999999999999 255\n" + std::string(8, char(1)));
+    ASSERT_THROW(MappedImageReader().readImage(dir + "overflow.pgm"), std::runtime_error);
+    std::string hugeFits = fits;
+    hugeFits.replace(3 * 80, 80, card("NAXIS1  =           4294967298"));
+    writeFile(dir + "huge.fits", hugeFits);
+    ASSERT_THROW(MappedImageReader().readImage(dir + "huge.fits"), std::runtime_error);
+}
+
+// Gray PNG of mat (CV_8U or CV_16U) through libpng
+static void writeGrayPng(const std::string& path, const cv::Mat& mat) {
+    FILE* file = std::fopen(path.c_str(), "wb");
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png_create_info_struct(png);
+    png_init_io(png, file);
+    int bitDepth = mat.depth() == CV_16U ? 16 : 8;
+    png_set_IHDR(png, info, mat.cols, mat.rows, bitDepth, PNG_COLOR_TYPE_GRAY,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    if (bitDepth == 16) {
+        png_set_swap(png);
+    }
+    for (int y = 0; y < mat.rows; ++y) {
+        png_write_row(png, const_cast<png_bytep>(mat.ptr(y)));
+    }
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+    std::fclose(file);
+}
+
+TEST(ImageProcessing, PngStreamingSelect) {
+    ThreadPool& pool = ThreadPool::instance();
+    size_t oldSize = pool.size();
+    pool.resize(2);
+
+    for (int depth : {CV_8U, CV_16U}) {
+        cv::Mat mat(23, 17, depth);
+        cv::randu(mat, cv::Scalar(0), cv::Scalar(depth == CV_8U ? 256 : 65536));
+        std::string path = testing::TempDir() + "stream.png";
+        writeGrayPng(path, mat);
+
+        PngBandReader reader(path);
+        ASSERT_EQ(reader.rows(), 23);
+        ASSERT_EQ(reader.cols(), 17);
+        ASSERT_EQ(reader.depth(), depth);
+        ASSERT_TRUE(PngBandReader::isPng(path));
+
+        ImageWrapper<uint16_t> img(mat);
+        ImageProcessor<uint16_t> ip(img);
+        for (size_t topN : {1, 40, 391}) {
+            PixelValues<uint16_t> expected = ip.processImageValues(topN);
+            PixelValues<uint16_t> streamed = selectTopNFromPng<uint16_t>(path, topN, 3);
+            ASSERT_EQ(streamed.x, expected.x);
+            ASSERT_EQ(streamed.y, expected.y);
+            ASSERT_EQ(streamed.value, expected.value);
+        }
+    }
+
+    pool.resize(oldSize);
+}
+
+TEST(ImageProcessing, PngStreamingColorWeights) {
+    // 8-bit RGB: pure primaries, where the Rec.601 and Rec.709 weights differ
+    // most, then random colors
+    cv::Mat rgb(9, 11, CV_8UC3);
+    cv::randu(rgb, cv::Scalar(0), cv::Scalar(256));
+    const uint8_t primaries[3][3] = {{255, 0, 0}, {0, 255, 0}, {0, 0, 255}};
+    for (int i = 0; i < 3; ++i) {
+        std::memcpy(rgb.ptr(0) + 3 * i, primaries[i], 3);
+    }
+    std::string path = testing::TempDir() + "color.png";
+    FILE* file = std::fopen(path.c_str(), "wb");
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    png_infop info = png_create_info_struct(png);
+    png_init_io(png, file);
+    png_set_IHDR(png, info, rgb.cols, rgb.rows, 8, PNG_COLOR_TYPE_RGB,
+                 PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    png_write_info(png, info);
+    for (int y = 0; y < rgb.rows; ++y) {
+        png_write_row(png, rgb.ptr(y));
+    }
+    png_write_end(png, nullptr);
+    png_destroy_write_struct(&png, &info);
+    std::fclose(file);
+
+    AnyImage decoded = OpenCVImageReader().readImageAnyDepth(path);
+    const IImage<uint8_t>& gray = *std::get<0>(decoded);
+
+    PngBandReader reader(path);
+    ASSERT_EQ(reader.depth(), CV_8U);
+    std::vector<uint8_t> buffer;
+    ImageView band = reader.readBand(buffer, reader.rows());
+    ASSERT_EQ(band.rows, gray.rows());
+    for (size_t y = 0; y < band.rows; ++y) {
+        for (size_t x = 0; x < band.cols; ++x) {
+            // both round their fixed point sums, allow one step
+            ASSERT_NEAR(band.row<uint8_t>(y)[x], gray.getPixelValue(x, y), 1) << x << "," << y;
+        }
+    }
+}
+
+TEST(ImageProcessing, BoundedQueue) {
+    BoundedQueue<int> queue(2);
+    std::thread producer([&] {
+        for (int i = 0; i < 100; ++i) {
+            ASSERT_TRUE(queue.push(i));
+        }
+        queue.close();
+    });
+    int item = -1;
+    for (int i = 0; i < 100; ++i) {
+        ASSERT_TRUE(queue.pop(item));
+        ASSERT_EQ(item, i);
+    }
+    ASSERT_FALSE(queue.pop(item)); // closed and drained
+    producer.join();
+    ASSERT_FALSE(queue.push(1));
+}
+
+TEST(ImageProcessing, BatchPipeline) {
+    std::string dir = testing::TempDir() + "batch_in/";
+    std::string outDir = testing::TempDir() + "batch_out/";
+    std::filesystem::remove_all(dir);
+    std::filesystem::remove_all(outDir);
+    std::filesystem::create_directories(dir);
+    std::filesystem::create_directories(outDir);
+
+    // 8-bit PGMs, the brightest pixel of frame i is at (i % 4, 1)
+    for (int i = 0; i < 12; ++i) {
+        std::string pixels(8, char(i));
+        pixels[4 + i % 4] = char(100 + i);
+        std::ofstream(dir + "frame" + std::to_string(10 + i) + ".pgm", std::ios::binary)
+            << "P5 4 2 255\n" << pixels;
+    }
+    std::ofstream(dir + "broken.pgm", std::ios::binary) << "P5 4 2 255\n"; // truncated
+
+    std::vector<std::string> inputs = listBatchInputs(dir);
+    ASSERT_EQ(inputs.size(), 13);
+    ASSERT_EQ(std::filesystem::path(inputs[0]).filename(), "broken.pgm");
+
+    BatchOptions options;
+    options.topN = 1;
+    options.outputDir = outDir;
+    options.readerThreads = 2;
+    options.computeThreads = 3;
+    options.queueCapacity = 2;
+    BatchStats stats = runBatch(inputs, options);
+    ASSERT_EQ(stats.processed, 12);
+    ASSERT_EQ(stats.failed, 1);
+
+    for (int i = 0; i < 12; ++i) {
+        std::ifstream result(outDir + "frame" + std::to_string(10 + i) + ".pgm.json");
+        std::string json((std::istreambuf_iterator<char>(result)), std::istreambuf_iterator<char>());
+        ASSERT_EQ(json, "{ \"pixels\": [{\"x\": " + std::to_string(i % 4) + ",\"y\": 1,\"value\": "
+                        + std::to_string(100 + i) + "}], \"number\": 1} \n");
+    }
+
+    // list file, binary output
+    std::ofstream(dir + "list.txt") << inputs[1] << "\n" << inputs[2] << "\n";
+    options.binary = true;
+    stats = runBatch(listBatchInputs(dir + "list.txt"), options);
+    ASSERT_EQ(stats.processed, 2);
+    ASSERT_TRUE(std::filesystem::exists(outDir + std::filesystem::path(inputs[1]).filename().string() + ".bin"));
+
+    // two inputs of the same name would write the same result: refused
+    std::string twin = dir + "other/" + std::filesystem::path(inputs[1]).filename().string();
+    std::filesystem::create_directories(dir + "other/");
+    std::filesystem::copy_file(inputs[1], twin);
+    std::ofstream(dir + "clash.txt") << inputs[1] << "\n" << twin << "\n";
+    ASSERT_THROW(runBatch(listBatchInputs(dir + "clash.txt"), options), std::runtime_error);
+}
+
+TEST(ImageProcessing, ServerRequests) {
+    std::string socketPath = testing::TempDir() + "topn_test.sock";
+    TopNServer server(socketPath, 0, 64); // raw requests up to 64 bytes of pixels
+    std::thread serverThread([&] { server.run(); });
+
+    cv::Mat mat(3, 4, CV_16U, cv::Scalar(5));
+    mat.at<uint16_t>(2, 1) = 900;
+    mat.at<uint16_t>(0, 3) = 70;
+    std::string expected = "{ \"pixels\": [{\"x\": 1,\"y\": 2,\"value\": 900},"
+                           "{\"x\": 3,\"y\": 0,\"value\": 70}], \"number\": 2} \n";
+    std::string pgm = "P5 4 3 65535\n";
+    for (int y = 0; y < 3; ++y) {
+        for (int x = 0; x < 4; ++x) {
+            pgm += char(mat.at<uint16_t>(y, x) >> 8);
+            pgm += char(mat.at<uint16_t>(y, x) & 0xFF);
+        }
+    }
+    std::string imagePath = testing::TempDir() + "served.pgm";
+    std::ofstream(imagePath, std::ios::binary) << pgm;
+
+    {
+        TopNClient client(socketPath);
+        ASSERT_EQ(client.queryBuffer(mat, 2), expected);
+        ASSERT_EQ(client.queryPath(imagePath, 2), expected);
+
+        // errors leave the connection usable
+        ASSERT_THROW(client.queryPath(testing::TempDir() + "missing.pgm", 2), std::runtime_error);
+        std::string bin = client.queryPath(imagePath, 2, true);
+        ASSERT_EQ(bin.size(), 16 + 2 * (4 + 4 + 2));
+        ASSERT_EQ(bin.substr(0, 4), "TOPN");
+        ASSERT_NE(client.queryMetrics().find("topn_stage_seconds_total{stage=\"scan\"}"), std::string::npos);
+    }
+    {
+        // a raw image over the limit is refused, and the connection closed:
+        // its pixels are not read
+        TopNClient client(socketPath);
+        cv::Mat large(8, 8, CV_16U, cv::Scalar(1)); // 128 bytes
+        ASSERT_THROW(client.queryBuffer(large, 2), std::runtime_error);
+        ASSERT_THROW(client.queryPath(imagePath, 2), std::runtime_error);
+    }
+
+    // concurrent clients
+    std::vector<std::thread> clients;
+    std::atomic<int> matches{0};
+    for (int c = 0; c < 4; ++c) {
+        clients.emplace_back([&] {
+            TopNClient client(socketPath);
+            for (int i = 0; i < 5; ++i) {
+                matches += client.queryBuffer(mat, 2) == expected;
+            }
+        });
+    }
+    for (auto& client : clients) {
+        client.join();
+    }
+    ASSERT_EQ(matches, 20);
+
+    TopNClient idle(socketPath); // open connection at shutdown
+    server.stop();
+    serverThread.join();
+    ASSERT_EQ(server.requestsServed(), 24);
+}
+
+TEST(ImageProcessing, CachingImageReader) {
+    std::string dir = testing::TempDir();
+    auto writePgm = [&](const std::string& name, char fill) {
+        std::ofstream(dir + name, std::ios::binary) << "P5 10 10 255\n" << std::string(100, fill);
+    };
+    writePgm("cacheA.pgm", 1);
+    writePgm("cacheB.pgm", 2);
+    writePgm("cacheC.pgm", 3);
+
+    size_t decodes = 0;
+    CachingImageReader cache(250, [&](const std::string& path) {
+        ++decodes;
+        return ImageReaderFactory::createImageReader(path);
+    });
+
+    AnyImage a1 = cache.readImageAnyDepth(dir + "cacheA.pgm");
+    AnyImage a2 = cache.readImageAnyDepth(dir + "cacheA.pgm");
+    ASSERT_EQ(decodes, 1);
+    ASSERT_NE(std::get<0>(a1), std::get<0>(a2)); // own image objects ...
+    ASSERT_EQ(std::get<0>(a1)->view().data, std::get<0>(a2)->view().data); // ... same pixels
+    ASSERT_EQ(std::get<0>(a2)->getPixelValue(9, 9), 1);
+
+    // the tile summary lives with the cached frame: the processor of a hit
+    // reuses the one built for the first read
+    auto summary = ImageProcessor<uint8_t>(std::get<0>(a1)).tileSummary(4);
+    ASSERT_EQ(ImageProcessor<uint8_t>(std::get<0>(a2)).tileSummary(4), summary);
+
+    cache.readImageAnyDepth(dir + "cacheB.pgm");
+    cache.readImageAnyDepth(dir + "cacheA.pgm"); // A most recent
+    cache.readImageAnyDepth(dir + "cacheC.pgm"); // evicts B
+    ImageCacheStats stats = cache.stats();
+    ASSERT_EQ(stats.hits, 2);
+    ASSERT_EQ(stats.misses, 3);
+    ASSERT_EQ(stats.evictions, 1);
+    ASSERT_EQ(stats.entries, 2);
+    ASSERT_EQ(stats.bytes, 200);
+    cache.readImageAnyDepth(dir + "cacheA.pgm");
+    ASSERT_EQ(decodes, 3);
+
+    // replaced file, other size: decoded again (replaced, not rewritten in
+    // place, the cached pixels of a PGM are a mapping of the old file)
+    std::ofstream(dir + "cacheA.tmp", std::ios::binary) << "P5 5 5 255\n" << std::string(25, 7);
+    std::filesystem::rename(dir + "cacheA.tmp", dir + "cacheA.pgm");
+    AnyImage a3 = cache.readImageAnyDepth(dir + "cacheA.pgm");
+    ASSERT_EQ(decodes, 4);
+    ASSERT_EQ(std::get<0>(a3)->getPixelValue(4, 4), 7);
+    ASSERT_EQ(std::get<0>(a1)->getPixelValue(9, 9), 1); // earlier images stay valid
+
+    // 16-bit reads are cached apart from native depth reads
+    std::unique_ptr<IImage<uint16_t>> c16 = cache.readImage(dir + "cacheC.pgm");
+    ASSERT_EQ(c16->getPixelValue(0, 0), 3);
+    ASSERT_EQ(decodes, 5);
+    ASSERT_THROW(cache.readImageAnyDepth(dir + "cacheMissing.pgm"), std::runtime_error);
+}
+
+TEST(ImageProcessing, ProcessImageMulti) {
+    cv::Mat mat(40, 30, CV_16U);
+    cv::randu(mat, cv::Scalar(0), cv::Scalar(50)); // many ties
+    ImageWrapper<uint16_t> img(mat);
+    ImageProcessor<uint16_t> ip(img);
+
+    std::vector<size_t> topNs = {100, 0, 1, 1200, 5000, 37};
+    std::vector<std::vector<PixelCoord>> results = ip.processImageMulti(topNs);
+    ASSERT_EQ(results.size(), topNs.size());
+    for (size_t i = 0; i < topNs.size(); ++i) {
+        size_t n = std::min<size_t>(topNs[i], 1200);
+        ASSERT_EQ(results[i].size(), n);
+        PixelValues<uint16_t> single = ip.processImageValues(n);
+        for (size_t k = 0; k < n; ++k) {
+            ASSERT_EQ(results[i][k].x, single.x[k]);
+            ASSERT_EQ(results[i][k].y, single.y[k]);
+        }
+    }
+
+    // float values: every answer is a valid top N and a prefix of the largest
+    cv::Mat matF(20, 20, CV_32F);
+    cv::randu(matF, cv::Scalar(-1), cv::Scalar(1));
+    AnyImage anyF = createImageWrapper(matF);
+    auto ipF = createImageProcessor(anyF);
+    auto resultsF = ipF->processImageMulti({400, 10, 150});
+    for (size_t n : {10, 150}) {
+        auto& prefix = n == 10 ? resultsF[1] : resultsF[2];
+        ASSERT_EQ(prefix.size(), n);
+        for (size_t k = 0; k < n; ++k) {
+            ASSERT_EQ(prefix[k].x, resultsF[0][k].x);
+            ASSERT_EQ(prefix[k].y, resultsF[0][k].y);
+        }
+        std::vector<float> all(matF.ptr<float>(0), matF.ptr<float>(0) + matF.total());
+        std::sort(all.begin(), all.end(), std::greater<float>());
+        ASSERT_EQ(matF.at<float>(prefix.back().y, prefix.back().x), all[n - 1]);
+    }
+    ASSERT_TRUE(ip.processImageMulti({}).empty());
+}
+
+// Star field: a dark frame with a few bright spots, and the counts of the
+// summary give the floor.
+TEST(ImageProcessing, TileSummaryStarField) {
+    ThreadPool& pool = ThreadPool::instance();
+    size_t oldSize = pool.size();
+    size_t oldGrain = pool.getMinGrain();
+    pool.resize(4);
+    pool.setMinGrain(1);
+
+    cv::Mat mat(150, 200, CV_16U);
+    cv::randu(mat, cv::Scalar(0), cv::Scalar(40));
+    std::mt19937 gen(7);
+    for (int star = 0; star < 30; ++star) {
+        int x = gen() % mat.cols, y = gen() % mat.rows;
+        mat.at<uint16_t>(y, x) = 1000 + gen() % 20; // ties between stars too
+    }
+    ImageWrapper<uint16_t> img(mat);
+    ImageProcessor<uint16_t> ip(img);
+
+    auto summary = ip.tileSummary(64);
+    ASSERT_EQ(summary->tilesX, 4);
+    ASSERT_EQ(summary->tilesY, 3);
+    ASSERT_EQ(summary->order.size(), 12);
+    for (size_t i = 1; i < summary->order.size(); ++i) {
+        ASSERT_GE(summary->max[summary->order[i - 1]], summary->max[summary->order[i]]);
+    }
+    ASSERT_EQ(ip.tileSummary(64), summary); // cached
+    ASSERT_GE(summary->floorFor(1), 1000);
+
+    for (size_t topN : {1, 10, 30, 31, 400, 30000}) {
+        std::vector<PixelCoord> topNpix = ip.processImageTileSummary(topN);
+        std::vector<PixelCoord> pixImg = sortImageAndGetTopN<uint16_t>(img, topN);
+        sortPixelByValue(topNpix, img);
+        ASSERT_EQ(topNpix.size(), pixImg.size());
+        for (size_t i = 0; i < topNpix.size(); ++i) {
+            ASSERT_EQ(img.getPixelValue(topNpix[i].x, topNpix[i].y),
+                      img.getPixelValue(pixImg[i].x, pixImg[i].y));
+        }
+    }
+
+    // uniform frame: one tile reaches topN, all ties
+    cv::Mat flat(50, 50, CV_8U, cv::Scalar(9));
+    ImageWrapper<uint8_t> flatImg(flat);
+    ImageProcessor<uint8_t> flatIp(flatImg);
+    ASSERT_EQ(flatIp.tileSummary(16)->floorFor(100), 9);
+    ASSERT_EQ(flatIp.processImageTileSummary(100).size(), 100);
+
+    pool.resize(oldSize);
+    pool.setMinGrain(oldGrain);
+}
+
+TEST(ImageProcessing, StrategySelector) {
+    cv::Mat mat(60, 50, CV_16U);
+    cv::randu(mat, cv::Scalar(0), cv::Scalar(300));
+    ImageWrapper<uint16_t> img(mat);
+    ImageProcessor<uint16_t> ip(img);
+
+    // every strategy gives a correct top N
+    for (size_t s = 0; s < STRATEGY_COUNT; ++s) {
+        for (size_t topN : {1, 77, 1500}) {
+            std::vector<PixelCoord> topNpix = ip.runStrategy(static_cast<Strategy>(s), topN);
+            std::vector<PixelCoord> pixImg = sortImageAndGetTopN<uint16_t>(img, topN);
+            sortPixelByValue(topNpix, img);
+            ASSERT_EQ(topNpix.size(), pixImg.size()) << strategyName(static_cast<Strategy>(s));
+            for (size_t i = 0; i < topNpix.size(); ++i) {
+                ASSERT_EQ(img.getPixelValue(topNpix[i].x, topNpix[i].y),
+                          img.getPixelValue(pixImg[i].x, pixImg[i].y));
+            }
+        }
+    }
+
+    ImageFeatures features = ip.imageFeatures(30);
+    ASSERT_EQ(features.pixels(), 3000);
+    ASSERT_EQ(features.tasks, ThreadPool::instance().tasksFor(3000));
+    ASSERT_DOUBLE_EQ(features.topNRatio, 0.01);
+    ASSERT_LT(features.dominantShare, 0.2); // spread values
+    cv::Mat flat(10, 10, CV_8U, cv::Scalar(4));
+    ImageWrapper<uint8_t> flatImg(flat);
+    ASSERT_DOUBLE_EQ(ImageProcessor<uint8_t>(flatImg).imageFeatures(5).dominantShare, 1.0);
+
+    // compiled tree: small images to the heap, large ones by topN ratio
+    constexpr StrategyTreeNode tree[] = {
+        {TREE_PIXELS, 10000, 1, 2, Strategy::ParallelV1},
+        {TREE_LEAF, 0, 0, 0, Strategy::HeapBest},
+        {TREE_TOPN_RATIO, 0.25, 3, 4, Strategy::ParallelV1},
+        {TREE_LEAF, 0, 0, 0, Strategy::ParallelV512},
+        {TREE_LEAF, 0, 0, 0, Strategy::CountingSort},
+    };
+    static_assert(evaluateStrategyTree(tree, 5000, 0.9) == Strategy::HeapBest, "evaluated at compile time");
+    ASSERT_EQ(evaluateStrategyTree(tree, 1e6, 0.01), Strategy::ParallelV512);
+    ASSERT_EQ(evaluateStrategyTree(tree, 1e6, 0.5), Strategy::CountingSort);
+    ASSERT_EQ(evaluateStrategyTree(tree, 10000, 0.5), Strategy::HeapBest); // <= goes left
+
+    // cheapest applicable strategy, no counting sort on float values
+    StrategySelector selector;
+    ASSERT_EQ(selector.choose(features), Strategy::ParallelV1);
+    for (size_t s = 0; s < STRATEGY_COUNT; ++s) {
+        StrategyCost cost;
+        cost.overhead = 100;
+        selector.setCost(static_cast<Strategy>(s), cost);
+    }
+    StrategyCost cheap;
+    cheap.perPixel = 0.001;
+    selector.setCost(Strategy::CountingSort, cheap);
+    ASSERT_EQ(selector.choose(features), Strategy::CountingSort);
+    features.integralValues = false;
+    ASSERT_EQ(selector.choose(features), Strategy::ParallelV1);
+
+    // persisted for the pool size it was measured with
+    std::string path = testing::TempDir() + "strategy_costs.txt";
+    selector.save(path);
+    StrategySelector reloaded;
+    ASSERT_TRUE(reloaded.load(path));
+    ASSERT_DOUBLE_EQ(reloaded.cost(Strategy::CountingSort).perPixel, 0.001);
+    ThreadPool& pool = ThreadPool::instance();
+    size_t oldSize = pool.size();
+    pool.resize(oldSize + 1);
+    ASSERT_FALSE(StrategySelector().load(path));
+    pool.resize(oldSize);
+
+    // the calibration fit recovers known coefficients from exact timings ...
+    StrategyCost known;
+    known.overhead = 40;
+    known.perPixel = 0.002;
+    known.perTaskPixel = 0.008;
+    known.perHeapOp = 0.03;
+    known.perDominantPixel = 0.001;
+    std::vector<ImageFeatures> samples;
+    std::vector<double> micros;
+    for (size_t size : {256, 512, 1024}) {
+        for (size_t tasks : {1, 3, 8}) {
+            for (double share : {0.02, 0.5, 1.0}) {
+                for (double ratio : {0.001, 0.1}) {
+                    ImageFeatures f;
+                    f.rows = f.cols = size;
+                    f.tasks = tasks;
+                    f.topN = static_cast<size_t>(ratio * size * size);
+                    f.dominantShare = share;
+                    samples.push_back(f);
+                    micros.push_back(known.predict(f));
+                }
+            }
+        }
+    }
+    StrategyCost fitted = StrategyCost::fit(samples, micros);
+    ASSERT_NEAR(fitted.overhead, known.overhead, 1e-3 * known.overhead);
+    ASSERT_NEAR(fitted.perPixel, known.perPixel, 1e-3 * known.perPixel);
+    ASSERT_NEAR(fitted.perTaskPixel, known.perTaskPixel, 1e-3 * known.perTaskPixel);
+    ASSERT_NEAR(fitted.perHeapOp, known.perHeapOp, 1e-3 * known.perHeapOp);
+    ASSERT_NEAR(fitted.perDominantPixel, known.perDominantPixel, 1e-3 * known.perDominantPixel);
+    // ... and pins a term that would come out negative to 0
+    for (size_t i = 0; i < samples.size(); ++i) {
+        micros[i] = 500 + (0.004 - 0.001 * samples[i].dominantShare) * samples[i].pixels();
+    }
+    fitted = StrategyCost::fit(samples, micros);
+    ASSERT_EQ(fitted.perDominantPixel, 0);
+    ASSERT_GT(fitted.perPixel, 0);
+
+    // a model drives processImage
+    StrategySelector& global = StrategySelector::instance();
+    global.setCost(Strategy::TileSummary, cheap);
+    std::vector<PixelCoord> topNpix = ip.processImage(40);
+    global.reset();
+    std::vector<PixelCoord> pixImg = sortImageAndGetTopN<uint16_t>(img, 40);
+    sortPixelByValue(topNpix, img);
+    ASSERT_EQ(img.getPixelValue(topNpix.back().x, topNpix.back().y),
+              img.getPixelValue(pixImg.back().x, pixImg.back().y));
+
+    // no model loaded: the compiled tree decides
+    Strategy treeChoice = evaluateStrategyTree(STRATEGY_TREE, 3000.0, 40 / 3000.0);
+    std::vector<PixelCoord> dispatched = ip.processImage(40);
+    std::vector<PixelCoord> fromTree = ip.runStrategy(treeChoice, 40);
+    ASSERT_TRUE(comparePixelCoord(dispatched, fromTree));
+}
+
+TEST(ImageProcessing, MetricsExport) {
+    Metrics& metrics = Metrics::instance();
+    metrics.reset();
+    metrics.recordStage(Stage::Decode, 2000000);
+    metrics.recordStage(Stage::Decode, 1000000);
+    metrics.recordLockWait(500);
+
+    std::string text = metrics.prometheus();
+    ASSERT_NE(text.find("topn_stage_seconds_total{stage=\"decode\"} 0.003\n"), std::string::npos);
+    ASSERT_NE(text.find("topn_stage_runs_total{stage=\"decode\"} 2\n"), std::string::npos);
+    ASSERT_NE(text.find("topn_stage_max_seconds{stage=\"decode\"} 0.002\n"), std::string::npos);
+    ASSERT_NE(text.find("topn_lock_acquisitions_total 1\n"), std::string::npos);
+    ASSERT_NE(metrics.json().find("\"decode\": {\"runs\": 2, \"seconds\": 0.003"), std::string::npos);
+
+    // the hot path records only in a TOPN_METRICS build
+    cv::Mat mat(60, 50, CV_16U);
+    cv::randu(mat, cv::Scalar(0), cv::Scalar(300));
+    ImageWrapper<uint16_t> img(mat);
+    ImageProcessor<uint16_t> ip(img);
+    metrics.reset();
+    ip.processImageParallel(10);
+    ASSERT_EQ(metrics.prometheus().find("topn_stage_runs_total{stage=\"merge\"} 1\n") != std::string::npos,
+              Metrics::enabled());
+    metrics.reset();
+    ip.processImageParallelWithTiling(10, 16); // pops its tiles under the deque locks
+    ASSERT_EQ(metrics.prometheus().find("topn_lock_acquisitions_total 0\n") == std::string::npos,
+              Metrics::enabled());
+    metrics.reset();
+}
+
+TEST(ImageProcessing, TraceTimeline) {
+    ThreadPool& pool = ThreadPool::instance();
+    size_t oldSize = pool.size();
+    size_t oldGrain = pool.getMinGrain();
+    pool.resize(4);
+    pool.setMinGrain(64);
+
+    cv::Mat mat(64, 64, CV_16U);
+    cv::randu(mat, cv::Scalar(0), cv::Scalar(60000));
+    ImageWrapper<uint16_t> img(mat);
+    ImageProcessor<uint16_t> ip(img);
+
+    TraceRecorder& trace = TraceRecorder::instance();
+    ip.processImageParallelWithTiling(10, 16); // not recording: no events
+    trace.start();
+    ASSERT_EQ(trace.eventCount(), 0);
+    ip.processImageParallelWithTiling(10, 16);
+
+    // a contended lock shows as a wait
+    std::mutex mutex;
+    std::unique_lock<std::mutex> held(mutex);
+    std::thread waiter([&] { auto lock = tracedLock(mutex, "testMutex"); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    held.unlock();
+    waiter.join();
+
+    // the caller of run() done before a helper waits for it
+    std::thread::id caller = std::this_thread::get_id();
+    std::atomic<int> started{0};
+    pool.run(2, [&](size_t) {
+        ++started;
+        while (started < 2) {
+            std::this_thread::yield();
+        }
+        if (std::this_thread::get_id() != caller) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+    });
+    trace.stop();
+
+    std::string json = trace.json();
+    ASSERT_EQ(json.rfind("{\"displayTimeUnit\": \"ms\", \"traceEvents\": [", 0), 0);
+    size_t tiles = 0;
+    for (size_t at = json.find("\"name\": \"tile\""); at != std::string::npos;
+         at = json.find("\"name\": \"tile\"", at + 1)) {
+        ++tiles;
+    }
+    ASSERT_EQ(tiles, 16);
+    ASSERT_NE(json.find("\"name\": \"mergeLocalHeaps\""), std::string::npos);
+    ASSERT_NE(json.find("\"name\": \"testMutex\", \"cat\": \"lock wait\""), std::string::npos);
+    ASSERT_NE(json.find("\"name\": \"ThreadPool::run\", \"cat\": \"lock wait\""), std::string::npos);
+    ASSERT_NE(json.find("\"ph\": \"M\""), std::string::npos);
+    ASSERT_EQ(trace.droppedCount(), 0);
+
+    pool.resize(oldSize);
+    pool.setMinGrain(oldGrain);
+}
+
+TEST(ImageProcessing, AllocationScope) {
+    size_t live = AllocationTracker::liveBytes();
+    AllocationScope scope;
+    AllocationTracker::allocated(1000);
+    AllocationTracker::allocated(500);
+    AllocationTracker::freed(1000);
+    AllocationTracker::allocated(200);
+
+    AllocationStats stats = scope.stats();
+    ASSERT_EQ(stats.peakBytes, 1500);   // not 1700: the first block was freed
+    ASSERT_EQ(stats.totalBytes, 1700);
+    ASSERT_EQ(stats.allocations, 3);
+
+    // a new scope starts from the live bytes, whatever peak came before
+    AllocationTracker::freed(700);
+    AllocationScope next;
+    AllocationTracker::allocated(10);
+    ASSERT_EQ(next.stats().peakBytes, 10);
+    AllocationTracker::freed(10);
+    ASSERT_EQ(AllocationTracker::liveBytes(), live);
+}
+
+// Processors sharing one arena, as the frames of a service: the next frames
+// run in the buffers of the first one and the results are unchanged.
+TEST(ImageProcessing, ScratchArenaReuse) {
+    auto arena = std::make_shared<ScratchArena>();
+    auto topValues = [](const cv::Mat& mat, std::vector<PixelCoord> pixels) {
+        std::vector<uint16_t> values;
+        for (const auto& p : pixels) values.push_back(mat.at<uint16_t>(p.y, p.x));
+        std::sort(values.begin(), values.end(), std::greater<uint16_t>());
+        return values;
+    };
+    auto expected = [](const cv::Mat& mat, size_t n) {
+        std::vector<uint16_t> all(mat.ptr<uint16_t>(0), mat.ptr<uint16_t>(0) + mat.total());
+        std::sort(all.begin(), all.end(), std::greater<uint16_t>());
+        all.resize(n);
+        return all;
+    };
+
+    const uint32_t* candidateRow = nullptr;
+    const uint32_t* counts = nullptr;
+    size_t bucketCount = 0;
+    for (int frame = 0; frame < 3; ++frame) {
+        cv::Mat mat(300, 260, CV_16U);
+        cv::randu(mat, cv::Scalar(0), cv::Scalar(frame == 0 ? 60000 : 900));
+        ImageWrapper<uint16_t> img(mat);
+        ImageProcessor<uint16_t> ip(img);
+        ip.setScratchArena(arena);
+        ImageProcessor<uint16_t> own(img); // its own arena: the reference
+
+        for (size_t topN : {1u, 77u, 5000u}) {
+            ASSERT_EQ(topValues(mat, ip.processImageParallelV1(topN)), expected(mat, topN));
+            ASSERT_EQ(topValues(mat, ip.processImageParallelWithTiling(topN, 64)), expected(mat, topN));
+            ASSERT_EQ(topValues(mat, ip.processImagePackedKeys(topN)), expected(mat, topN));
+            // the set family on pmr nodes: the same answer as on an arena of its own
+            std::vector<PixelCoord> shared = ip.processImageSetNice(topN);
+            std::vector<PixelCoord> reference = own.processImageSetNice(topN);
+            ASSERT_TRUE(comparePixelCoord(shared, reference));
+            shared = ip.processImageSetCopy(topN);
+            reference = own.processImageSetCopy(topN);
+            ASSERT_TRUE(comparePixelCoord(shared, reference));
+        }
+        ASSERT_EQ(topValues(mat, ip.processImageCS(300)), expected(mat, 300));
+        ASSERT_EQ(topValues(mat, ip.processImageHistogramSelect(300)), expected(mat, 300));
+
+        if (frame == 0) {
+            candidateRow = arena->candidates(0).data();
+            bucketCount = arena->buckets(0).size();
+            counts = arena->histogram(65536).data();
+        }
+        // same frame size: the rows are not reallocated, the buckets of the
+        // first frame (values up to 60000) serve the next ones
+        ASSERT_EQ(arena->candidates(0).data(), candidateRow);
+        ASSERT_EQ(arena->buckets(0).size(), bucketCount);
+        ASSERT_EQ(arena->histogram(65536).data(), counts);
+    }
+    ASSERT_GT(bucketCount, 900u);
+
+    // arena busy with another call: the processor runs on a temporary one
+    cv::Mat mat(50, 40, CV_16U);
+    cv::randu(mat, cv::Scalar(0), cv::Scalar(1000));
+    ImageWrapper<uint16_t> img(mat);
+    ImageProcessor<uint16_t> ip(img);
+    ip.setScratchArena(arena);
+    size_t reserved = arena->reservedBytes();
+    {
+        ScratchArena::Lease held(arena);
+        ASSERT_EQ(topValues(mat, ip.processImageParallelV1(30)), expected(mat, 30));
+    }
+    ASSERT_EQ(arena->reservedBytes(), reserved);
+
+    arena->release();
+    ASSERT_EQ(arena->reservedBytes(), 0u);
+    ASSERT_EQ(topValues(mat, ip.processImageParallelV1(30)), expected(mat, 30));
+}
+
 // Performance test
 TEST(ImageProcessingPerformance, processImageHeap) {
     std::vector<std::tuple<uint16_t, int, int>> pixels 
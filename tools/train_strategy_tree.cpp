@@ -0,0 +1,293 @@
+/*
+ * Trains the strategy decision tree of processImage from the CSV written by
+ * bench (matrix_data.csv) and emits it as include/strategy_tree.h.
+ *
+ *   train_strategy_tree <matrix_data.csv> <strategy_tree.h> [methods] [max_depth]
+ *
+ * methods, comma separated Strategy names, are the candidates of the tree:
+ * every method of the Method column by default, except the rows of IDMethod
+ * -1 (bench members that are not a processImage strategy). CSVs without that
+ * column (the former simulate() output) name IDMethod 0, 1, ... by methods,
+ * HeapBest,ParallelV512,CountingSort by default.
+ *
+ * Runs of the same Type, Dimension and topN form one sample, with the
+ * ExecTime of every method. The tree is a CART regression on the cost of the
+ * pick: a leaf picks the method with the lowest total time over its samples,
+ * a split is the (feature, threshold) that lowers that total the most.
+ * Features are those processImage has for free: pixels and topN / pixels.
+ * No dependency besides the standard library.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+
+
+namespace {
+
+constexpr int FEATURES = 2; // TREE_PIXELS, TREE_TOPN_RATIO of selector.h
+const char* const FEATURE_NAMES[FEATURES] = {"TREE_PIXELS", "TREE_TOPN_RATIO"};
+
+struct Sample {
+    double feature[FEATURES];
+    std::vector<double> time; // per method
+};
+
+struct Node {
+    int feature = -1;         // -1: leaf
+    double threshold = 0;
+    int left = -1;
+    int right = -1;
+    size_t method = 0;
+    size_t samples = 0;
+    double cost = 0;          // total time of the pick(s) below
+};
+
+std::vector<std::string> split(const std::string& text, char separator) {
+    std::vector<std::string> parts;
+    std::stringstream stream(text);
+    std::string part;
+    while (std::getline(stream, part, separator)) {
+        if (!part.empty() && part.back() == '\r') {
+            part.pop_back();
+        }
+        parts.push_back(part);
+    }
+    return parts;
+}
+
+// names: the candidate methods, filled from the Method column when empty.
+std::vector<Sample> readSamples(const std::string& path, std::vector<std::string>& names) {
+    std::ifstream file(path);
+    if (!file.is_open()) {
+        throw std::runtime_error("Could not open " + path);
+    }
+
+    // Type,Dimension,topN,IDMethod,ExecTime,MemUsed,Cost[,Method,...]
+    std::string line;
+    std::getline(file, line);
+    std::vector<std::string> header = split(line, ',');
+    auto methodColumn = std::find(header.begin(), header.end(), "Method") - header.begin();
+    bool byName = methodColumn < static_cast<long>(header.size());
+    if (!byName && names.empty()) {
+        names = {"HeapBest", "ParallelV512", "CountingSort"};
+    }
+    bool collectNames = names.empty();
+
+    struct Row {
+        std::tuple<long, double, double> key;
+        size_t method;
+        double time;
+    };
+    std::vector<Row> rows;
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields = split(line, ',');
+        if (fields.size() < 5 || (byName && fields.size() <= static_cast<size_t>(methodColumn))) {
+            continue;
+        }
+        long type = std::stol(fields[0]);
+        double pixels = std::stod(fields[1]);
+        double topN = std::stod(fields[2]);
+        double time = std::stod(fields[4]);
+        long id = std::stol(fields[3]);
+        if (id < 0) {
+            continue; // no Strategy to emit
+        }
+        size_t method = static_cast<size_t>(id);
+        if (byName) {
+            const std::string& name = fields[methodColumn];
+            method = std::find(names.begin(), names.end(), name) - names.begin();
+            if (method == names.size() && collectNames) {
+                names.push_back(name);
+            }
+        }
+        if (method >= names.size() || pixels <= 0) {
+            continue;
+        }
+        rows.push_back({std::make_tuple(type, pixels, topN), method, time});
+    }
+
+    size_t methods = names.size();
+    std::map<std::tuple<long, double, double>, Sample> groups;
+    std::map<std::tuple<long, double, double>, std::vector<bool>> seen;
+    for (const Row& row : rows) {
+        Sample& sample = groups[row.key];
+        std::vector<bool>& found = seen[row.key];
+        if (sample.time.empty()) {
+            sample.feature[0] = std::get<1>(row.key);
+            sample.feature[1] = std::get<2>(row.key) / std::get<1>(row.key);
+            sample.time.assign(methods, 0);
+            found.assign(methods, false);
+        }
+        sample.time[row.method] += row.time; // repeated runs add up, the pick is the same
+        found[row.method] = true;
+    }
+
+    std::vector<Sample> samples;
+    for (auto& [key, sample] : groups) {
+        if (std::all_of(seen[key].begin(), seen[key].end(), [](bool b) { return b; })) {
+            samples.push_back(sample);
+        }
+    }
+    return samples;
+}
+
+// Method with the lowest total time over samples, and that total.
+std::pair<size_t, double> bestMethod(const std::vector<double>& totals) {
+    size_t best = 0;
+    for (size_t m = 1; m < totals.size(); ++m) {
+        if (totals[m] < totals[best]) best = m;
+    }
+    return {best, totals.empty() ? 0 : totals[best]};
+}
+
+class Trainer {
+public:
+    Trainer(size_t methods, size_t maxDepth, size_t minLeaf)
+        : methods(methods), maxDepth(maxDepth), minLeaf(minLeaf) {}
+
+    std::vector<Node> train(std::vector<Sample> samples) {
+        nodes.clear();
+        grow(samples, 0);
+        return nodes;
+    }
+
+private:
+    size_t methods;
+    size_t maxDepth;
+    size_t minLeaf;
+    std::vector<Node> nodes;
+
+    int grow(std::vector<Sample>& samples, size_t depth) {
+        std::vector<double> totals(methods, 0);
+        for (const Sample& s : samples) {
+            for (size_t m = 0; m < methods; ++m) totals[m] += s.time[m];
+        }
+        int index = static_cast<int>(nodes.size());
+        nodes.emplace_back();
+        auto [method, cost] = bestMethod(totals);
+        nodes[index].method = method;
+        nodes[index].cost = cost;
+        nodes[index].samples = samples.size();
+
+        if (depth >= maxDepth || samples.size() < 2 * minLeaf) {
+            return index;
+        }
+
+        // best split over both features, first found wins ties (deterministic)
+        int bestFeature = -1;
+        double bestThreshold = 0;
+        double bestCost = cost * (1 - 1e-9);
+        for (int f = 0; f < FEATURES; ++f) {
+            std::stable_sort(samples.begin(), samples.end(),
+                             [f](const Sample& a, const Sample& b) { return a.feature[f] < b.feature[f]; });
+            std::vector<double> left(methods, 0);
+            for (size_t i = 0; i + 1 < samples.size(); ++i) {
+                for (size_t m = 0; m < methods; ++m) left[m] += samples[i].time[m];
+                if (samples[i].feature[f] == samples[i + 1].feature[f]
+                    || i + 1 < minLeaf || samples.size() - i - 1 < minLeaf) {
+                    continue;
+                }
+                std::vector<double> right(methods);
+                for (size_t m = 0; m < methods; ++m) right[m] = totals[m] - left[m];
+                double splitCost = bestMethod(left).second + bestMethod(right).second;
+                if (splitCost < bestCost) {
+                    bestCost = splitCost;
+                    bestFeature = f;
+                    bestThreshold = (samples[i].feature[f] + samples[i + 1].feature[f]) / 2;
+                }
+            }
+        }
+        if (bestFeature < 0) {
+            return index;
+        }
+
+        std::vector<Sample> leftSamples, rightSamples;
+        for (const Sample& s : samples) {
+            (s.feature[bestFeature] <= bestThreshold ? leftSamples : rightSamples).push_back(s);
+        }
+        nodes[index].feature = bestFeature;
+        nodes[index].threshold = bestThreshold;
+        int left = grow(leftSamples, depth + 1);
+        int right = grow(rightSamples, depth + 1);
+        nodes[index].left = left;
+        nodes[index].right = right;
+        nodes[index].cost = nodes[left].cost + nodes[right].cost;
+        return index;
+    }
+};
+
+void writeHeader(const std::string& path, const std::vector<Node>& nodes, const std::vector<std::string>& names,
+                 const std::string& source, size_t samples, double oracleTime) {
+    std::ofstream out(path);
+    if (!out.is_open()) {
+        throw std::runtime_error("Could not open " + path);
+    }
+    out << "#pragma once\n\n"
+        << "// Generated by tools/train_strategy_tree from " << source.substr(source.find_last_of('/') + 1)
+        << ", do not edit:\n// make strategy_tree regenerates it.\n// ";
+    if (samples > 0) {
+        out << samples << " samples, " << nodes.size() << " nodes, total time " << std::fixed
+            << std::setprecision(3) << nodes[0].cost << " ms against " << oracleTime
+            << " ms\n// for the best pick of every sample.\n";
+    } else {
+        out << "No samples: the fixed ParallelV1 choice.\n";
+    }
+    out << "\n#include \"selector.h\"\n\n"
+        << "inline constexpr StrategyTreeNode STRATEGY_TREE[] = {\n";
+    out << std::setprecision(17) << std::defaultfloat;
+    for (size_t i = 0; i < nodes.size(); ++i) {
+        const Node& n = nodes[i];
+        if (n.feature < 0) {
+            out << "    {TREE_LEAF, 0, 0, 0, Strategy::" << names[n.method] << "},";
+        } else {
+            out << "    {" << FEATURE_NAMES[n.feature] << ", " << n.threshold << ", " << n.left << ", "
+                << n.right << ", Strategy::ParallelV1},";
+        }
+        out << " // " << i << "\n";
+    }
+    out << "};\n";
+}
+
+} // namespace
+
+
+int main(int argc, char** argv) {
+    if (argc < 3 || argc > 5) {
+        std::cerr << "Usage: " << argv[0] << " <matrix_data.csv> <strategy_tree.h> [methods] [max_depth]\n";
+        return 1;
+    }
+    try {
+        std::vector<std::string> names = argc > 3 ? split(argv[3], ',') : std::vector<std::string>();
+        size_t maxDepth = argc > 4 ? std::stoul(argv[4]) : 4;
+
+        std::vector<Sample> samples = readSamples(argv[1], names);
+        std::vector<Node> nodes;
+        double oracleTime = 0;
+        if (samples.empty()) {
+            // no data: keep the fixed choice
+            names = {"ParallelV1"};
+            nodes.emplace_back();
+        } else {
+            nodes = Trainer(names.size(), maxDepth, 2).train(samples);
+            for (const Sample& s : samples) {
+                oracleTime += *std::min_element(s.time.begin(), s.time.end());
+            }
+        }
+        writeHeader(argv[2], nodes, names, argv[1], samples.size(), oracleTime);
+        std::cout << "Tree of " << nodes.size() << " nodes from " << samples.size() << " samples written to "
+                  << argv[2] << "\n";
+    } catch (const std::exception& e) {
+        std::cerr << "Error occurred: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}